@@ -17,7 +17,7 @@ wrmsconv = 1e-4;
 #### Do NOT touch past here ####
 
 ## the version of this lasso script
-lasso_version = "1.7bin";
+lasso_version = "1.8bin";
 
 ## Read the binary file written by acpdb
 function [atoms,symbols,lmax,lname,explist,exprnlist,nrows,ncols,x,y,maxcoef,yaddnames,yadd] = readbin(filebin)
@@ -28,6 +28,15 @@ function [atoms,symbols,lmax,lname,explist,exprnlist,nrows,ncols,x,y,maxcoef,yad
   fid = fopen(filebin,"r");
 
   ## read all the info ##
+  ## precision of the terms: files with single-precision terms
+  ## (TRAINING DUMP SINGLE) start with the ACPDBF32 marker
+  xprec = "double";
+  if (strcmp(char(fread(fid,[1 8],"char")),"ACPDBF32"))
+    xprec = "single";
+  else
+    frewind(fid);
+  endif
+
   ## integers
   natoms = fread(fid,1,"uint64");
   nexp = fread(fid,1,"uint64");
@@ -44,6 +53,7 @@ function [atoms,symbols,lmax,lname,explist,exprnlist,nrows,ncols,x,y,maxcoef,yad
   printf("# %d rows\n",nrows);
   printf("# %d columns\n",ncols);
   printf("# %d additional method evaluations\n",naddsub);
+  printf("# %s precision terms\n",xprec);
 
   ## atom names
   atomstr = char(fread(fid,2*natoms,"char"));
@@ -73,7 +83,7 @@ function [atoms,symbols,lmax,lname,explist,exprnlist,nrows,ncols,x,y,maxcoef,yad
 
   ## large data arrays
   w = fread(fid,[nrows 1],"double");
-  x = fread(fid,[nrows ncols],"double");
+  x = fread(fid,[nrows ncols],xprec);
   yref = fread(fid,[nrows 1],"double");
   yempty = fread(fid,[nrows 1],"double");
   if (nadd > 0)
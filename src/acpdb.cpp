@@ -157,6 +157,11 @@ int main(int argc, char *argv[]) {
       globals::verbose = true;
     } else if (keyw == "QUIET") {
       globals::verbose = false;
+    } else if (keyw == "NTHREADS") {
+      std::string num = popstring(tokens);
+      if (!isinteger(num) || std::stoi(num) < 0)
+        throw std::runtime_error("Invalid number of threads in NTHREADS");
+      globals::nthreads = std::stoi(num);
     } else if (keyw == "SYSTEM") {
       std::string cmd = mergetokens(tokens);
       *os << "* SYSTEM: " << cmd << std::endl << std::endl;
@@ -226,11 +231,63 @@ int main(int argc, char *argv[]) {
       ts = trainset();
       ts.setdb(nullptr);
 
+      //// ATTACH file.s [AS alias.s] [READONLY]
+    } else if (keyw == "ATTACH") {
+      *os << "* ATTACH: attach a database file " << std::endl << std::endl;
+      std::string file = popstring(tokens);
+      std::string alias = "";
+      bool readonly = false;
+      while (!tokens.empty()){
+        std::string str = popstring(tokens,true);
+        if (str == "AS")
+          alias = popstring(tokens);
+        else if (str == "READONLY")
+          readonly = true;
+        else
+          throw std::runtime_error("Unknown keyword in ATTACH: " + str);
+      }
+      db.attach(*os,file,alias,readonly);
+      *os << std::endl;
+
+      //// DETACH alias.s
+    } else if (keyw == "DETACH") {
+      *os << "* DETACH: detach a database file " << std::endl << std::endl;
+      db.detach(*os,popstring(tokens));
+      *os << std::endl;
+
+      //// SIMILAR [TOL tol.r] [MERGE]
+    } else if (keyw == "SIMILAR") {
+      *os << "* SIMILAR: find near-duplicate structures " << std::endl << std::endl;
+      double tol = 1e-3;
+      bool merge = false;
+      while (!tokens.empty()){
+        std::string str = popstring(tokens,true);
+        if (str == "TOL")
+          tol = std::stod(popstring(tokens));
+        else if (str == "MERGE")
+          merge = true;
+        else
+          throw std::runtime_error("Unknown keyword in SIMILAR: " + str);
+      }
+      db.similar(*os,tol,merge);
+
       //// VERIFY
     } else if (keyw == "VERIFY") {
       *os << "* VERIFY: verify the consistency of the database " << std::endl << std::endl;
       db.verify(*os);
 
+      //// REPACK
+    } else if (keyw == "REPACK") {
+      *os << "* REPACK: rebuild the terms table and compact the database " << std::endl << std::endl;
+      db.repack(*os);
+
+      //// SQL
+    } else if (keyw == "SQL") {
+      std::string cmd = line.substr(3);
+      deblank(cmd);
+      *os << "* SQL: run a statement on the database " << std::endl << std::endl;
+      db.sql(*os,cmd);
+
       //// PRINT
     } else if (keyw == "PRINT"){
       if (!db)
@@ -387,19 +444,58 @@ int main(int argc, char *argv[]) {
 	std::unordered_map<std::string,std::string> kmap = map_keyword_pairs(*is,true);
 	ts.maxcoef(*os,kmap);
       } else if (category == "DUMP") {
-        ts.dump(*os,uname);
+	// keywords, and the numbers after a keyword are its arguments
+	std::unordered_map<std::string,std::string> kmap;
+	std::string key = "";
+	while (!name.empty()){
+	  if (isfloat(name) && !key.empty())
+	    kmap[key] += (kmap[key].empty()?"":" ") + name;
+	  else {
+	    uppercase(name);
+	    key = name;
+	    kmap[key] = "";
+	  }
+	  name = popstring(tokens);
+	}
+        ts.dump(*os,kmap);
       } else if (category == "GENERATE") {
-	bool maxcoef = true;
+	// the numbers before the first keyword are the lambda values,
+	// the numbers after a keyword are its arguments; all the words
+	// after REFERENCE are method names
 	std::vector<double> lambdav;
+	std::unordered_map<std::string,std::string> kmap;
+	std::string key = "";
+	while (!name.empty()){
+	  if (key == "REFERENCE")
+	    kmap[key] += (kmap[key].empty()?"":" ") + name;
+	  else if (isfloat(name)){
+	    if (key.empty())
+	      lambdav.push_back(std::stod(name));
+	    else
+	      kmap[key] += (kmap[key].empty()?"":" ") + name;
+	  } else {
+	    uppercase(name);
+	    key = name;
+	    kmap[key] = "";
+	  }
+	  name = popstring(tokens);
+	}
+	ts.generate(*os,lambdav,kmap);
+
+      } else if (category == "COMPRESS") {
+	// the number of properties, then the keywords
+	std::vector<double> nselv;
+	std::unordered_map<std::string,std::string> kmap;
 	while (!name.empty()){
-	  uppercase(name);
-	  if (name == "NOMAXCOEF")
-	    maxcoef = false;
-	  else
-	    lambdav.push_back(std::stod(name));
+	  if (isfloat(name))
+	    nselv.push_back(std::stod(name));
+	  else {
+	    uppercase(name);
+	    kmap[name] = "";
+	  }
 	  name = popstring(tokens);
 	}
-	ts.generate(*os,maxcoef,lambdav);
+	ts.compress(*os,nselv,kmap);
 
       } else {
         throw std::runtime_error("Unknown keyword after TRAINING");
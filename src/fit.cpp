@@ -0,0 +1,1147 @@
+/*
+Copyright (c) 2020 Alberto Otero de la Roza <aoterodelaroza@gmail.com>
+
+acpdb is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or (at
+your option) any later version.
+
+acpdb is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "fit.h"
+#include "globals.h"
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <thread>
+#include <random>
+#include <limits>
+#include <stdexcept>
+#include <exception>
+#include <string>
+
+// The least-squares problem with the term matrix. The working vector
+// of the coordinate descent is the residual r = y - x*c (nrows). If
+// m is not null, the squared residual of row i is multiplied by m[i]
+// (the number of times the row is repeated in a bootstrap sample).
+struct sparse_ls {
+  const sparsemat &x;
+  const double *y;
+  const double *m = nullptr;
+
+  unsigned long int ncols() const { return x.get_ncols(); }
+  unsigned long int nvec() const { return x.get_nrows(); }
+  void init(const double *beta, double *r) const {
+    x.mult(beta,r);
+    for (unsigned long int i = 0; i < x.get_nrows(); i++)
+      r[i] = y[i] - r[i];
+  }
+  double grad(unsigned long int j, const double *r) const { return x.dotcol(j,r,m); }
+  void update(unsigned long int j, double a, double *r) const { x.axpycol(j,a,r); }
+  void colnorm2(std::vector<double> &nrm) const { x.colnorm2(nrm,m); }
+  double ydot(unsigned long int j) const { return x.dotcol(j,y,m); }
+  double ynorm() const {
+    double s = 0.;
+    for (unsigned long int i = 0; i < x.get_nrows(); i++)
+      s += (m ? m[i] : 1.) * y[i] * y[i];
+    return std::sqrt(s);
+  }
+  // recalculated to avoid the accumulated error
+  double wrms(const double *beta, double *r) const {
+    x.mult(beta,r);
+    double s = 0.;
+    for (unsigned long int i = 0; i < x.get_nrows(); i++)
+      s += (m ? m[i] : 1.) * (y[i] - r[i]) * (y[i] - r[i]);
+    return std::sqrt(s);
+  }
+};
+
+// The least-squares problem with the normal equations. The working
+// vector is the gradient x^T * r = xty - G*c (ncols).
+struct gram_ls {
+  const gramsys &g;
+
+  unsigned long int ncols() const { return g.ncols; }
+  unsigned long int nvec() const { return g.ncols; }
+  void init(const double *beta, double *r) const {
+    for (unsigned long int j = 0; j < g.ncols; j++){
+      r[j] = g.xty[j];
+      for (unsigned long int k = 0; k < g.ncols; k++)
+	r[j] -= g.G[j*g.ncols+k] * beta[k];
+    }
+  }
+  double grad(unsigned long int j, const double *r) const { return r[j]; }
+  void update(unsigned long int j, double a, double *r) const {
+    const double *gj = g.G.data() + j * g.ncols;
+    for (unsigned long int k = 0; k < g.ncols; k++)
+      r[k] += a * gj[k];
+  }
+  void colnorm2(std::vector<double> &nrm) const {
+    nrm.resize(g.ncols);
+    for (unsigned long int j = 0; j < g.ncols; j++)
+      nrm[j] = g.G[j*g.ncols+j];
+  }
+  double ydot(unsigned long int j) const { return g.xty[j]; }
+  double ynorm() const { return std::sqrt(std::max(g.yty,0.)); }
+  // no scratch vector needed; same signature as sparse_ls
+  double wrms(const double *beta, double *) const {
+    return std::sqrt(gram_sse(g,beta));
+  }
+};
+
+// Number of threads to use in the fits
+int fit_nthreads(){
+  if (globals::nthreads > 0)
+    return globals::nthreads;
+  return std::max(1u,std::thread::hardware_concurrency());
+}
+
+// Calculate the normal equations. The columns in a block are
+// scattered into a dense buffer (row-major, nrows x block size) and
+// the dot products with all the columns to their right are
+// accumulated in one pass over the latter.
+void gram_build(const sparsemat &x, const double *y, gramsys &g, int nthreads){
+  const unsigned long int bufmax = 4194304; // elements in each thread's buffer
+  unsigned long int nrows = x.get_nrows(), ncols = x.get_ncols();
+  g.nrows = nrows;
+  g.ncols = ncols;
+  g.G.assign(ncols*ncols,0.);
+  g.xty.resize(ncols);
+  for (unsigned long int j = 0; j < ncols; j++)
+    g.xty[j] = x.dotcol(j,y);
+  g.yty = 0.;
+  for (unsigned long int i = 0; i < nrows; i++)
+    g.yty += y[i] * y[i];
+  if (ncols == 0) return;
+
+  // block size and number of blocks
+  unsigned long int nb = std::max(1ul,std::min(16ul,bufmax / std::max(nrows,1ul)));
+  unsigned long int nblock = (ncols + nb - 1) / nb;
+  nthreads = std::max(1,std::min(nthreads,(int) nblock));
+
+  // each thread does blocks ith, ith+nthreads, ...
+  auto work = [&](int ith){
+    std::vector<double> buf(nrows*nb,0.), col(nrows), s(nb);
+    for (unsigned long int ib = ith; ib < nblock; ib += nthreads){
+      unsigned long int j0 = ib * nb, j1 = std::min(ncols,j0 + nb);
+      for (unsigned long int j = j0; j < j1; j++){
+	std::fill(col.begin(),col.end(),0.);
+	x.axpycol(j,1.,col.data());
+	for (unsigned long int i = 0; i < nrows; i++)
+	  buf[i*nb+(j-j0)] = col[i];
+      }
+      for (unsigned long int k = j0; k < ncols; k++){
+	std::fill(s.begin(),s.end(),0.);
+	x.dotcols(k,buf.data(),nb,j1-j0,s.data());
+	for (unsigned long int j = j0; j < std::min(j1,k+1); j++){
+	  g.G[j*ncols+k] = s[j-j0];
+	  g.G[k*ncols+j] = s[j-j0];
+	}
+      }
+    }
+  };
+  if (nthreads == 1)
+    work(0);
+  else {
+    std::vector<std::thread> th;
+    for (int i = 0; i < nthreads; i++)
+      th.emplace_back(work,i);
+    for (int i = 0; i < nthreads; i++)
+      th[i].join();
+  }
+}
+
+// Sparse random projection of the rows (CountSketch)
+unsigned long int sketch_map(unsigned long int nrows, unsigned long int m, unsigned long int seed,
+			     const std::vector<int> *group, std::vector<uint32_t> &bucket,
+			     std::vector<double> &sign, std::vector<int> *sgroup/*=nullptr*/){
+  if (m == 0)
+    throw std::runtime_error("The number of rows in the sketch must be positive");
+  if (m > std::numeric_limits<uint32_t>::max())
+    throw std::runtime_error("Too many rows in the sketch");
+
+  // the range of buckets for each group, proportional to its number
+  // of rows and rounded by largest remainder, so the numbers add up
+  // to min(m,nrows), with at least one bucket per non-empty group
+  int ngroup = 1;
+  if (group)
+    for (unsigned long int i = 0; i < nrows; i++)
+      ngroup = std::max(ngroup,(*group)[i]+1);
+  std::vector<unsigned long int> ng(ngroup,0), mg(ngroup,0), offset(ngroup,0);
+  for (unsigned long int i = 0; i < nrows; i++)
+    ng[group ? (*group)[i] : 0]++;
+  unsigned long int mt = std::min(m,nrows), mtot = 0;
+  std::vector<double> quota(ngroup,0.);
+  std::vector<int> order;
+  for (int g = 0; g < ngroup; g++){
+    if (ng[g] == 0) continue;
+    quota[g] = (double) mt * ng[g] / nrows;
+    mg[g] = std::min(ng[g],std::max(1ul,(unsigned long int) quota[g]));
+    mtot += mg[g];
+    order.push_back(g);
+  }
+  std::stable_sort(order.begin(),order.end(),[&](int a, int b){ return quota[a] - mg[a] > quota[b] - mg[b]; });
+  for (bool more = true; mtot < mt && more;){
+    more = false;
+    for (int k = 0; k < order.size() && mtot < mt; k++){
+      if (mg[order[k]] < ng[order[k]]){
+	mg[order[k]]++;
+	mtot++;
+	more = true;
+      }
+    }
+  }
+  for (bool more = true; mtot > mt && more;){
+    more = false;
+    for (int k = (int) order.size() - 1; k >= 0 && mtot > mt; k--){
+      if (mg[order[k]] > 1){
+	mg[order[k]]--;
+	mtot--;
+	more = true;
+      }
+    }
+  }
+  for (int g = 1; g < ngroup; g++)
+    offset[g] = offset[g-1] + mg[g-1];
+
+  // random sign for each row
+  std::mt19937_64 gen(seed);
+  sign.resize(nrows);
+  for (unsigned long int i = 0; i < nrows; i++)
+    sign[i] = (gen() & 1) ? -1. : 1.;
+
+  // deal the rows of each group to its buckets in random order, so
+  // the bucket sizes differ by at most one. If there are as many
+  // buckets as rows, there are no collisions and the sketch is
+  // exact. The shuffle is written out because std::shuffle is not
+  // the same in all standard libraries.
+  std::vector<std::vector<unsigned long int>> rows(ngroup);
+  for (unsigned long int i = 0; i < nrows; i++)
+    rows[group ? (*group)[i] : 0].push_back(i);
+  bucket.resize(nrows);
+  for (int g = 0; g < ngroup; g++){
+    std::vector<unsigned long int> &r = rows[g];
+    for (unsigned long int k = r.size(); k > 1; k--)
+      std::swap(r[k-1],r[gen() % k]);
+    for (unsigned long int k = 0; k < r.size(); k++)
+      bucket[r[k]] = offset[g] + k % mg[g];
+  }
+  if (sgroup){
+    sgroup->resize(mtot);
+    for (int g = 0; g < ngroup; g++)
+      for (unsigned long int b = 0; b < mg[g]; b++)
+	(*sgroup)[offset[g]+b] = g;
+  }
+  return mtot;
+}
+
+// Apply the sketch to a vector
+void sketch_vector(const double *v, const std::vector<uint32_t> &bucket, const std::vector<double> &sign,
+		   unsigned long int m, double *out){
+  std::fill(out,out+m,0.);
+  for (unsigned long int i = 0; i < bucket.size(); i++)
+    out[bucket[i]] += sign[i] * v[i];
+}
+
+// Apply the sketch to the columns of a matrix
+void sketch_matrix(const sparsemat &x, const std::vector<uint32_t> &bucket, const std::vector<double> &sign,
+		   unsigned long int m, sparsemat &xk){
+  xk.clear(m,x.is_single());
+  std::vector<double> col(m);
+  for (unsigned long int j = 0; j < x.get_ncols(); j++){
+    std::fill(col.begin(),col.end(),0.);
+    x.scattercol(j,bucket.data(),sign.data(),col.data());
+    xk.add_column(col.data());
+  }
+}
+
+// Weighted residual for the coefficients in beta
+double fit_wrms(const sparsemat &x, const double *y, const double *beta){
+  std::vector<double> r(x.get_nrows());
+  return sparse_ls{x,y}.wrms(beta,r.data());
+}
+
+// Add the contribution of a dense block of rows to the normal
+// equations. The thread that owns column j calculates G(j,k) and
+// G(k,j) for k >= j, so no two threads write the same element.
+void gram_add(const double *xb, const double *yb, unsigned long int nr, gramsys &g, int nthreads){
+  unsigned long int ncols = g.ncols;
+  g.nrows += nr;
+  for (unsigned long int i = 0; i < nr; i++)
+    g.yty += yb[i] * yb[i];
+  if (ncols == 0 || nr == 0) return;
+  nthreads = std::max(1,std::min(nthreads,(int) ncols));
+
+  auto work = [&](int ith){
+    for (unsigned long int j = ith; j < ncols; j += nthreads){
+      const double *xj = xb + j * nr;
+      double s = 0.;
+      for (unsigned long int i = 0; i < nr; i++)
+	s += xj[i] * yb[i];
+      g.xty[j] += s;
+      for (unsigned long int k = j; k < ncols; k++){
+	const double *xk = xb + k * nr;
+	s = 0.;
+	for (unsigned long int i = 0; i < nr; i++)
+	  s += xj[i] * xk[i];
+	g.G[j*ncols+k] += s;
+	if (k != j)
+	  g.G[k*ncols+j] += s;
+      }
+    }
+  };
+  if (nthreads == 1)
+    work(0);
+  else {
+    std::vector<std::thread> th;
+    for (int i = 0; i < nthreads; i++)
+      th.emplace_back(work,i);
+    for (int i = 0; i < nthreads; i++)
+      th[i].join();
+  }
+}
+
+// Weighted sum of squared residuals from the normal equations:
+// |y - x*c|^2 = yty - 2 c^T xty + c^T G c
+double gram_sse(const gramsys &g, const double *beta){
+  double s = g.yty;
+  for (unsigned long int j = 0; j < g.ncols; j++){
+    if (beta[j] == 0.) continue;
+    double gc = 0.;
+    for (unsigned long int k = 0; k < g.ncols; k++)
+      gc += g.G[j*g.ncols+k] * beta[k];
+    s += beta[j] * (gc - 2. * g.xty[j]);
+  }
+  return std::max(s,0.);
+}
+
+// Soft-thresholding operator
+static double soft(double z, double lambda){
+  if (z > lambda)
+    return z - lambda;
+  else if (z < -lambda)
+    return z + lambda;
+  return 0.;
+}
+
+// One coordinate descent update of column j, with squared norm nj,
+// on the working vector r, with ridge penalty l2. Returns the change
+// in the derivative of the smooth terms with respect to beta[j] ((nj
+// + l2) * |delta|), used for the convergence test.
+template<class T>
+static double cd_update(const T &x, unsigned long int j, double nj, double lambda, double l2,
+			const double *maxc, double *beta, double *r){
+  if (nj == 0.){
+    beta[j] = 0.;
+    return 0.;
+  }
+  double bold = beta[j];
+  double bnew = soft(x.grad(j,r) + nj * bold,lambda) / (nj + l2);
+  if (maxc)
+    bnew = std::max(-maxc[j],std::min(maxc[j],bnew));
+  if (bnew == bold)
+    return 0.;
+  x.update(j,bold-bnew,r);
+  beta[j] = bnew;
+  return (nj + l2) * std::abs(bnew - bold);
+}
+
+// Violation of the optimality conditions for column j, given the
+// derivative g = x_j^T * r.
+static double kkt_violation(double g, double b, double lambda, double maxc){
+  if (b == 0.)
+    return std::max(0.,std::abs(g) - lambda);
+  double v = g - (b > 0. ? lambda : -lambda);
+  if (std::abs(b) >= maxc && v * b > 0.)
+    return 0.; // at the bound, pushing outwards
+  return std::abs(v);
+}
+
+// Solve the LASSO problem in penalized form by cyclic coordinate
+// descent. If scr is active, screen the columns before the sweeps
+// with the safe rule and, if the solution in beta is for a known
+// lambda_prev (>= 0), with the strong rule. If l2 > 0, add the ridge
+// penalty l2/2 * |c|^2 (elastic net). The elastic net is a LASSO
+// problem with x augmented by sqrt(l2) times the identity, so the
+// column norms in the safe rule are sqrt(|x_j|^2 + l2) and the
+// derivatives in the optimality conditions are x_j^T * r - l2 * c_j.
+template<class T>
+static int cd_penalized(const T &x, double lambda, double *beta, double *wrms,
+			const double *maxc, int maxit, double tol,
+			double lambda_prev=-1., screening *scr=nullptr, double l2=0.){
+  unsigned long int ncols = x.ncols();
+
+  // working vector for the initial guess
+  std::vector<double> r(x.nvec());
+  x.init(beta,r.data());
+
+  // column norms and the tolerance, relative to the largest
+  // lambda with a non-zero solution
+  std::vector<double> nrm;
+  x.colnorm2(nrm);
+  double lmax = 0.;
+  for (unsigned long int j = 0; j < ncols; j++)
+    lmax = std::max(lmax,std::abs(x.ydot(j)));
+  double thr = tol * std::max(lmax,1e-300);
+
+  // Screening of the columns with zero coefficient. Safe rule (El
+  // Ghaoui et al.): c_j = 0 if |x_j^T y| < lambda - |x_j| |y|
+  // (lmax - lambda) / lmax. Strong rule (Tibshirani et al.), using
+  // that x_j^T r changes at most by |lambda - lambda_prev|: c_j is
+  // likely zero if |x_j^T r(lambda_prev)| < lambda - |lambda -
+  // lambda_prev|. The screened columns are checked at the end.
+  std::vector<bool> keep(ncols,true);
+  if (scr && scr->active){
+    scr->nsafe = scr->nstrong = scr->nviol = 0;
+    double ynrm = x.ynorm();
+    for (unsigned long int j = 0; j < ncols; j++){
+      if (beta[j] != 0.) continue;
+      if (lmax > 0. && std::abs(x.ydot(j)) < lambda - std::sqrt(nrm[j] + l2) * ynrm * (lmax - lambda) / lmax){
+	keep[j] = false;
+	scr->nsafe++;
+      } else if (lambda_prev >= 0. && std::abs(x.grad(j,r.data())) < lambda - std::abs(lambda - lambda_prev)){
+	keep[j] = false;
+	scr->nstrong++;
+      }
+    }
+  }
+
+  // full sweeps to find the active set, then sweeps over the active
+  // set until convergence, then check the optimality conditions
+  // (first the columns in the sweeps, then the screened columns)
+  int it = 0;
+  std::vector<unsigned long int> active;
+  while (it < maxit){
+    it++;
+    double dmax = 0.;
+    for (unsigned long int j = 0; j < ncols; j++)
+      if (keep[j])
+	dmax = std::max(dmax,cd_update(x,j,nrm[j],lambda,l2,maxc,beta,r.data()));
+
+    if (dmax < thr){
+      double vmax = 0.;
+      for (unsigned long int j = 0; j < ncols; j++)
+	if (keep[j] && nrm[j] > 0.)
+	  vmax = std::max(vmax,kkt_violation(x.grad(j,r.data()) - l2 * beta[j],beta[j],lambda,maxc?maxc[j]:HUGE_VAL));
+      if (vmax < thr){
+	bool viol = false;
+	for (unsigned long int j = 0; j < ncols; j++){
+	  if (!keep[j] && nrm[j] > 0. && kkt_violation(x.grad(j,r.data()),0.,lambda,HUGE_VAL) >= thr){
+	    keep[j] = true;
+	    scr->nviol++;
+	    viol = true;
+	  }
+	}
+	if (!viol)
+	  break;
+      }
+    }
+
+    active.clear();
+    for (unsigned long int j = 0; j < ncols; j++)
+      if (beta[j] != 0.) active.push_back(j);
+    while (it < maxit){
+      it++;
+      dmax = 0.;
+      for (unsigned long int k = 0; k < active.size(); k++)
+	dmax = std::max(dmax,cd_update(x,active[k],nrm[active[k]],lambda,l2,maxc,beta,r.data()));
+      if (dmax < thr)
+	break;
+    }
+  }
+
+  // final residual
+  *wrms = x.wrms(beta,r.data());
+  return it;
+}
+
+// Solve the LASSO problem in constrained form. The 1-norm of the
+// solution decreases monotonically with lambda, so lambda is
+// bracketed by halving it from the smallest lambda that gives c = 0,
+// then bisected. Every solution is warm-started from the previous
+// one (the first from beta), and the unconstrained problem (lambda = 0) is solved only if
+// lambda becomes negligible before the 1-norm reaches norm1. Throws
+// if a penalized solution does not converge.
+template<class T>
+static double cd_constrained(const T &x, double norm1, double *beta, double *wrms, const double *maxc,
+			     screening *scr, double l2=0.){
+  const int maxbisect = 100;
+  const double ntol = 1e-8;
+  const double lfloor = 1e-12;
+  const int maxit = 100000;
+  const double tol = 1e-8;
+  unsigned long int ncols = x.ncols();
+  auto norm = [&]() -> double {
+    double s = 0.;
+    for (unsigned long int j = 0; j < ncols; j++)
+      s += std::abs(beta[j]);
+    return s;
+  };
+  auto solve = [&](double lam, double lprev){
+    if (cd_penalized(x,lam,beta,wrms,maxc,maxit,tol,lprev,scr,l2) >= maxit)
+      throw std::runtime_error("The coordinate descent did not converge in " + std::to_string(maxit) +
+			       " sweeps (lambda = " + std::to_string(lam) + ")");
+  };
+
+  // lambda for c = 0
+  double lmax = 0.;
+  for (unsigned long int j = 0; j < ncols; j++)
+    lmax = std::max(lmax,std::abs(x.ydot(j)));
+  if (norm1 <= 0. || lmax == 0.){
+    std::fill(beta,beta+ncols,0.);
+    solve(lmax,-1.);
+    return lmax;
+  }
+
+  // bracket lambda between llo (1-norm above norm1) and lhi; the
+  // strong rule needs the solution at the previous lambda, so it is
+  // not used in the first step unless the initial guess is zero
+  bool cold = std::all_of(beta,beta+ncols,[](double b){ return b == 0.; });
+  double lhi = lmax, llo = lmax, n = 0.;
+  for (;;){
+    llo = (llo > lfloor * lmax) ? 0.5 * llo : 0.;
+    solve(llo,(lhi < lmax || cold) ? lhi : -1.);
+    n = norm();
+    if (n >= norm1 || llo == 0.)
+      break;
+    lhi = llo;
+  }
+  if (n <= norm1 || std::abs(n - norm1) <= ntol * norm1)
+    return llo;
+
+  // bisection, warm-starting from the previous solution
+  double lam = llo, lprev = llo;
+  for (int i = 0; i < maxbisect; i++){
+    lam = 0.5 * (llo + lhi);
+    solve(lam,lprev);
+    lprev = lam;
+    n = norm();
+    if (std::abs(n - norm1) <= ntol * norm1)
+      break;
+    if (n > norm1)
+      llo = lam;
+    else
+      lhi = lam;
+  }
+  return lam;
+}
+
+// Solve the LASSO problem in penalized form with the term matrix.
+int lasso_cd_penalized(const sparsemat &x, const double *y, double lambda, double *beta, double *wrms,
+		       const double *maxc/*=nullptr*/, int maxit/*=100000*/, double tol/*=1e-8*/,
+		       screening *scr/*=nullptr*/){
+  return cd_penalized(sparse_ls{x,y},lambda,beta,wrms,maxc,maxit,tol,-1.,scr);
+}
+
+// Solve the LASSO problem in constrained form with the term matrix.
+double lasso_cd(const sparsemat &x, const double *y, double norm1, double *beta, double *wrms,
+		const double *maxc/*=nullptr*/, screening *scr/*=nullptr*/, double l2/*=0.*/){
+  return cd_constrained(sparse_ls{x,y},norm1,beta,wrms,maxc,scr,l2);
+}
+
+// Solve the LASSO problem in penalized form with the normal equations.
+int lasso_gram_penalized(const gramsys &g, double lambda, double *beta, double *wrms,
+			 const double *maxc/*=nullptr*/, int maxit/*=100000*/, double tol/*=1e-8*/,
+			 screening *scr/*=nullptr*/){
+  return cd_penalized(gram_ls{g},lambda,beta,wrms,maxc,maxit,tol,-1.,scr);
+}
+
+// Solve the LASSO problem in constrained form with the normal equations.
+double lasso_gram(const gramsys &g, double norm1, double *beta, double *wrms,
+		  const double *maxc/*=nullptr*/, screening *scr/*=nullptr*/, double l2/*=0.*/){
+  return cd_constrained(gram_ls{g},norm1,beta,wrms,maxc,scr,l2);
+}
+
+// Normal equations of the training rows of a cross-validation fold:
+// the total minus the fold's.
+static void gram_train(const gramsys &g, const gramsys &gf, gramsys &gt){
+  gt = g;
+  gt.nrows -= gf.nrows;
+  for (unsigned long int k = 0; k < g.G.size(); k++)
+    gt.G[k] -= gf.G[k];
+  for (unsigned long int j = 0; j < g.ncols; j++)
+    gt.xty[j] -= gf.xty[j];
+  gt.yty -= gf.yty;
+}
+
+// Run work(k) for the tasks k = 0 ... ntask-1 (e.g. folds),
+// distributed over nthreads threads in turn. An exception in a task
+// is rethrown after all the threads have finished.
+template<class F>
+static void run_tasks(unsigned long int ntask, int nthreads, const F &work){
+  nthreads = std::max(1,std::min(nthreads,(int) ntask));
+  std::vector<std::exception_ptr> err(nthreads);
+  auto loop = [&](int ith){
+    try {
+      for (unsigned long int k = ith; k < ntask; k += nthreads)
+	work(k);
+    } catch (...) {
+      err[ith] = std::current_exception();
+    }
+  };
+  if (nthreads == 1)
+    loop(0);
+  else {
+    std::vector<std::thread> th;
+    for (int i = 0; i < nthreads; i++)
+      th.emplace_back(loop,i);
+    for (int i = 0; i < nthreads; i++)
+      th[i].join();
+  }
+  for (int i = 0; i < nthreads; i++)
+    if (err[i])
+      std::rethrow_exception(err[i]);
+}
+
+// Cross-validation of the constrained LASSO path on the normal
+// equations. The training problem for each fold is obtained by
+// subtracting the fold's normal equations from the total.
+void lasso_gram_cv(const gramsys &g, const std::vector<gramsys> &gfold, const std::vector<double> &norm1,
+		   const double *maxc, int nthreads, std::vector<double> &sse, bool screen/*=false*/,
+		   double l2/*=0.*/){
+  unsigned long int nfold = gfold.size(), nlam = norm1.size();
+  sse.assign(nfold*nlam,0.);
+  if (nfold == 0 || nlam == 0) return;
+
+  run_tasks(nfold,nthreads,[&](unsigned long int f){
+    gramsys gt;
+    gram_train(g,gfold[f],gt);
+    std::vector<double> beta(g.ncols,0.);
+    double wrms;
+    screening scr;
+    scr.active = screen;
+    for (unsigned long int l = 0; l < nlam; l++){
+      lasso_gram(gt,norm1[l],beta.data(),&wrms,maxc,&scr,l2);
+      sse[f*nlam+l] = gram_sse(gfold[f],beta.data());
+    }
+  });
+}
+
+// Eigenvalues (d) and eigenvectors of the symmetric n x n matrix in
+// v, which are returned in the columns of v (v[k*n+j] is element k of
+// eigenvector j). Householder reduction to tridiagonal form followed
+// by the implicit QL algorithm (tred2 and tql2 from EISPACK).
+static void symm_eigen(unsigned long int n, std::vector<double> &v, std::vector<double> &d){
+  d.assign(n,0.);
+  if (n == 0) return;
+  std::vector<double> e(n,0.);
+  auto V = [&](unsigned long int i, unsigned long int j) -> double& { return v[i*n+j]; };
+
+  // tridiagonalization
+  for (unsigned long int j = 0; j < n; j++)
+    d[j] = V(n-1,j);
+  for (unsigned long int i = n-1; i > 0; i--){
+    double scale = 0., h = 0.;
+    for (unsigned long int k = 0; k < i; k++)
+      scale += std::abs(d[k]);
+    if (scale == 0.){
+      e[i] = d[i-1];
+      for (unsigned long int j = 0; j < i; j++){
+	d[j] = V(i-1,j);
+	V(i,j) = 0.;
+	V(j,i) = 0.;
+      }
+    } else {
+      for (unsigned long int k = 0; k < i; k++){
+	d[k] /= scale;
+	h += d[k] * d[k];
+      }
+      double f = d[i-1];
+      double g = std::sqrt(h);
+      if (f > 0.) g = -g;
+      e[i] = scale * g;
+      h -= f * g;
+      d[i-1] = f - g;
+      for (unsigned long int j = 0; j < i; j++)
+	e[j] = 0.;
+      for (unsigned long int j = 0; j < i; j++){
+	f = d[j];
+	V(j,i) = f;
+	g = e[j] + V(j,j) * f;
+	for (unsigned long int k = j+1; k <= i-1; k++){
+	  g += V(k,j) * d[k];
+	  e[k] += V(k,j) * f;
+	}
+	e[j] = g;
+      }
+      f = 0.;
+      for (unsigned long int j = 0; j < i; j++){
+	e[j] /= h;
+	f += e[j] * d[j];
+      }
+      double hh = f / (h + h);
+      for (unsigned long int j = 0; j < i; j++)
+	e[j] -= hh * d[j];
+      for (unsigned long int j = 0; j < i; j++){
+	f = d[j];
+	g = e[j];
+	for (unsigned long int k = j; k <= i-1; k++)
+	  V(k,j) -= (f * e[k] + g * d[k]);
+	d[j] = V(i-1,j);
+	V(i,j) = 0.;
+      }
+    }
+    d[i] = h;
+  }
+
+  // accumulate the transformations
+  for (unsigned long int i = 0; i < n-1; i++){
+    V(n-1,i) = V(i,i);
+    V(i,i) = 1.;
+    double h = d[i+1];
+    if (h != 0.){
+      for (unsigned long int k = 0; k <= i; k++)
+	d[k] = V(k,i+1) / h;
+      for (unsigned long int j = 0; j <= i; j++){
+	double g = 0.;
+	for (unsigned long int k = 0; k <= i; k++)
+	  g += V(k,i+1) * V(k,j);
+	for (unsigned long int k = 0; k <= i; k++)
+	  V(k,j) -= g * d[k];
+      }
+    }
+    for (unsigned long int k = 0; k <= i; k++)
+      V(k,i+1) = 0.;
+  }
+  for (unsigned long int j = 0; j < n; j++){
+    d[j] = V(n-1,j);
+    V(n-1,j) = 0.;
+  }
+  V(n-1,n-1) = 1.;
+  e[0] = 0.;
+
+  // implicit QL iterations on the tridiagonal matrix
+  for (unsigned long int i = 1; i < n; i++)
+    e[i-1] = e[i];
+  e[n-1] = 0.;
+  double f = 0., tst1 = 0.;
+  const double eps = std::numeric_limits<double>::epsilon();
+  for (unsigned long int l = 0; l < n; l++){
+    tst1 = std::max(tst1,std::abs(d[l]) + std::abs(e[l]));
+    unsigned long int m = l;
+    while (m < n-1 && std::abs(e[m]) > eps * tst1)
+      m++;
+    if (m > l){
+      do {
+	double g = d[l];
+	double p = (d[l+1] - g) / (2. * e[l]);
+	double r = std::hypot(p,1.);
+	if (p < 0.) r = -r;
+	d[l] = e[l] / (p + r);
+	d[l+1] = e[l] * (p + r);
+	double dl1 = d[l+1];
+	double h = g - d[l];
+	for (unsigned long int i = l+2; i < n; i++)
+	  d[i] -= h;
+	f += h;
+
+	p = d[m];
+	double c = 1., c2 = 1., c3 = 1., s = 0., s2 = 0.;
+	double el1 = e[l+1];
+	for (unsigned long int i = m; i-- > l;){
+	  c3 = c2;
+	  c2 = c;
+	  s2 = s;
+	  g = c * e[i];
+	  h = c * p;
+	  r = std::hypot(p,e[i]);
+	  e[i+1] = s * r;
+	  s = e[i] / r;
+	  c = p / r;
+	  p = c * d[i] - s * g;
+	  d[i+1] = h + s * (c * g + s * d[i]);
+	  for (unsigned long int k = 0; k < n; k++){
+	    h = V(k,i+1);
+	    V(k,i+1) = s * V(k,i) + c * h;
+	    V(k,i) = c * V(k,i) - s * h;
+	  }
+	}
+	p = -s * s2 * c3 * el1 * e[l] / dl1;
+	e[l] = s * p;
+	d[l] = c * p;
+      } while (std::abs(e[l]) > eps * tst1);
+    }
+    d[l] += f;
+    e[l] = 0.;
+  }
+}
+
+// Ridge path from the eigendecomposition G = V*D*V^T: with z = V^T *
+// xty, c = V * (D + lambda)^-1 * z. The eigenvalues below a relative
+// tolerance (the null space of G) are left out at lambda = 0.
+void ridge_gram_path(const gramsys &g, const std::vector<double> &lam, std::vector<double> &beta,
+		     std::vector<double> &wrms){
+  const double eigtol = 1e-12;
+  unsigned long int n = g.ncols, nlam = lam.size();
+  beta.assign(nlam*n,0.);
+  wrms.assign(nlam,0.);
+  for (unsigned long int l = 0; l < nlam; l++)
+    if (lam[l] < 0.)
+      throw std::runtime_error("The ridge penalty must be positive or zero");
+
+  std::vector<double> v(g.G), d;
+  symm_eigen(n,v,d);
+  double dmax = 0.;
+  for (unsigned long int j = 0; j < n; j++)
+    dmax = std::max(dmax,std::abs(d[j]));
+  std::vector<double> z(n,0.);
+  for (unsigned long int k = 0; k < n; k++)
+    for (unsigned long int j = 0; j < n; j++)
+      z[j] += v[k*n+j] * g.xty[k];
+
+  std::vector<double> t(n);
+  for (unsigned long int l = 0; l < nlam; l++){
+    for (unsigned long int j = 0; j < n; j++){
+      double den = d[j] + lam[l];
+      t[j] = (den > eigtol * std::max(dmax,1e-300)) ? z[j] / den : 0.;
+    }
+    double *b = beta.data() + l * n;
+    for (unsigned long int k = 0; k < n; k++){
+      double s = 0.;
+      for (unsigned long int j = 0; j < n; j++)
+	s += v[k*n+j] * t[j];
+      b[k] = s;
+    }
+    wrms[l] = std::sqrt(gram_sse(g,b));
+  }
+}
+
+// Cross-validation of the ridge path: one eigendecomposition per
+// fold.
+void ridge_gram_cv(const gramsys &g, const std::vector<gramsys> &gfold, const std::vector<double> &lam,
+		   int nthreads, std::vector<double> &sse){
+  unsigned long int nfold = gfold.size(), nlam = lam.size();
+  sse.assign(nfold*nlam,0.);
+  if (nfold == 0 || nlam == 0) return;
+
+  run_tasks(nfold,nthreads,[&](unsigned long int f){
+    gramsys gt;
+    gram_train(g,gfold[f],gt);
+    std::vector<double> beta, wrms;
+    ridge_gram_path(gt,lam,beta,wrms);
+    for (unsigned long int l = 0; l < nlam; l++)
+      sse[f*nlam+l] = gram_sse(gfold[f],beta.data()+l*g.ncols);
+  });
+}
+
+// Bootstrap of the constrained LASSO fit. The sample of replicate b
+// is drawn with a generator seeded with (seed, b), so it does not
+// depend on the thread that fits it. The samples are represented as
+// row multiplicities on the shared term matrix.
+void lasso_bootstrap(const sparsemat &x, const double *y, const std::vector<int> &group, int nboot,
+		     unsigned long int seed, double norm1, const double *beta0, const double *maxc,
+		     double l2, int nthreads, std::vector<double> &beta){
+  unsigned long int nrows = x.get_nrows(), ncols = x.get_ncols();
+  if (group.size() != nrows)
+    throw std::runtime_error("Inconsistent number of rows in the bootstrap");
+  beta.assign((unsigned long int) std::max(nboot,0)*ncols,0.);
+  if (nboot <= 0 || nrows == 0) return;
+  int ngroup = 0;
+  for (unsigned long int i = 0; i < nrows; i++)
+    ngroup = std::max(ngroup,group[i]+1);
+
+  run_tasks(nboot,nthreads,[&](unsigned long int b){
+    std::seed_seq sq{(uint64_t) seed,(uint64_t) b};
+    std::mt19937_64 gen(sq);
+    std::uniform_int_distribution<int> dist(0,ngroup-1);
+    std::vector<double> count(ngroup,0.), m(nrows);
+    for (int k = 0; k < ngroup; k++)
+      count[dist(gen)] += 1.;
+    for (unsigned long int i = 0; i < nrows; i++)
+      m[i] = count[group[i]];
+
+    double *bb = beta.data() + b * ncols;
+    double wrms;
+    std::copy(beta0,beta0+ncols,bb);
+    cd_constrained(sparse_ls{x,y,m.data()},norm1,bb,&wrms,maxc,nullptr,l2);
+  });
+}
+
+// Grid of constrained LASSO fits for several targets. Each
+// (target, norm1) problem is a task with its own residual vector on
+// the shared term matrix.
+void lasso_grid(const sparsemat &x, const std::vector<double> &y, const std::vector<double> &norm1,
+		const double *maxc, double l2, bool screen, int nthreads, std::vector<double> &beta,
+		std::vector<double> &wrms, std::vector<unsigned long int> &nscr){
+  unsigned long int nrows = x.get_nrows(), ncols = x.get_ncols(), nlam = norm1.size();
+  if (nrows == 0 || y.size() % nrows != 0)
+    throw std::runtime_error("Inconsistent number of rows in the LASSO grid");
+  unsigned long int ntask = (y.size() / nrows) * nlam;
+  beta.assign(ntask*ncols,0.);
+  wrms.assign(ntask,0.);
+  nscr.assign(ntask,0);
+  if (ntask == 0) return;
+
+  run_tasks(ntask,nthreads,[&](unsigned long int k){
+    unsigned long int t = k / nlam, l = k % nlam;
+    screening scr;
+    scr.active = screen;
+    cd_constrained(sparse_ls{x,y.data()+t*nrows},norm1[l],beta.data()+k*ncols,&wrms[k],maxc,&scr,l2);
+    nscr[k] = scr.nscreened();
+  });
+}
+
+// Leverages of the rows from the eigendecomposition G = V*D*V^T of
+// the normal equations: h_i = sum_j (x_i^T v_j)^2 / d_j, leaving out
+// the null space of G. One pass over x for each eigenvector.
+void row_leverage(const sparsemat &x, const gramsys &g, std::vector<double> &h){
+  const double eigtol = 1e-12;
+  unsigned long int n = g.ncols, nrows = x.get_nrows();
+  h.assign(nrows,0.);
+  std::vector<double> v(g.G), d;
+  symm_eigen(n,v,d);
+  double dmax = 0.;
+  for (unsigned long int j = 0; j < n; j++)
+    dmax = std::max(dmax,std::abs(d[j]));
+
+  std::vector<double> vj(n), xv(nrows);
+  for (unsigned long int j = 0; j < n; j++){
+    if (d[j] <= eigtol * std::max(dmax,1e-300)) continue;
+    for (unsigned long int k = 0; k < n; k++)
+      vj[k] = v[k*n+j];
+    x.mult(vj.data(),xv.data());
+    for (unsigned long int i = 0; i < nrows; i++)
+      h[i] += xv[i] * xv[i] / d[j];
+  }
+}
+
+// Greedy D-optimal design. The information matrix of the selected
+// rows, M = delta*I + sum_i x_i * x_i^T, is kept as its inverse, and
+// d_i = x_i^T * M^-1 * x_i is kept for all the rows. Adding row a
+// changes log det M by log(1 + d_a), and the Sherman-Morrison update
+// with u = M^-1 * x_a gives d_i <- d_i - (x_i^T * u)^2 / (1 + d_a),
+// so each step costs one pass over x plus O(ncols^2) per row added.
+// The score of a group is sum log(1 + d_i) over its rows, which is
+// the exact gain for single-row groups and an upper bound otherwise.
+void dopt_select(const sparsemat &x, const std::vector<int> &group, unsigned long int nsel,
+		 std::vector<int> &sel){
+  unsigned long int nrows = x.get_nrows(), ncols = x.get_ncols();
+  if (group.size() != nrows)
+    throw std::runtime_error("Inconsistent number of rows in the D-optimal design");
+  int ngroup = 0;
+  for (unsigned long int i = 0; i < nrows; i++)
+    ngroup = std::max(ngroup,group[i]+1);
+  sel.clear();
+  if (ncols == 0 || ngroup == 0) return;
+
+  // rows of each group, and the rows of x as columns of xt
+  std::vector<std::vector<unsigned long int>> grows(ngroup);
+  for (unsigned long int i = 0; i < nrows; i++)
+    grows[group[i]].push_back(i);
+  sparsemat xt;
+  x.transpose(xt);
+  std::vector<double> d;
+  xt.colnorm2(d);
+  double tr = 0.;
+  for (unsigned long int i = 0; i < nrows; i++)
+    tr += d[i];
+  double delta = 1e-6 * std::max(tr / ncols,1e-300);
+
+  // initial M^-1 = I/delta and d_i = |x_i|^2/delta
+  std::vector<double> minv(ncols*ncols,0.), xa(ncols), u(ncols), z(nrows);
+  for (unsigned long int j = 0; j < ncols; j++)
+    minv[j*ncols+j] = 1. / delta;
+  for (unsigned long int i = 0; i < nrows; i++)
+    d[i] /= delta;
+
+  std::vector<bool> used(ngroup,false);
+  nsel = std::min(nsel,(unsigned long int) ngroup);
+  while (sel.size() < nsel){
+    // the group with the largest gain
+    int gbest = -1;
+    double best = -1.;
+    for (int g = 0; g < ngroup; g++){
+      if (used[g] || grows[g].empty()) continue;
+      double s = 0.;
+      for (unsigned long int k = 0; k < grows[g].size(); k++)
+	s += std::log1p(std::max(d[grows[g][k]],0.));
+      if (s > best){
+	best = s;
+	gbest = g;
+      }
+    }
+    if (gbest < 0) break;
+    used[gbest] = true;
+    sel.push_back(gbest);
+
+    // add its rows to M
+    for (unsigned long int k = 0; k < grows[gbest].size(); k++){
+      unsigned long int a = grows[gbest][k];
+      std::fill(xa.begin(),xa.end(),0.);
+      xt.axpycol(a,1.,xa.data());
+      double den = 1.;
+      for (unsigned long int j = 0; j < ncols; j++){
+	u[j] = 0.;
+	for (unsigned long int l = 0; l < ncols; l++)
+	  u[j] += minv[j*ncols+l] * xa[l];
+	den += u[j] * xa[j];
+      }
+      for (unsigned long int j = 0; j < ncols; j++)
+	for (unsigned long int l = 0; l < ncols; l++)
+	  minv[j*ncols+l] -= u[j] * u[l] / den;
+      x.mult(u.data(),z.data());
+      for (unsigned long int i = 0; i < nrows; i++)
+	d[i] -= z[i] * z[i] / den;
+    }
+  }
+  std::sort(sel.begin(),sel.end());
+}
+
+// Greedy forward selection (orthogonal matching pursuit). The
+// selected columns with free coefficients are kept in a thin QR
+// factorization (x_S = Q*R), extended by one column in each step
+// with classical Gram-Schmidt and reorthogonalization, and the
+// residual r = yf - Q*Q^T*yf is updated with the new column of Q. The
+// columns whose coefficient exceeds maxc are fixed at the bound,
+// subtracted from the target (yf), and the factorization is rebuilt
+// with the remaining free columns.
+unsigned long int omp_path(const sparsemat &x, const double *y, const std::vector<unsigned long int> &kv,
+			   const double *maxc, std::vector<double> &beta, std::vector<double> &wrms){
+  const double deptol = 1e-10; // relative norm of a linearly dependent column
+  unsigned long int nrows = x.get_nrows(), ncols = x.get_ncols();
+  unsigned long int kmax = 0;
+  for (unsigned long int i = 0; i < kv.size(); i++)
+    kmax = std::max(kmax,kv[i]);
+  beta.assign(kv.size()*ncols,0.);
+  wrms.assign(kv.size(),0.);
+
+  std::vector<double> nrm;
+  x.colnorm2(nrm);
+
+  // state: free columns in the factorization, fixed columns and
+  // their coefficients, Q (column-major), the columns of R, and Q^T*yf
+  std::vector<unsigned long int> freec;
+  std::vector<char> used(ncols,0); // 0 = available, 1 = selected, 2 = discarded
+  std::vector<double> c(ncols,0.), yf(y,y+nrows), r(nrows), v(nrows), h, q;
+  std::vector<std::vector<double>> rcol;
+  std::vector<double> qty;
+
+  // add column j to the factorization; false if it is linearly
+  // dependent on the columns already in it
+  auto append = [&](unsigned long int j) -> bool {
+    unsigned long int k = freec.size();
+    std::fill(v.begin(),v.end(),0.);
+    x.axpycol(j,1.,v.data());
+    h.assign(k+1,0.);
+    for (int pass = 0; pass < 2; pass++){
+      for (unsigned long int l = 0; l < k; l++){
+	const double *ql = q.data() + l * nrows;
+	double s = 0.;
+	for (unsigned long int i = 0; i < nrows; i++)
+	  s += ql[i] * v[i];
+	h[l] += s;
+	for (unsigned long int i = 0; i < nrows; i++)
+	  v[i] -= s * ql[i];
+      }
+    }
+    double rho = 0.;
+    for (unsigned long int i = 0; i < nrows; i++)
+      rho += v[i] * v[i];
+    rho = std::sqrt(rho);
+    if (rho <= deptol * std::sqrt(nrm[j]))
+      return false;
+    h[k] = rho;
+    double s = 0.;
+    for (unsigned long int i = 0; i < nrows; i++){
+      v[i] /= rho;
+      s += v[i] * yf[i];
+    }
+    q.insert(q.end(),v.begin(),v.end());
+    rcol.push_back(h);
+    qty.push_back(s);
+    freec.push_back(j);
+    for (unsigned long int i = 0; i < nrows; i++)
+      r[i] -= s * v[i];
+    return true;
+  };
+
+  // coefficients of the free columns: R * c = Q^T * yf
+  auto solve = [&](){
+    unsigned long int k = freec.size();
+    std::vector<double> b(k);
+    for (long int l = (long int) k - 1; l >= 0; l--){
+      double s = qty[l];
+      for (unsigned long int m = l+1; m < k; m++)
+	s -= rcol[m][l] * b[m];
+      b[l] = s / rcol[l][l];
+    }
+    for (unsigned long int l = 0; l < k; l++)
+      c[freec[l]] = b[l];
+  };
+
+  unsigned long int nsel = 0;
+  auto save = [&](){
+    for (unsigned long int i = 0; i < kv.size(); i++){
+      if (kv[i] != nsel) continue;
+      std::copy(c.begin(),c.end(),beta.begin()+i*ncols);
+      wrms[i] = fit_wrms(x,y,c.data());
+    }
+  };
+
+  std::copy(yf.begin(),yf.end(),r.begin());
+  while (nsel < kmax){
+    // the column most correlated with the residual
+    long int jbest = -1;
+    double best = 0.;
+    for (unsigned long int j = 0; j < ncols; j++){
+      if (used[j] || nrm[j] == 0. || (maxc && maxc[j] <= 0.)) continue;
+      double s = std::abs(x.dotcol(j,r.data())) / std::sqrt(nrm[j]);
+      if (s > best){
+	best = s;
+	jbest = j;
+      }
+    }
+    if (jbest < 0) break;
+    if (!append(jbest)){
+      used[jbest] = 2;
+      continue;
+    }
+    used[jbest] = 1;
+    nsel++;
+
+    // least-squares coefficients; fix the ones out of bounds and
+    // refactorize the rest
+    solve();
+    while (maxc){
+      bool fixed = false;
+      for (unsigned long int l = 0; l < freec.size(); l++){
+	unsigned long int j = freec[l];
+	if (std::abs(c[j]) > maxc[j]){
+	  c[j] = c[j] > 0. ? maxc[j] : -maxc[j];
+	  x.axpycol(j,-c[j],yf.data());
+	  freec[l] = ncols;
+	  fixed = true;
+	}
+      }
+      if (!fixed) break;
+      std::vector<unsigned long int> fc;
+      for (unsigned long int l = 0; l < freec.size(); l++)
+	if (freec[l] < ncols) fc.push_back(freec[l]);
+      freec.clear();
+      q.clear();
+      rcol.clear();
+      qty.clear();
+      std::copy(yf.begin(),yf.end(),r.begin());
+      for (unsigned long int l = 0; l < fc.size(); l++)
+	append(fc[l]);
+      solve();
+    }
+    save();
+  }
+
+  // the requests for more terms than could be selected
+  for (unsigned long int i = 0; i < kv.size(); i++){
+    if (kv[i] <= nsel) continue;
+    std::copy(c.begin(),c.end(),beta.begin()+i*ncols);
+    wrms[i] = fit_wrms(x,y,c.data());
+  }
+  return nsel;
+}
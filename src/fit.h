@@ -0,0 +1,238 @@
+// -*- c++-mode -*-
+/*
+Copyright (c) 2020 Alberto Otero de la Roza <aoterodelaroza@gmail.com>
+
+acpdb is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or (at
+your option) any later version.
+
+acpdb is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef FIT_H
+#define FIT_H
+
+#include "sparsemat.h"
+
+#include <vector>
+
+// The normal equations of a weighted least-squares problem with term
+// matrix x and target y, both already multiplied by the square root
+// of the weights: the Gram matrix G = x^T * x (ncols x ncols, stored
+// in full and column-major), xty = x^T * y, and yty = y^T * y. The
+// size of the normal equations is independent of the number of rows.
+struct gramsys {
+  unsigned long int nrows = 0; // number of rows in x
+  unsigned long int ncols = 0; // number of columns in x
+  std::vector<double> G; // Gram matrix
+  std::vector<double> xty; // x^T * y
+  double yty = 0.; // y^T * y
+};
+
+// Screening of the columns in the coordinate descent. If active,
+// the columns with zero coefficient that are sure (safe rule) or
+// likely (strong rule) to remain zero are left out of the sweeps,
+// and the optimality conditions of the screened columns are checked
+// at convergence. The counts are for the last penalized problem
+// solved.
+struct screening {
+  bool active = false; // use screening
+  unsigned long int nsafe = 0; // columns screened by the safe rule
+  unsigned long int nstrong = 0; // columns screened by the strong rule
+  unsigned long int nviol = 0; // screened columns put back after the check
+  unsigned long int nscreened() const { return nsafe + nstrong - nviol; }
+};
+
+// Number of threads to use in the fits: globals::nthreads, or the
+// number of hardware threads if it is zero.
+int fit_nthreads();
+
+// Calculate the normal equations for term matrix x and target y
+// (nrows). The columns of x are processed in blocks and the blocks
+// are distributed over nthreads threads. Each element of G is
+// calculated by a single thread, so the result does not depend on
+// the number of threads.
+void gram_build(const sparsemat &x, const double *y, gramsys &g, int nthreads);
+
+// Sparse random projection of the rows (CountSketch). Each row i of
+// the problem is added with a random sign (sign[i] = +/-1) to row
+// bucket[i] of the sketched problem, which has m rows. The rows are
+// spread evenly over the buckets, so the sketch is exact (a signed
+// permutation) if m >= nrows. If group is
+// not null, the rows of group g (e.g. a cross-validation fold) are
+// mapped only to a range of buckets reserved for g, proportional to
+// the number of rows in it (by largest remainder, at least one per
+// group), and the group of each sketched row is returned in sgroup.
+// The map depends only on the seed. Returns the number of rows in
+// the sketched problem: min(m,nrows), or the number of non-empty
+// groups if that is larger.
+unsigned long int sketch_map(unsigned long int nrows, unsigned long int m, unsigned long int seed,
+                             const std::vector<int> *group, std::vector<uint32_t> &bucket,
+                             std::vector<double> &sign, std::vector<int> *sgroup=nullptr);
+
+// Apply the sketch to vector v (nrows) and write the result to out
+// (m).
+void sketch_vector(const double *v, const std::vector<uint32_t> &bucket, const std::vector<double> &sign,
+                   unsigned long int m, double *out);
+
+// Apply the sketch to the columns of x and write the result to xk
+// (m rows, same precision as x).
+void sketch_matrix(const sparsemat &x, const std::vector<uint32_t> &bucket, const std::vector<double> &sign,
+                   unsigned long int m, sparsemat &xk);
+
+// Weighted residual |y - x*c| for the coefficients in beta.
+double fit_wrms(const sparsemat &x, const double *y, const double *beta);
+
+// Add the contribution of a block of nr rows of the term matrix
+// (xb, dense, nr x g.ncols, column-major) and the target (yb, nr) to
+// the normal equations in g. The columns are distributed over
+// nthreads threads.
+void gram_add(const double *xb, const double *yb, unsigned long int nr, gramsys &g, int nthreads);
+
+// Weighted sum of squared residuals |y - x*c|^2 for coefficients
+// beta, calculated from the normal equations.
+double gram_sse(const gramsys &g, const double *beta);
+
+// Solve the LASSO problem in penalized form with the term matrix in
+// x (nrows x ncols) and the target in y (nrows), both already
+// multiplied by the square root of the weights:
+//
+//   min_c 1/2 |y - x*c|^2 + lambda * |c|_1
+//
+// by cyclic coordinate descent. If maxc is not null, the
+// coefficients are bounded by |c_j| <= maxc[j]. On input, beta
+// (ncols) is the initial guess (use zeros if there is none, or the
+// solution for a nearby lambda). On output, beta contains the
+// coefficients and wrms = |y - x*c|. The iterations stop when the
+// optimality conditions are satisfied to within tol times the
+// largest |x_j^T * y|. If scr is not null and active, use screening
+// and return the screening counts in it. Returns the number of sweeps
+// over the columns.
+int lasso_cd_penalized(const sparsemat &x, const double *y, double lambda, double *beta, double *wrms,
+                       const double *maxc=nullptr, int maxit=100000, double tol=1e-8,
+                       screening *scr=nullptr);
+
+// Solve the LASSO problem in constrained form, with the same
+// arguments as lasso_cd_penalized:
+//
+//   min_c |y - x*c|^2  subject to  |c|_1 <= norm1
+//
+// The lambda of the equivalent penalized problem is bracketed by
+// halving it from the lambda that gives c = 0, and then found by
+// bisection, warm-starting each penalized solution from the previous
+// one. Same interface as lasso_c in liblasso. If l2 > 0, the ridge
+// penalty l2/2 * |c|^2 is added to the least-squares term (elastic
+// net). Returns the lambda. Throws std::runtime_error if one of the
+// penalized solutions does not converge.
+double lasso_cd(const sparsemat &x, const double *y, double norm1, double *beta, double *wrms,
+                const double *maxc=nullptr, screening *scr=nullptr, double l2=0.);
+
+// Solve the LASSO problem in penalized and constrained forms by
+// coordinate descent on the normal equations in g. Same arguments as
+// lasso_cd_penalized and lasso_cd, but each sweep costs O(ncols^2)
+// instead of O(nnz). The wrms is calculated from the normal
+// equations.
+int lasso_gram_penalized(const gramsys &g, double lambda, double *beta, double *wrms,
+                         const double *maxc=nullptr, int maxit=100000, double tol=1e-8,
+                         screening *scr=nullptr);
+double lasso_gram(const gramsys &g, double norm1, double *beta, double *wrms,
+                  const double *maxc=nullptr, screening *scr=nullptr, double l2=0.);
+
+// Cross-validation of the constrained LASSO path. g contains the
+// normal equations of the whole problem and gfold[f] those of the
+// rows in validation fold f. For each fold, fit the problems with
+// the 1-norm constraints in norm1 (in order, warm-starting from the
+// previous solution) using the rows not in the fold (g - gfold[f]),
+// and calculate the sum of squared residuals on the rows in the fold
+// (sse[f*norm1.size()+l]). The folds are distributed over nthreads
+// threads. If screen, use screening in the fits. l2 is the ridge
+// penalty of the elastic net.
+void lasso_gram_cv(const gramsys &g, const std::vector<gramsys> &gfold, const std::vector<double> &norm1,
+                   const double *maxc, int nthreads, std::vector<double> &sse, bool screen=false,
+                   double l2=0.);
+
+// Ridge regression on the normal equations in g:
+//
+//   min_c 1/2 |y - x*c|^2 + lambda/2 * |c|^2
+//
+// for all the lambda (>= 0) in lam. The Gram matrix is diagonalized
+// once and each solution costs O(ncols^2). The coefficients for
+// lam[l] are written to beta[l*ncols...] and the wrms to wrms[l].
+// The bounds on the coefficients are not applied.
+void ridge_gram_path(const gramsys &g, const std::vector<double> &lam, std::vector<double> &beta,
+                     std::vector<double> &wrms);
+
+// Cross-validation of the ridge path, with the same arguments as
+// lasso_gram_cv.
+void ridge_gram_cv(const gramsys &g, const std::vector<gramsys> &gfold, const std::vector<double> &lam,
+                   int nthreads, std::vector<double> &sse);
+
+// Bootstrap of the constrained LASSO fit (lasso_cd, with ridge
+// penalty l2 for the elastic net). In each of the nboot replicates,
+// the resampling units (the rows with the same group, e.g. the rows
+// of a property) are drawn with replacement as many times as there
+// are units, and the problem is refitted with each row counted as
+// many times as its unit was drawn, starting from beta0. The term
+// matrix is shared by all replicates, which are distributed over
+// nthreads threads. The random sample of each replicate depends only
+// on the seed and the replicate index. The coefficients of replicate
+// b are written to beta[b*ncols...].
+void lasso_bootstrap(const sparsemat &x, const double *y, const std::vector<int> &group, int nboot,
+                     unsigned long int seed, double norm1, const double *beta0, const double *maxc,
+                     double l2, int nthreads, std::vector<double> &beta);
+
+// Constrained LASSO fits (lasso_cd, with ridge penalty l2 for the
+// elastic net) for several targets sharing the term matrix x. The
+// ny = y.size()/nrows targets are stored one after the other in y.
+// For each target t and each 1-norm constraint norm1[l], the problem
+// is solved starting from zero coefficients, and the grid of
+// problems is distributed over nthreads threads, so the results do
+// not depend on the number of threads. The coefficients of problem
+// k = t*norm1.size()+l are written to beta[k*ncols...], its wrms to
+// wrms[k], and, if screen, the number of screened columns to
+// nscr[k].
+void lasso_grid(const sparsemat &x, const std::vector<double> &y, const std::vector<double> &norm1,
+                const double *maxc, double l2, bool screen, int nthreads, std::vector<double> &beta,
+                std::vector<double> &wrms, std::vector<unsigned long int> &nscr);
+
+// Leverage of each row of the term matrix x (nrows), h_i = x_i^T *
+// G^+ * x_i, with G^+ the pseudo-inverse of the Gram matrix in g
+// (the normal equations of x). The leverages are between 0 and 1
+// and add up to the rank of x. G is diagonalized once.
+void row_leverage(const sparsemat &x, const gramsys &g, std::vector<double> &h);
+
+// Select nsel groups of rows of x (group[i] is the group of row i,
+// e.g. its property) by greedy D-optimal design: in each step, add
+// the group that most increases the determinant of the information
+// matrix of the selected rows (x_S^T * x_S plus a small multiple of
+// the identity). Returns the selected groups in sel, in increasing
+// order.
+void dopt_select(const sparsemat &x, const std::vector<int> &group, unsigned long int nsel,
+                 std::vector<int> &sel);
+
+// Least-squares fits with a fixed number of terms by greedy forward
+// selection (orthogonal matching pursuit), with the term matrix in x
+// and the target in y, both already multiplied by the square root of
+// the weights. In each step, the column most correlated with the
+// residual is added and the coefficients of all the selected columns
+// are refitted. The least-squares solution is updated with an
+// incremental QR factorization of the selected columns, so each step
+// costs O(nrows * k) plus one pass over x. If maxc is not null, the
+// coefficients that exceed |c_j| <= maxc[j] are fixed at the bound
+// and the other selected columns are refitted. For each number of
+// terms kv[i], the coefficients are written to beta[i*ncols...] and
+// the wrms to wrms[i]. Returns the number of terms selected, which
+// is smaller than the largest kv if no more terms can be added (all
+// columns used or linearly dependent); the fits with more terms
+// than that are the last one.
+unsigned long int omp_path(const sparsemat &x, const double *y, const std::vector<unsigned long int> &kv,
+                           const double *maxc, std::vector<double> &beta, std::vector<double> &wrms);
+
+#endif
@@ -19,6 +19,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 // global flags
 bool globals::verbose = false;
+int globals::nthreads = 0;
 
 // conversion factors
 const double globals::ha_to_kcal = 627.50947;
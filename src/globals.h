@@ -31,6 +31,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 namespace globals {
   // global flags
   extern bool verbose; // verbose output
+  extern int nthreads; // number of threads for the fits (0 = all available)
 
   // universal constants and conversion factors
   extern const double ha_to_kcal; // Hartree to kcal/mol
@@ -70,6 +70,12 @@ inline bool isinteger(const std::string &a){
   return a.find_first_not_of("0123456789 ") == std::string::npos;
 }
 
+// Check if a string can be converted to a real number.
+inline bool isfloat(const std::string &a){
+  return !a.empty() && a.find_first_not_of("0123456789+-.eE") == std::string::npos &&
+    a.find_first_of("0123456789") != std::string::npos;
+}
+
 // Write a double to a string very precisely
 std::string to_string_precise(double a);
 
@@ -0,0 +1,261 @@
+/*
+Copyright (c) 2020 Alberto Otero de la Roza <aoterodelaroza@gmail.com>
+
+acpdb is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or (at
+your option) any later version.
+
+acpdb is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "sparsemat.h"
+
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+#include <algorithm>
+
+// Kernels on the values of one column (v, with row indices idx and
+// n elements), for double or single precision values. The
+// accumulation is always in double precision.
+template<typename T>
+static double kdot(const T *v, const uint32_t *idx, unsigned long int n, const double *r){
+  double s = 0.;
+  for (unsigned long int k = 0; k < n; k++)
+    s += (double) v[k] * r[idx[k]];
+  return s;
+}
+
+template<typename T>
+static double kdotw(const T *v, const uint32_t *idx, unsigned long int n, const double *r, const double *w){
+  double s = 0.;
+  for (unsigned long int k = 0; k < n; k++)
+    s += (double) v[k] * w[idx[k]] * r[idx[k]];
+  return s;
+}
+
+template<typename T>
+static void kaxpy(const T *v, const uint32_t *idx, unsigned long int n, double a, double *r){
+  for (unsigned long int k = 0; k < n; k++)
+    r[idx[k]] += a * (double) v[k];
+}
+
+template<typename T>
+static double knorm2(const T *v, unsigned long int n){
+  double s = 0.;
+  for (unsigned long int k = 0; k < n; k++)
+    s += (double) v[k] * (double) v[k];
+  return s;
+}
+
+template<typename T>
+static double knorm2w(const T *v, const uint32_t *idx, unsigned long int n, const double *w){
+  double s = 0.;
+  for (unsigned long int k = 0; k < n; k++)
+    s += (double) v[k] * (double) v[k] * w[idx[k]];
+  return s;
+}
+
+template<typename T>
+static void kdotm(const T *v, const uint32_t *idx, unsigned long int n, const double *b,
+		  unsigned long int ld, unsigned long int nb, double *s){
+  for (unsigned long int k = 0; k < n; k++){
+    double x = (double) v[k];
+    const double *bk = b + idx[k] * ld;
+    for (unsigned long int l = 0; l < nb; l++)
+      s[l] += x * bk[l];
+  }
+}
+
+template<typename T>
+static void kscatter(const T *v, const uint32_t *idx, unsigned long int n, const uint32_t *map,
+		     const double *sign, double *out){
+  for (unsigned long int k = 0; k < n; k++)
+    out[map[idx[k]]] += sign[idx[k]] * (double) v[k];
+}
+
+// Clear the matrix and set the number of rows and the precision
+void sparsemat::clear(unsigned long int nrows_, bool single_/*=false*/){
+  if (nrows_ > std::numeric_limits<uint32_t>::max())
+    throw std::runtime_error("Too many rows for a sparse matrix");
+  nrows = nrows_;
+  single = single_;
+  colptr.assign(1,0);
+  rowidx.clear();
+  val.clear();
+  valf.clear();
+}
+
+// Add a column from the dense vector col (nrows elements). Only the
+// elements with absolute value greater than thr are kept. If w is
+// not null, multiply the elements by w.
+void sparsemat::add_column(const double *col, double thr/*=0.*/, const double *w/*=nullptr*/){
+  if (nrows > std::numeric_limits<uint32_t>::max())
+    throw std::runtime_error("Too many rows for a sparse matrix");
+  for (unsigned long int i = 0; i < nrows; i++){
+    double x = w ? col[i] * w[i] : col[i];
+    if (x != 0. && std::abs(x) > thr){
+      rowidx.push_back(i);
+      if (single)
+	valf.push_back((float) x);
+      else
+	val.push_back(x);
+    }
+  }
+  colptr.push_back(rowidx.size());
+}
+
+// y = X * c
+void sparsemat::mult(const double *c, double *y) const{
+  std::fill(y,y+nrows,0.);
+  for (unsigned long int j = 0; j < get_ncols(); j++)
+    if (c[j] != 0.)
+      axpycol(j,c[j],y);
+}
+
+// g = X^T * r
+void sparsemat::multt(const double *r, double *g) const{
+  for (unsigned long int j = 0; j < get_ncols(); j++)
+    g[j] = dotcol(j,r);
+}
+
+// Dot product of column j with vector r
+double sparsemat::dotcol(unsigned long int j, const double *r, const double *w/*=nullptr*/) const{
+  unsigned long int k0 = colptr[j], n = colptr[j+1] - k0;
+  if (w && single)
+    return kdotw(valf.data()+k0,rowidx.data()+k0,n,r,w);
+  else if (w)
+    return kdotw(val.data()+k0,rowidx.data()+k0,n,r,w);
+  else if (single)
+    return kdot(valf.data()+k0,rowidx.data()+k0,n,r);
+  else
+    return kdot(val.data()+k0,rowidx.data()+k0,n,r);
+}
+
+// r = r + a * (column j)
+void sparsemat::axpycol(unsigned long int j, double a, double *r) const{
+  unsigned long int k0 = colptr[j], n = colptr[j+1] - k0;
+  if (single)
+    kaxpy(valf.data()+k0,rowidx.data()+k0,n,a,r);
+  else
+    kaxpy(val.data()+k0,rowidx.data()+k0,n,a,r);
+}
+
+// out[map[i]] = out[map[i]] + sign[i] * x(i,j) for the non-zero
+// elements of column j
+void sparsemat::scattercol(unsigned long int j, const uint32_t *map, const double *sign, double *out) const{
+  unsigned long int k0 = colptr[j], n = colptr[j+1] - k0;
+  if (single)
+    kscatter(valf.data()+k0,rowidx.data()+k0,n,map,sign,out);
+  else
+    kscatter(val.data()+k0,rowidx.data()+k0,n,map,sign,out);
+}
+
+// Dot products of column j with the first nb columns of the
+// row-major matrix b (leading dimension ld), added to s[0..nb-1]
+void sparsemat::dotcols(unsigned long int j, const double *b, unsigned long int ld, unsigned long int nb,
+			double *s) const{
+  unsigned long int k0 = colptr[j], n = colptr[j+1] - k0;
+  if (single)
+    kdotm(valf.data()+k0,rowidx.data()+k0,n,b,ld,nb,s);
+  else
+    kdotm(val.data()+k0,rowidx.data()+k0,n,b,ld,nb,s);
+}
+
+// Squared 2-norm of each column
+void sparsemat::colnorm2(std::vector<double> &nrm, const double *w/*=nullptr*/) const{
+  nrm.assign(get_ncols(),0.);
+  for (unsigned long int j = 0; j < get_ncols(); j++){
+    unsigned long int k0 = colptr[j], n = colptr[j+1] - k0;
+    if (w && single)
+      nrm[j] = knorm2w(valf.data()+k0,rowidx.data()+k0,n,w);
+    else if (w)
+      nrm[j] = knorm2w(val.data()+k0,rowidx.data()+k0,n,w);
+    else if (single)
+      nrm[j] = knorm2(valf.data()+k0,n);
+    else
+      nrm[j] = knorm2(val.data()+k0,n);
+  }
+}
+
+// Write the rows with mask true to sub, in the same order and with
+// the same precision
+void sparsemat::rowsubset(const std::vector<bool> &mask, sparsemat &sub) const{
+  std::vector<long int> newidx(nrows,-1);
+  unsigned long int n = 0;
+  for (unsigned long int i = 0; i < nrows; i++)
+    if (mask[i]) newidx[i] = n++;
+  sub.clear(n,single);
+  for (unsigned long int j = 0; j < get_ncols(); j++){
+    for (unsigned long int k = colptr[j]; k < colptr[j+1]; k++){
+      if (newidx[rowidx[k]] < 0) continue;
+      sub.rowidx.push_back(newidx[rowidx[k]]);
+      if (single)
+	sub.valf.push_back(valf[k]);
+      else
+	sub.val.push_back(val[k]);
+    }
+    sub.colptr.push_back(sub.rowidx.size());
+  }
+}
+
+// Write the columns with mask true to sub, in the same order and
+// with the same precision
+void sparsemat::colsubset(const std::vector<bool> &mask, sparsemat &sub) const{
+  sub.clear(nrows,single);
+  for (unsigned long int j = 0; j < get_ncols(); j++){
+    if (!mask[j]) continue;
+    sub.rowidx.insert(sub.rowidx.end(),rowidx.begin()+colptr[j],rowidx.begin()+colptr[j+1]);
+    if (single)
+      sub.valf.insert(sub.valf.end(),valf.begin()+colptr[j],valf.begin()+colptr[j+1]);
+    else
+      sub.val.insert(sub.val.end(),val.begin()+colptr[j],val.begin()+colptr[j+1]);
+    sub.colptr.push_back(sub.rowidx.size());
+  }
+}
+
+// Write the transpose of the matrix to t, with the same precision.
+// The elements of each row are counted first, then placed in column
+// order, so the row indices of t are in increasing order.
+void sparsemat::transpose(sparsemat &t) const{
+  unsigned long int ncols = get_ncols();
+  if (ncols > std::numeric_limits<uint32_t>::max())
+    throw std::runtime_error("Too many columns to transpose a sparse matrix");
+  t.clear(ncols,single);
+  t.colptr.assign(nrows+1,0);
+  for (unsigned long int k = 0; k < rowidx.size(); k++)
+    t.colptr[rowidx[k]+1]++;
+  for (unsigned long int i = 0; i < nrows; i++)
+    t.colptr[i+1] += t.colptr[i];
+  t.rowidx.resize(rowidx.size());
+  if (single)
+    t.valf.resize(valf.size());
+  else
+    t.val.resize(val.size());
+  std::vector<unsigned long int> next(t.colptr.begin(),t.colptr.end()-1);
+  for (unsigned long int j = 0; j < ncols; j++){
+    for (unsigned long int k = colptr[j]; k < colptr[j+1]; k++){
+      unsigned long int kt = next[rowidx[k]]++;
+      t.rowidx[kt] = j;
+      if (single)
+	t.valf[kt] = valf[k];
+      else
+	t.val[kt] = val[k];
+    }
+  }
+}
+
+// Write the matrix in dense column-major order to x
+void sparsemat::todense(std::vector<double> &x) const{
+  x.assign(nrows * get_ncols(),0.);
+  for (unsigned long int j = 0; j < get_ncols(); j++)
+    for (unsigned long int k = colptr[j]; k < colptr[j+1]; k++)
+      x[j * nrows + rowidx[k]] = single ? (double) valf[k] : val[k];
+}
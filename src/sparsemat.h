@@ -0,0 +1,121 @@
+// -*- c++-mode -*-
+/*
+Copyright (c) 2020 Alberto Otero de la Roza <aoterodelaroza@gmail.com>
+
+acpdb is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or (at
+your option) any later version.
+
+acpdb is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SPARSEMAT_H
+#define SPARSEMAT_H
+
+#include <vector>
+#include <cstdint>
+
+// A sparse matrix in compressed sparse column (CSC) format, used for
+// the training set term matrix. The matrix is built column by column
+// with add_column, in order. The values in column j are val[colptr[j]]
+// to val[colptr[j+1]-1], in rows rowidx[colptr[j]] ... in increasing
+// order. In single-precision mode, the values are stored as floats
+// (half the memory and bandwidth), but the kernels still accumulate
+// in double precision.
+class sparsemat {
+
+ public:
+
+  //// Operators ////
+
+  // constructors
+  sparsemat(unsigned long int nrows_ = 0, bool single_ = false) : nrows(nrows_), single(single_), colptr{0} {};
+
+  //// Public methods ////
+
+  // Clear the matrix and set the number of rows and the precision
+  void clear(unsigned long int nrows_, bool single_=false);
+
+  // Add a column from the dense vector col (nrows elements). Only the
+  // elements with absolute value greater than thr are kept. If w is
+  // not null, multiply the elements by w.
+  void add_column(const double *col, double thr=0., const double *w=nullptr);
+
+  // y = X * c
+  void mult(const double *c, double *y) const;
+
+  // g = X^T * r
+  void multt(const double *r, double *g) const;
+
+  // Dot product of column j with vector r. If w is not null, the
+  // elements of r are multiplied by w.
+  double dotcol(unsigned long int j, const double *r, const double *w=nullptr) const;
+
+  // r = r + a * (column j)
+  void axpycol(unsigned long int j, double a, double *r) const;
+
+  // out[map[i]] = out[map[i]] + sign[i] * x(i,j) for the non-zero
+  // elements of column j
+  void scattercol(unsigned long int j, const uint32_t *map, const double *sign, double *out) const;
+
+  // Dot products of column j with the first nb columns of the
+  // row-major matrix b (leading dimension ld), added to s[0..nb-1]
+  void dotcols(unsigned long int j, const double *b, unsigned long int ld, unsigned long int nb,
+	       double *s) const;
+
+  // Squared 2-norm of each column. If w is not null, the squares are
+  // multiplied by w.
+  void colnorm2(std::vector<double> &nrm, const double *w=nullptr) const;
+
+  // Write the matrix in dense column-major order to x
+  void todense(std::vector<double> &x) const;
+
+  // Write the rows with mask true to sub, in the same order and with
+  // the same precision
+  void rowsubset(const std::vector<bool> &mask, sparsemat &sub) const;
+
+  // Write the columns with mask true to sub, in the same order and
+  // with the same precision
+  void colsubset(const std::vector<bool> &mask, sparsemat &sub) const;
+
+  // Write the transpose of the matrix to t, with the same precision
+  void transpose(sparsemat &t) const;
+
+  // Number of rows, columns, and non-zero elements, and the fraction
+  // of non-zero elements
+  unsigned long int get_nrows() const { return nrows; }
+  unsigned long int get_ncols() const { return colptr.size() - 1; }
+  unsigned long int get_nnz() const { return rowidx.size(); }
+  double density() const {
+    return (nrows > 0 && get_ncols() > 0) ? (double) rowidx.size() / ((double) nrows * get_ncols()) : 0.;
+  }
+
+  // Whether the values are stored in single precision
+  bool is_single() const { return single; }
+
+  // Memory used by the matrix (bytes)
+  unsigned long int memory() const {
+    return colptr.size() * sizeof(unsigned long int) + rowidx.size() * sizeof(uint32_t) +
+      val.size() * sizeof(double) + valf.size() * sizeof(float);
+  }
+
+ private:
+
+  //// Private variables ////
+
+  unsigned long int nrows; // number of rows
+  bool single; // whether the values are stored in valf
+  std::vector<unsigned long int> colptr; // start of each column (ncols+1)
+  std::vector<uint32_t> rowidx; // row index of each value
+  std::vector<double> val; // values (double precision)
+  std::vector<float> valf; // values (single precision)
+};
+
+#endif
@@ -26,7 +26,13 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <string>
 #include <iterator>
 #include <set>
+#include <random>
+#include <thread>
+#include <map>
+#include <array>
+#include <cmath>
 #include "sqldb.h"
+#include "sqlext.h"
 #include "parseutils.h"
 #include "statement.h"
 #include "structure.h"
@@ -113,7 +119,7 @@ CREATE TABLE Terms (
   PRIMARY KEY(methodid,zatom,symbol,l,exponent,exprn,propid),
   FOREIGN KEY(methodid) REFERENCES Methods(id) ON DELETE CASCADE,
   FOREIGN KEY(propid) REFERENCES Properties(id) ON DELETE CASCADE
-);
+) WITHOUT ROWID;
 CREATE TABLE Training_set_repo (
   key TEXT PRIMARY KEY,
   training_set BLOB NOT NULL
@@ -130,6 +136,25 @@ INSERT INTO Property_types (id,key,description)
 )SQL";
 //// end of database schema ////
 
+//// database schema version ////
+// The database_schema above is the version 0 skeleton. Each new
+// version adds a step to sqldb::upgrade(), which brings an older
+// database up to date in place. The version is stored in the
+// user_version pragma of the database file.
+static const int database_version = 6;
+
+//// concurrency ////
+// Several acpdb processes can work on the same database file. The
+// database uses write-ahead logging, so readers do not block the
+// writer, and the busy handler retries with exponential backoff (in
+// ms) for up to busy_timeout before giving up. The bulk inserts
+// commit every commit_batch rows, so the write lock is not held for
+// the whole operation.
+static const int busy_timeout = 600000;
+static const int busy_delay_min = 2;
+static const int busy_delay_max = 1000;
+static const int commit_batch = 2000;
+
 // essential information for a property
 struct propinfo {
   int fieldasrxn = 0;
@@ -225,9 +250,371 @@ WHERE type='table' AND name='Literature_refs';
     else
       return 0;
   }
+
+  st.reset();
+
+  // upgrade the schema if this is an older database
+  int version = get_version();
+  if (version > database_version)
+    throw std::runtime_error("Database version (" + std::to_string(version) + ") is newer than this acpdb (" +
+			     std::to_string(database_version) + ")");
+  else if (version < database_version)
+    upgrade(version);
+
   return 1;
 }
 
+// Get the schema version of the connected database.
+int sqldb::get_version(){
+  if (!db) throw std::runtime_error("A database file must be connected before reading the version");
+
+  statement st(db,"PRAGMA user_version;");
+  st.step();
+  int version = sqlite3_column_int(st.ptr(),0);
+  st.reset();
+  return version;
+}
+
+// Upgrade the database schema from the given version to the
+// current version. Each step is applied in order and the
+// user_version is updated in the same transaction.
+void sqldb::upgrade(int version){
+  if (!db) throw std::runtime_error("A database file must be connected before using UPGRADE");
+
+  begin_transaction();
+  for (int v = version; v < database_version; v++){
+    statement st(db);
+    switch (v){
+    case 0:
+      // version 1: indexes for the property type, set, and property lookups
+      st.recycle(R"SQL(
+CREATE INDEX IF NOT EXISTS Properties_property_type_idx ON Properties (property_type);
+CREATE INDEX IF NOT EXISTS Properties_setid_idx ON Properties (setid,orderid);
+CREATE INDEX IF NOT EXISTS Evaluations_propid_idx ON Evaluations (propid);
+CREATE INDEX IF NOT EXISTS Terms_propid_idx ON Terms (propid);
+)SQL");
+      st.execute();
+      break;
+    case 1:
+      // version 2: the structures and coefficients of each property
+      // as a table, for reverse lookups
+      st.recycle(R"SQL(
+CREATE TABLE IF NOT EXISTS Property_structures (
+  propid    INTEGER NOT NULL,
+  position  INTEGER NOT NULL,
+  strid     INTEGER NOT NULL,
+  coef      REAL,
+  PRIMARY KEY(propid,position),
+  FOREIGN KEY(propid) REFERENCES Properties(id) ON DELETE CASCADE
+) WITHOUT ROWID;
+CREATE INDEX IF NOT EXISTS Property_structures_strid_idx ON Property_structures (strid,propid);
+)SQL");
+      st.execute();
+      st.recycle("SELECT id, nstructures, structures, coefficients FROM Properties;");
+      while (st.step() != SQLITE_DONE)
+	insert_property_structures(sqlite3_column_int(st.ptr(),0),sqlite3_column_int(st.ptr(),1),
+				   (int *) sqlite3_column_blob(st.ptr(),2),(double *) sqlite3_column_blob(st.ptr(),3));
+      break;
+    case 2:
+      // version 3: data versions for methods, sets, and term columns
+      st.recycle(R"SQL(
+CREATE TABLE IF NOT EXISTS Data_versions (
+  kind      TEXT NOT NULL,
+  id        INTEGER NOT NULL,
+  version   INTEGER NOT NULL,
+  PRIMARY KEY(kind,id)
+) WITHOUT ROWID;
+CREATE TABLE IF NOT EXISTS Term_versions (
+  methodid  INTEGER NOT NULL,
+  zatom     INTEGER NOT NULL,
+  symbol    TEXT NOT NULL,
+  l         INTEGER NOT NULL,
+  exponent  REAL NOT NULL,
+  exprn     INTEGER NOT NULL,
+  version   INTEGER NOT NULL,
+  PRIMARY KEY(methodid,zatom,symbol,l,exponent,exprn)
+) WITHOUT ROWID;
+INSERT OR IGNORE INTO Data_versions (kind,id,version) VALUES ('GLOBAL',0,0);
+)SQL");
+      st.execute();
+      break;
+    case 3:
+      // version 4: geometry hash of the structures and aliases of
+      // deduplicated structures
+      st.recycle(R"SQL(
+ALTER TABLE Structures ADD COLUMN hash TEXT;
+CREATE INDEX IF NOT EXISTS Structures_hash_idx ON Structures (hash);
+CREATE TABLE IF NOT EXISTS Structure_aliases (
+  key       TEXT PRIMARY KEY,
+  strid     INTEGER NOT NULL,
+  FOREIGN KEY(strid) REFERENCES Structures(id) ON DELETE CASCADE
+) WITHOUT ROWID;
+)SQL");
+      st.execute();
+      {
+	statement sthash(db,"UPDATE Structures SET hash = ?2 WHERE id = ?1;");
+	st.recycle("SELECT id,key,ismolecule,charge,multiplicity,nat,cell,zatoms,coordinates FROM Structures;");
+	while (st.step() != SQLITE_DONE){
+	  structure s;
+	  s.readdbrow(st.ptr());
+	  sthash.bind(1,sqlite3_column_int(st.ptr(),0));
+	  sthash.bind(2,s.hash());
+	  sthash.step();
+	}
+      }
+      break;
+    case 4:
+      // version 5: composition of the structures, for the masks and
+      // the element lookups
+      st.recycle(R"SQL(
+CREATE TABLE IF NOT EXISTS Structure_atoms (
+  strid     INTEGER NOT NULL,
+  zatom     INTEGER NOT NULL,
+  count     INTEGER NOT NULL,
+  PRIMARY KEY(strid,zatom),
+  FOREIGN KEY(strid) REFERENCES Structures(id) ON DELETE CASCADE
+) WITHOUT ROWID;
+CREATE INDEX IF NOT EXISTS Structure_atoms_zatom_idx ON Structure_atoms (zatom,strid);
+)SQL");
+      st.execute();
+      st.recycle("SELECT id, nat, zatoms FROM Structures;");
+      while (st.step() != SQLITE_DONE)
+	insert_structure_atoms(sqlite3_column_int(st.ptr(),0),sqlite3_column_int(st.ptr(),1),
+			       (const unsigned char *) sqlite3_column_blob(st.ptr(),2));
+      break;
+    case 5:
+      // version 6: the Terms table is stored clustered by its primary
+      // key (WITHOUT ROWID), as in new databases
+      st.recycle("SELECT sql FROM main.sqlite_schema WHERE type = 'table' AND name = 'Terms';");
+      if (st.step() == SQLITE_ROW){
+	std::string sql = (const char *) sqlite3_column_text(st.ptr(),0);
+	st.reset();
+	uppercase(sql);
+	if (sql.find("WITHOUT ROWID") == std::string::npos)
+	  rebuild_terms();
+      }
+      break;
+    default:
+      throw std::runtime_error("Unknown database version " + std::to_string(v) + " in UPGRADE");
+    }
+  }
+  statement st(db,"PRAGMA user_version = " + std::to_string(database_version) + ";");
+  st.execute();
+  commit_transaction();
+
+  // refresh the query planner statistics, with a bounded cost
+  st.recycle("PRAGMA analysis_limit = 1000; ANALYZE;");
+  st.execute();
+}
+
+// Increase the global data version counter and return the new value.
+long int sqldb::next_version(){
+  statement st(db,"UPDATE Data_versions SET version = version + 1 WHERE kind = 'GLOBAL' AND id = 0;");
+  st.step();
+  return version();
+}
+
+// Get the global data version (the last version assigned to any data).
+long int sqldb::version(){
+  return version("GLOBAL",0);
+}
+
+// Get the data version of a method (kind = METHOD) or set (kind =
+// SET) with the given id. Returns zero if the data was never changed.
+long int sqldb::version(const std::string &kind, int id){
+  if (!db) throw std::runtime_error("A database file must be connected before reading data versions");
+
+  statement st(db,"SELECT version FROM Data_versions WHERE kind = ?1 AND id = ?2;");
+  st.bind(1,kind);
+  st.bind(2,id);
+  long int v = 0;
+  if (st.step() == SQLITE_ROW)
+    v = sqlite3_column_int64(st.ptr(),0);
+  st.reset();
+  return v;
+}
+
+// Get the data version of the terms column for the given method and
+// term. Returns zero if the column was never changed.
+long int sqldb::version_term(int methodid, int zatom, const std::string &symbol, int l, double exp, int exprn){
+  if (!db) throw std::runtime_error("A database file must be connected before reading data versions");
+
+  statement st(db,R"SQL(
+SELECT version FROM Term_versions
+WHERE methodid = ?1 AND zatom = ?2 AND symbol = ?3 AND l = ?4 AND exponent = ?5 AND exprn = ?6;
+)SQL");
+  st.bind(1,methodid);
+  st.bind(2,zatom);
+  st.bind(3,symbol);
+  st.bind(4,l);
+  st.bind(5,exp);
+  st.bind(6,exprn);
+  long int v = 0;
+  if (st.step() == SQLITE_ROW)
+    v = sqlite3_column_int64(st.ptr(),0);
+  st.reset();
+  return v;
+}
+
+// Mark the method (kind = METHOD) or set (kind = SET) with the given
+// id as changed.
+void sqldb::touch(const std::string &kind, int id){
+  touch_ids(kind,"SELECT " + std::to_string(id) + " AS id");
+}
+
+// Mark as changed the methods or sets whose ids are returned by the
+// SQL query in sqlids (in a column named id).
+void sqldb::touch_ids(const std::string &kind, const std::string &sqlids){
+  long int v = next_version();
+  statement st(db,"INSERT OR REPLACE INTO Data_versions (kind,id,version) SELECT ?1, id, ?2 FROM (" + sqlids + ");");
+  st.bind(1,kind);
+  st.bind(2,v);
+  st.step();
+}
+
+// Mark the terms column for the given method and term as changed.
+void sqldb::touch_term(int methodid, int zatom, const std::string &symbol, int l, double exp, int exprn){
+  long int v = next_version();
+  statement st(db,R"SQL(
+INSERT OR REPLACE INTO Term_versions (methodid,zatom,symbol,l,exponent,exprn,version)
+       VALUES(?1,?2,?3,?4,?5,?6,?7);
+)SQL");
+  st.bind(1,methodid);
+  st.bind(2,zatom);
+  st.bind(3,symbol);
+  st.bind(4,l);
+  st.bind(5,exp);
+  st.bind(6,exprn);
+  st.bind(7,v);
+  st.step();
+}
+
+// Mark all the terms columns of a method as changed. If methodid is
+// negative, mark the columns of all methods.
+void sqldb::touch_terms(int methodid){
+  if (methodid >= 0)
+    touch_terms_where("methodid = " + std::to_string(methodid));
+  else
+    touch_terms_where("1");
+}
+
+// Mark as changed the terms columns that have at least one row
+// satisfying the SQL condition in where.
+void sqldb::touch_terms_where(const std::string &where){
+  long int v = next_version();
+  statement st(db,R"SQL(
+INSERT OR REPLACE INTO Term_versions (methodid,zatom,symbol,l,exponent,exprn,version)
+SELECT DISTINCT methodid,zatom,symbol,l,exponent,exprn,?1 FROM Terms
+WHERE )SQL" + where + ";");
+  st.bind(1,v);
+  st.step();
+}
+
+// Insert the structures (strid) and coefficients (coef, may be null)
+// of property propid in the Property_structures table, replacing the
+// previous entries for that property. Positions start at zero.
+void sqldb::insert_property_structures(int propid, int nstr, const int *strid, const double *coef){
+  statement st(db,"DELETE FROM Property_structures WHERE propid = ?1;");
+  st.bind(1,propid);
+  st.step();
+
+  st.recycle("INSERT INTO Property_structures (propid,position,strid,coef) VALUES(?1,?2,?3,?4);");
+  for (int i = 0; i < nstr; i++){
+    st.reset();
+    st.bind(1,propid);
+    st.bind(2,i);
+    st.bind(3,strid[i]);
+    if (coef)
+      st.bind(4,coef[i]);
+    if (st.step() != SQLITE_DONE)
+      throw std::runtime_error("Failed inserting property structures");
+  }
+}
+
+// Insert the composition of structure strid with nat atoms and
+// atomic numbers z in the Structure_atoms table, replacing the
+// previous entries for that structure.
+void sqldb::insert_structure_atoms(int strid, int nat, const unsigned char *z){
+  std::map<int,int> count;
+  for (int i = 0; i < nat; i++)
+    count[z[i]]++;
+
+  statement st(db,"DELETE FROM Structure_atoms WHERE strid = ?1;");
+  st.bind(1,strid);
+  st.step();
+
+  st.recycle("INSERT INTO Structure_atoms (strid,zatom,count) VALUES(?1,?2,?3);");
+  for (auto it = count.begin(); it != count.end(); it++){
+    st.reset();
+    st.bind(1,strid);
+    st.bind(2,it->first);
+    st.bind(3,it->second);
+    if (st.step() != SQLITE_DONE)
+      throw std::runtime_error("Failed inserting structure atoms");
+  }
+}
+
+// Find the ID of the structure with the given key, or of the
+// structure it is an alias of. Returns 0 if not found.
+int sqldb::find_structure_id(const std::string &key){
+  int id = find_id_from_key(key,"Structures");
+  if (id > 0) return id;
+
+  statement st(db,"SELECT strid FROM Structure_aliases WHERE key = ?1;");
+  st.bind(1,key);
+  if (st.step() == SQLITE_ROW)
+    id = sqlite3_column_int(st.ptr(),0);
+  st.reset();
+  return id;
+}
+
+// Insert structure s with the given key using the prepared INSERT
+// statement st (with parameters :KEY, :ISMOLECULE, :CHARGE,
+// :MULTIPLICITY, :NAT, :CELL, :ZATOMS, :COORDINATES, and :HASH). If
+// dedupe and a structure with the same geometry hash already exists
+// under a different key, insert the key as an alias of that
+// structure instead. Returns the ID of the structure.
+int sqldb::insert_structure_row(std::ostream &os, statement &st, const std::string &key, const structure &s, bool dedupe){
+  std::string hash = s.hash();
+
+  if (dedupe){
+    statement stfind(db,"SELECT id, key FROM Structures WHERE hash = ?1 AND key != ?2 ORDER BY id LIMIT 1;");
+    stfind.bind(1,hash);
+    stfind.bind(2,key);
+    if (stfind.step() == SQLITE_ROW){
+      int id = sqlite3_column_int(stfind.ptr(),0);
+      std::string origkey = (const char *) sqlite3_column_text(stfind.ptr(),1);
+      stfind.reset();
+
+      statement stalias(db,"INSERT OR REPLACE INTO Structure_aliases (key,strid) VALUES(?1,?2);");
+      stalias.bind(1,key);
+      stalias.bind(2,id);
+      if (stalias.step() != SQLITE_DONE)
+	throw std::runtime_error("Failed inserting structure alias (" + key + ")");
+      os << "# Structure " << key << " is a duplicate of " << origkey << " (id=" << id << ")" << std::endl;
+      return id;
+    }
+  }
+
+  int nat = s.get_nat();
+  st.reset();
+  st.bind((char *) ":KEY",key);
+  st.bind((char *) ":ISMOLECULE",s.ismolecule()?1:0);
+  st.bind((char *) ":CHARGE",s.get_charge());
+  st.bind((char *) ":MULTIPLICITY",s.get_mult());
+  st.bind((char *) ":NAT",nat);
+  if (!s.ismolecule())
+    st.bind((char *) ":CELL",(void *) s.get_r(),false,9 * sizeof(double));
+  st.bind((char *) ":ZATOMS",(void *) s.get_z(),false,nat * sizeof(unsigned char));
+  st.bind((char *) ":COORDINATES",(void *) s.get_x(),false,3 * nat * sizeof(double));
+  st.bind((char *) ":HASH",hash);
+  if (st.step() != SQLITE_DONE)
+    throw std::runtime_error("Failed inserting structure (" + key + ")");
+  int id = sqlite3_last_insert_rowid(db);
+  insert_structure_atoms(id,nat,s.get_z());
+  return id;
+}
+
 // Open a database file for use.
 void sqldb::connect(const std::string &filename, int flags/*=SQLITE_OPEN_READWRITE*/){
   // close the previous db if open
@@ -238,7 +625,7 @@ void sqldb::connect(const std::string &filename, int flags/*=SQLITE_OPEN_READWRI
     throw std::runtime_error("Need a database file name to connect");
 
   // open the new one
-  if (sqlite3_open_v2(filename.c_str(), &db, flags, NULL)) {
+  if (sqlite3_open_v2(filename.c_str(), &db, flags | SQLITE_OPEN_URI, NULL)) {
     std::string errmsg = "Can't connect to database file " + filename + " (" + std::string(sqlite3_errmsg(db)) + ")";
     close();
     throw std::runtime_error(errmsg);
@@ -247,9 +634,151 @@ void sqldb::connect(const std::string &filename, int flags/*=SQLITE_OPEN_READWRI
   // write down the file name
   dbfilename = filename;
 
+  // wait for other processes if the database is locked
+  sqlite3_busy_handler(db,busy_handler,this);
+
   // initialize the database
   statement st(db,"PRAGMA foreign_keys = ON;");
   st.execute();
+  if (flags & SQLITE_OPEN_READWRITE){
+    st.recycle("PRAGMA journal_mode = WAL; PRAGMA synchronous = NORMAL;");
+    st.execute();
+  }
+
+  // register the acpdb SQL functions
+  if (register_sqlext(db))
+    throw std::runtime_error("Error registering the SQL functions (" + std::string(sqlite3_errmsg(db)) + ")");
+}
+
+// Attach the database in file as schema alias (if empty, use the
+// file name without extension). If readonly, open the file in
+// read-only mode. The Terms and Evaluations tables in the attached
+// database are merged with those in the main database.
+void sqldb::attach(std::ostream &os, const std::string &file, const std::string &alias, bool readonly){
+  if (!db) throw std::runtime_error("A database file must be connected before using ATTACH");
+  if (!fs::is_regular_file(file))
+    throw std::runtime_error("Database file " + file + " not found in ATTACH");
+
+  std::string name = alias;
+  if (name.empty())
+    name = fs::path(file).stem();
+  if (equali_strings(name,"main") || equali_strings(name,"temp"))
+    throw std::runtime_error("Invalid schema name " + name + " in ATTACH");
+
+  // build the URI
+  std::string uri = "file:";
+  std::string path = fs::absolute(file);
+  for (int i = 0; i < path.size(); i++){
+    if (path[i] == '%' || path[i] == '?' || path[i] == '#'){
+      char buf[4];
+      snprintf(buf,4,"%%%02X",(unsigned char) path[i]);
+      uri += buf;
+    } else
+      uri += path[i];
+  }
+  if (readonly)
+    uri += "?mode=ro";
+
+  // attach
+  statement st(db,"ATTACH DATABASE ?1 AS ?2;");
+  st.bind(1,uri);
+  st.bind(2,name);
+  st.step();
+
+  // check that it has terms or evaluations
+  st.recycle("SELECT COUNT(*) FROM \"" + name + "\".sqlite_schema WHERE type = 'table' AND name IN ('Terms','Evaluations');");
+  st.step();
+  int ntables = sqlite3_column_int(st.ptr(),0);
+  st.reset();
+  if (ntables == 0){
+    st.recycle("DETACH DATABASE ?1;");
+    st.bind(1,name);
+    st.step();
+    throw std::runtime_error("Database file " + file + " has no Terms or Evaluations tables in ATTACH");
+  }
+  os << "Attached database file " << file << " as " << name << (readonly?" (read-only)":"") << std::endl;
+
+  // rebuild the views and update the data versions
+  update_views();
+  touch_ids("METHOD","SELECT id FROM Methods");
+  touch_terms(-1);
+}
+
+// Detach the database with schema name alias.
+void sqldb::detach(std::ostream &os, const std::string &alias){
+  if (!db) throw std::runtime_error("A database file must be connected before using DETACH");
+
+  update_views(false);
+  statement st(db,"DETACH DATABASE ?1;");
+  st.bind(1,alias);
+  st.step();
+  os << "Detached database " << alias << std::endl;
+
+  update_views();
+  touch_ids("METHOD","SELECT id FROM Methods");
+  touch_terms(-1);
+}
+
+// Drop the temporary Terms and Evaluations views on the attached
+// databases. If create, create them again for the databases
+// currently attached. The views shadow the tables in the main
+// database, so the read queries see the rows in all the files, and
+// the write queries refer to the main database explicitly.
+void sqldb::update_views(bool create/*=true*/){
+  const std::vector<std::pair<std::string,std::string>> tables = {
+    {"Terms","methodid,zatom,symbol,l,exponent,exprn,propid,value,maxcoef"},
+    {"Evaluations","methodid,propid,value"},
+  };
+
+  // list the attached databases
+  std::vector<std::string> schemas;
+  statement st(db,"PRAGMA database_list;");
+  while (st.step() != SQLITE_DONE){
+    std::string name = (const char *) sqlite3_column_text(st.ptr(),1);
+    if (name != "main" && name != "temp")
+      schemas.push_back(name);
+  }
+
+  for (int i = 0; i < tables.size(); i++){
+    st.recycle("DROP VIEW IF EXISTS temp." + tables[i].first + ";");
+    st.execute();
+    if (!create) continue;
+
+    std::string cmd = "";
+    for (int j = 0; j < schemas.size(); j++){
+      st.recycle("SELECT COUNT(*) FROM \"" + schemas[j] + "\".sqlite_schema WHERE type = 'table' AND name = ?1;");
+      st.bind(1,tables[i].first);
+      st.step();
+      int n = sqlite3_column_int(st.ptr(),0);
+      st.reset();
+      if (n > 0)
+	cmd += "\nUNION ALL SELECT " + tables[i].second + " FROM \"" + schemas[j] + "\"." + tables[i].first;
+    }
+    if (!cmd.empty()){
+      st.recycle("CREATE TEMP VIEW " + tables[i].first + " AS SELECT " + tables[i].second + " FROM main." + tables[i].first + cmd + ";");
+      st.execute();
+    }
+  }
+}
+
+// Busy handler: called when the database is locked by another
+// process, with count the number of previous calls for this
+// lock. Sleep for an exponentially increasing time with random
+// jitter and return 1 to retry, or return 0 after busy_timeout.
+int sqldb::busy_handler(void *ptr, int count){
+  static thread_local std::minstd_rand gen(std::random_device{}());
+
+  sqldb *sdb = (sqldb *) ptr;
+  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+  if (count == 0)
+    sdb->busy_start = now;
+  if (std::chrono::duration_cast<std::chrono::milliseconds>(now - sdb->busy_start).count() >= busy_timeout)
+    return 0;
+
+  int delay = (count < 10) ? std::min(busy_delay_max,busy_delay_min << count) : busy_delay_max;
+  delay = delay / 2 + gen() % (delay / 2 + 1);
+  std::this_thread::sleep_for(std::chrono::milliseconds(delay));
+  return 1;
 }
 
 // Create the database skeleton.
@@ -257,9 +786,10 @@ void sqldb::create(){
   // skip if not open
   if (!db) throw std::runtime_error("A database file must be connected before using CREATE");
 
-  // Create the table
+  // Create the tables, then bring them to the current version
   statement st(db,database_schema);
   st.execute();
+  upgrade(0);
 }
 
 // Close a database connection if open and reset the pointer to NULL
@@ -341,6 +871,7 @@ INSERT INTO Sets (key,litrefs,description)
 
   // submit
   st.step();
+  int setid = sqlite3_last_insert_rowid(db);
 
   // interpret the xyz keyword
   if (kmap.find("XYZ") != kmap.end() || kmap.find("POSCAR") != kmap.end())
@@ -349,6 +880,9 @@ INSERT INTO Sets (key,litrefs,description)
   // interpret the din/directory/method keyword combination
   if (kmap.find("DIN") != kmap.end())
     insert_set_din(os, key, kmap);
+
+  // update the data version of the set
+  touch("SET",setid);
 }
 
 // Insert a method by manually giving the data
@@ -377,6 +911,7 @@ INSERT INTO Methods (key,litrefs,description)
 
   // submit
   st.step();
+  touch("METHOD",sqlite3_last_insert_rowid(db));
 }
 
 // Insert a property by manually giving the data
@@ -411,28 +946,22 @@ void sqldb::insert_structure(std::ostream &os, const std::string &key, const std
   if (skey.find('@') != std::string::npos)
     throw std::runtime_error("Character @ is not allowed in structure keys, in INSERT STRUCTURE");
 
-  // bind
+  // statement
   statement st(db,R"SQL(
-INSERT OR REPLACE INTO Structures (key,ismolecule,charge,multiplicity,nat,cell,zatoms,coordinates)
-       VALUES(:KEY,:ISMOLECULE,:CHARGE,:MULTIPLICITY,:NAT,:CELL,:ZATOMS,:COORDINATES);
+INSERT OR REPLACE INTO Structures (key,ismolecule,charge,multiplicity,nat,cell,zatoms,coordinates,hash)
+       VALUES(:KEY,:ISMOLECULE,:CHARGE,:MULTIPLICITY,:NAT,:CELL,:ZATOMS,:COORDINATES,:HASH);
 )SQL");
 
-  int nat = s.get_nat();
-  st.bind((char *) ":KEY",skey,false);
-  st.bind((char *) ":ISMOLECULE",s.ismolecule()?1:0,false);
-  st.bind((char *) ":NAT",nat,false);
-  st.bind((char *) ":CHARGE",s.get_charge(),false);
-  st.bind((char *) ":MULTIPLICITY",s.get_mult(),false);
-  if (!s.ismolecule())
-    st.bind((char *) ":CELL",(void *) s.get_r(),false,9 * sizeof(double));
-  st.bind((char *) ":ZATOMS",(void *) s.get_z(),false,nat * sizeof(unsigned char));
-  st.bind((char *) ":COORDINATES",(void *) s.get_x(),false,3 * nat * sizeof(double));
-
   if (globals::verbose)
     os << "# INSERT STRUCTURE " << skey << std::endl;
 
+  // a structure with this key replaces the alias
+  statement stalias(db,"DELETE FROM Structure_aliases WHERE key = ?1;");
+  stalias.bind(1,skey);
+  stalias.step();
+
   // submit
-  st.step();
+  insert_structure_row(os,st,skey,s,kmap.find("DEDUPE") != kmap.end());
 }
 
 // Insert a property by manually giving the data
@@ -495,23 +1024,19 @@ INSERT INTO Properties (id,key,property_type,setid,orderid,nstructures,structure
   st.bind((char *) ":NSTRUCTURES",nstructures);
 
   // bind the structures
-  {
-    int n = 0;
-    int *str = new int[nstructures];
-    for (auto it = tok1.begin(); it != tok1.end(); it++){
-      int idx = 0;
-      if (isinteger(*it))
-	idx = std::stoi(*it);
-      else
-	idx = find_id_from_key(*it,"Structures");
+  std::vector<int> str;
+  for (auto it = tok1.begin(); it != tok1.end(); it++){
+    int idx = 0;
+    if (isinteger(*it))
+      idx = std::stoi(*it);
+    else
+      idx = find_structure_id(*it);
 
-      if (!idx)
-	throw std::runtime_error("Structure not found (" + *it + ") in INSERT PROPERTY");
-      str[n++] = idx;
-    }
-    st.bind((char *) ":STRUCTURES",(void *) str,true,nstructures * sizeof(int));
-    delete str;
+    if (!idx)
+      throw std::runtime_error("Structure not found (" + *it + ") in INSERT PROPERTY");
+    str.push_back(idx);
   }
+  st.bind((char *) ":STRUCTURES",(void *) str.data(),true,nstructures * sizeof(int));
 
   // bind the coefficients
   if (!tok2.empty()) {
@@ -524,7 +1049,12 @@ INSERT INTO Properties (id,key,property_type,setid,orderid,nstructures,structure
     os << "# INSERT PROPERTY " << key << std::endl;
 
   // submit
-  st.step();
+  begin_transaction();
+  if (st.step() != SQLITE_DONE)
+    throw std::runtime_error("Failed inserting property in INSERT PROPERTY");
+  insert_property_structures(sqlite3_last_insert_rowid(db),nstructures,str.data(),tok2.empty()?nullptr:tok2.data());
+  touch("SET",setid);
+  commit_transaction();
 }
 
 // Insert an evaluation by manually giving the data
@@ -533,7 +1063,7 @@ void sqldb::insert_evaluation(std::ostream &os, const std::unordered_map<std::st
 
   // bind
   std::unordered_map<std::string,std::string>::const_iterator im;
-  statement st(db,"INSERT INTO Evaluations (methodid,propid,value) VALUES(:METHODID,:PROPID,:VALUE)");
+  statement st(db,"INSERT INTO main.Evaluations (methodid,propid,value) VALUES(:METHODID,:PROPID,:VALUE)");
 
   std::string methodkey;
   int methodid;
@@ -563,6 +1093,7 @@ void sqldb::insert_evaluation(std::ostream &os, const std::unordered_map<std::st
 
   // submit
   st.step();
+  touch("METHOD",methodid);
 }
 
 // Insert a term by manually giving the data
@@ -574,13 +1105,13 @@ void sqldb::insert_term(std::ostream &os, const std::unordered_map<std::string,s
   bool reqpropty = true, isterm;
   if (kmap.find("VALUE") != kmap.end()) {
     isterm = true;
-    cmd = "INSERT INTO Terms (methodid,propid,zatom,symbol,l,exponent,exprn,value,maxcoef) VALUES(:METHODID,:PROPID,:ZATOM,:SYMBOL,:L,:EXPONENT,:EXPRN,:VALUE,:MAXCOEF)";
+    cmd = "INSERT INTO main.Terms (methodid,propid,zatom,symbol,l,exponent,exprn,value,maxcoef) VALUES(:METHODID,:PROPID,:ZATOM,:SYMBOL,:L,:EXPONENT,:EXPRN,:VALUE,:MAXCOEF)";
   } else if (kmap.find("MAXCOEF") != kmap.end()){
     isterm = false;
     if (kmap.find("PROPERTY") != kmap.end())
-      cmd = "UPDATE Terms SET maxcoef = :MAXCOEF WHERE methodid = :METHODID AND propid = :PROPID AND zatom = :ZATOM AND symbol = :SYMBOL AND l = :L AND exponent = :EXPONENT AND exprn = :EXPRN";
+      cmd = "UPDATE main.Terms SET maxcoef = :MAXCOEF WHERE methodid = :METHODID AND propid = :PROPID AND zatom = :ZATOM AND symbol = :SYMBOL AND l = :L AND exponent = :EXPONENT AND exprn = :EXPRN";
     else{
-      cmd = "UPDATE Terms SET maxcoef = :MAXCOEF WHERE methodid = :METHODID AND zatom = :ZATOM AND symbol = :SYMBOL AND l = :L AND exponent = :EXPONENT AND exprn = :EXPRN";
+      cmd = "UPDATE main.Terms SET maxcoef = :MAXCOEF WHERE methodid = :METHODID AND zatom = :ZATOM AND symbol = :SYMBOL AND l = :L AND exponent = :EXPONENT AND exprn = :EXPRN";
       reqpropty = false;
     }
   } else
@@ -609,10 +1140,12 @@ void sqldb::insert_term(std::ostream &os, const std::unordered_map<std::string,s
     throw std::runtime_error("A PROPERTY is required in INSERT EVALUATION");
 
   std::string symbol;
+  int iz, il, iexprn = 2;
+  double exponent;
   if ((im = kmap.find("ATOM")) != kmap.end()){
     symbol = im->second;
     symbol.resize(ATSYMBOL_LENGTH,ATSYMBOL_PAD);
-    int iz = zatguess(symbol);
+    iz = zatguess(symbol);
     if (!iz)
       throw std::runtime_error("Unknown atom in INSERT TERM");
     st.bind((char *) ":ZATOM",iz);
@@ -622,24 +1155,25 @@ void sqldb::insert_term(std::ostream &os, const std::unordered_map<std::string,s
     throw std::runtime_error("An atom must be given in INSERT TERM");
   if ((im = kmap.find("L")) != kmap.end())
     if (isinteger(im->second))
-      st.bind((char *) ":L",std::stoi(im->second));
+      il = std::stoi(im->second);
     else{
       std::string l = im->second;
       lowercase(l);
       if (globals::ltoint.find(l) == globals::ltoint.end())
 	throw std::runtime_error("Unknown angular momentum label in INSERT TERM");
-      st.bind((char *) ":L",globals::ltoint.at(l));
+      il = globals::ltoint.at(l);
     }
   else
     throw std::runtime_error("An angular momentum (l) must be given in INSERT TERM");
+  st.bind((char *) ":L",il);
   if ((im = kmap.find("EXPONENT")) != kmap.end())
-    st.bind((char *) ":EXPONENT",std::stod(im->second));
+    exponent = std::stod(im->second);
   else
     throw std::runtime_error("An exponent must be given in INSERT TERM");
+  st.bind((char *) ":EXPONENT",exponent);
   if ((im = kmap.find("EXPRN")) != kmap.end())
-    st.bind((char *) ":EXPRN",std::stod(im->second));
-  else
-    st.bind((char *) ":EXPRN",2);
+    iexprn = std::stoi(im->second);
+  st.bind((char *) ":EXPRN",iexprn);
   if ((im = kmap.find("VALUE")) != kmap.end()){
     std::vector<double> tok = list_all_doubles(im->second);
 
@@ -686,6 +1220,7 @@ WHERE Evaluations.propid = ?1 AND Evaluations.methodid = ?2;
   }
   // submit
   st.step();
+  touch_term(methodid,iz,symbol,il,exponent,iexprn);
 }
 
 // Insert maxcoefs from a file
@@ -710,8 +1245,8 @@ void sqldb::insert_maxcoef(std::ostream &os, const std::unordered_map<std::strin
     throw std::runtime_error("A METHOD is required in INSERT MAXCOEF");
 
   // statements
-  statement sty(db,"UPDATE Terms SET maxcoef = :MAXCOEF WHERE methodid = :METHODID AND propid = :PROPID AND zatom = :ZATOM AND symbol=:SYMBOL AND l = :L AND exponent = :EXPONENT AND exprn = :EXPRN");
-  statement stn(db,"UPDATE Terms SET maxcoef = :MAXCOEF WHERE methodid = :METHODID AND zatom = :ZATOM AND symbol=:SYMBOL AND l = :L AND exponent = :EXPONENT AND exprn = :EXPRN");
+  statement sty(db,"UPDATE main.Terms SET maxcoef = :MAXCOEF WHERE methodid = :METHODID AND propid = :PROPID AND zatom = :ZATOM AND symbol=:SYMBOL AND l = :L AND exponent = :EXPONENT AND exprn = :EXPRN");
+  statement stn(db,"UPDATE main.Terms SET maxcoef = :MAXCOEF WHERE methodid = :METHODID AND zatom = :ZATOM AND symbol=:SYMBOL AND l = :L AND exponent = :EXPONENT AND exprn = :EXPRN");
   statement *st;
 
   // begin the transaction
@@ -722,6 +1257,7 @@ void sqldb::insert_maxcoef(std::ostream &os, const std::unordered_map<std::strin
   if (ifile.fail())
     throw std::runtime_error("In INSERT MAXCOEF, error reading file: " + file);
   std::string line;
+  long int nline = 0;
   while (std::getline(ifile,line)){
     std::string atom, l, exp, exprn, value, propkey;
     std::istringstream iss(line);
@@ -760,6 +1296,13 @@ void sqldb::insert_maxcoef(std::ostream &os, const std::unordered_map<std::strin
     st->bind((char *) ":EXPRN",exprn);
     st->bind((char *) ":MAXCOEF",value);
     st->step();
+    touch_term(methodid,izat,atom,globals::ltoint.at(l),std::stod(exp),std::stoi(exprn));
+
+    // commit in batches to release the lock
+    if (++nline % commit_batch == 0){
+      commit_transaction();
+      begin_transaction();
+    }
   }
   ifile.close();
 
@@ -855,13 +1398,42 @@ void sqldb::insert_calc(std::ostream &os, const std::unordered_map<std::string,s
     throw std::runtime_error("FIXME: property not yet implemented in INSERT TERM ASSUME_ORDER");
   }
 
+  // the values given for an alias belong to the structure it refers
+  // to, unless the file also has them under the structure key
+  {
+    statement stalias(db,R"SQL(
+SELECT Structure_aliases.key, Structures.key
+FROM Structure_aliases
+INNER JOIN Structures ON Structures.id = Structure_aliases.strid;)SQL");
+    while (stalias.step() != SQLITE_DONE){
+      auto it = datmap.find((const char *) sqlite3_column_text(stalias.ptr(),0));
+      std::string key = (const char *) sqlite3_column_text(stalias.ptr(),1);
+      if (it != datmap.end() && datmap.find(key) == datmap.end())
+	datmap[key] = it->second;
+    }
+  }
+
   // consistency check
   if (zat_.size() != l_.size())
     throw std::runtime_error("Inconsistent zat and l arrays in insert_calc");
 
   // begin the transaction and prepare the statements
   begin_transaction();
-  statement stkey(db,"SELECT key, nat FROM Structures WHERE id = ?1;");
+
+  // key and number of atoms of the structures used by properties of this type
+  std::unordered_map<int,std::pair<std::string,int>> strmap;
+  {
+    statement stkey(db,R"SQL(
+SELECT DISTINCT Structures.id, Structures.key, Structures.nat
+FROM Properties
+INNER JOIN Property_structures ON Property_structures.propid = Properties.id
+INNER JOIN Structures ON Structures.id = Property_structures.strid
+WHERE Properties.property_type = ?1;)SQL");
+    stkey.bind(1,ptid);
+    while (stkey.step() != SQLITE_DONE)
+      strmap[sqlite3_column_int(stkey.ptr(),0)] = {std::string((char *) sqlite3_column_text(stkey.ptr(),1)),
+						  sqlite3_column_int(stkey.ptr(),2)};
+  }
   statement ststruct(db,R"SQL(
 SELECT id, nstructures, structures, coefficients
 FROM Properties
@@ -880,9 +1452,9 @@ WHERE Evaluations.propid = ?1 AND Evaluations.methodid = ?2;
   else
     sqlcmd = "INSERT";
   if (doterm)
-    sqlcmd += " INTO Terms (methodid,zatom,symbol,l,exponent,exprn,propid,value) VALUES(:METHOD,:ZATOM,:SYMBOL,:L,:EXP,:EXPRN,:PROPID,:VALUE);";
+    sqlcmd += " INTO main.Terms (methodid,zatom,symbol,l,exponent,exprn,propid,value) VALUES(:METHOD,:ZATOM,:SYMBOL,:L,:EXP,:EXPRN,:PROPID,:VALUE);";
   else
-    sqlcmd += " INTO Evaluations (methodid,propid,value) VALUES(:METHOD,:PROPID,:VALUE);";
+    sqlcmd += " INTO main.Evaluations (methodid,propid,value) VALUES(:METHOD,:PROPID,:VALUE);";
   stinsert.recycle(sqlcmd);
 
   if (doterm){
@@ -899,11 +1471,27 @@ FROM Properties, Training_Set
 WHERE Properties.property_type = ?1 AND Training_Set.propid = Properties.id;)SQL");
 
 
+    // atoms in each structure; the terms for atoms not in the
+    // structure may be missing from the file
+    std::unordered_map<int,std::set<int>> strzat;
+    {
+      statement stzat(db,R"SQL(
+SELECT DISTINCT Structure_atoms.strid, Structure_atoms.zatom
+FROM Properties
+INNER JOIN Property_structures ON Property_structures.propid = Properties.id
+INNER JOIN Structure_atoms ON Structure_atoms.strid = Property_structures.strid
+WHERE Properties.property_type = ?1;)SQL");
+      stzat.bind(1,ptid);
+      while (stzat.step() != SQLITE_DONE)
+	strzat[sqlite3_column_int(stzat.ptr(),0)].insert(sqlite3_column_int(stzat.ptr(),1));
+    }
+
     // build the property map
     long int nprop = 0;
     std::list<std::string> reject, accept;
-    std::unordered_map<int,std::vector<double>> propmap;
-    std::unordered_map<int,int> stridemap;
+    std::map<int,std::vector<double>> propmap;
+    std::map<int,std::vector<bool>> zeromap;
+    std::map<int,int> stridemap;
     ststruct.reset();
     ststruct.bind(1,ptid);
     while (ststruct.step() != SQLITE_DONE){
@@ -914,13 +1502,12 @@ WHERE Properties.property_type = ?1 AND Training_Set.propid = Properties.id;)SQL
       nprop++;
 
       std::vector<double> value;
+      std::vector<int> nmiss(zat_.size(),0);
       bool found = true;
       int nstride = 1;
       for (int i = 0; i < nstr; i++){
-	stkey.reset();
-	stkey.bind(1,istr[i]);
-	stkey.step();
-	std::string strname = (char *) sqlite3_column_text(stkey.ptr(),0);
+	std::string strname = strmap[istr[i]].first;
+	int nat = strmap[istr[i]].second;
 
 	// check the fail conditions
 	bool fail = (datmap.find(strname) == datmap.end());
@@ -929,26 +1516,60 @@ WHERE Properties.property_type = ?1 AND Training_Set.propid = Properties.id;)SQL
 	else if (ptid == globals::ppty_energy)
 	  nstride = 1;
 	else if (ptid == globals::ppty_d1e)
-	  nstride = 3 * sqlite3_column_int(stkey.ptr(),1);
-	else if (ptid == globals::ppty_d2e){
-	  int nat = sqlite3_column_int(stkey.ptr(),1);
+	  nstride = 3 * nat;
+	else if (ptid == globals::ppty_d2e)
 	  nstride = (3 * nat) * (3 * nat + 1) / 2;
+
+	// the data is either the full list of terms or only the terms
+	// for the atoms present in the structure, in the same order
+	std::vector<double> &dat = datmap[strname];
+	std::vector<bool> present(zat_.size(),true);
+	int npresent = zat_.size();
+	if (!fail && nstride*zat_.size()*exp_.size() != dat.size()){
+	  const std::set<int> &zs = strzat[istr[i]];
+	  npresent = 0;
+	  for (int ii = 0; ii < zat_.size(); ii++){
+	    present[ii] = (zs.find(zat_[ii]) != zs.end());
+	    if (present[ii]) npresent++;
+	  }
 	}
-	fail = fail || (nstride*zat_.size()*exp_.size() != datmap[strname].size());
+	fail = fail || (nstride*npresent*exp_.size() != dat.size());
 	if (fail){
 	  found = false;
-	  reject.push_back(strname + " (reason:" + std::to_string(datmap[strname].size()) + " out of " +
+	  reject.push_back(strname + " (reason:" + std::to_string(dat.size()) + " out of " +
 			   std::to_string(zat_.size() * exp_.size()) + " provided)");
 	  break;
 	}
 	accept.push_back(strname);
 
-	value.resize(datmap[strname].size(),0.0);
-	for (int j = 0; j < datmap[strname].size(); j++){
-	  if (coef)
-	    value[j] += coef[i] * datmap[strname][j];
-	  else
-	    value[j] += datmap[strname][j];
+	value.resize(nstride*zat_.size()*exp_.size(),0.0);
+	int k = 0;
+	for (int ii = 0; ii < zat_.size(); ii++){
+	  if (!present[ii]){
+	    nmiss[ii]++;
+	    continue;
+	  }
+	  int j0 = ii * nstride * exp_.size();
+	  for (int j = j0; j < j0 + nstride * exp_.size(); j++){
+	    if (coef)
+	      value[j] += coef[i] * dat[k++];
+	    else
+	      value[j] += dat[k++];
+	  }
+	}
+      }
+
+      // The terms missing in all structures are implicit zeros and
+      // are not stored. With CALCSLOPE, the missing terms would need
+      // the empty energy of the structure, so the property is
+      // rejected if only some of the structures miss them.
+      std::vector<bool> iszero(zat_.size(),false);
+      for (int ii = 0; found && ii < zat_.size(); ii++){
+	iszero[ii] = (nmiss[ii] == nstr);
+	if (doslope && nmiss[ii] > 0 && nmiss[ii] < nstr){
+	  found = false;
+	  reject.push_back(strmap[istr[0]].first + " (reason: CALCSLOPE with missing terms for atom " +
+			   symbol_[ii] + " in some structures)");
 	}
       }
       if (found){
@@ -968,19 +1589,35 @@ WHERE Properties.property_type = ?1 AND Training_Set.propid = Properties.id;)SQL
 	  }
 	}
 	propmap[propid] = value;
+	zeromap[propid] = iszero;
 	stridemap[propid] = nstride;
       }
     }
 
-    // insert into the database
-    long int ninsert = 0;
+    // update the data versions of the inserted columns, in the same
+    // transaction as each batch of rows
+    auto touch_columns = [&](){
+      for (int ii = 0; ii < zat_.size(); ii++)
+	for (int iexp = 0; iexp < exp_.size(); iexp++)
+	  touch_term(methodid,zat_[ii],symbol_[ii],l_[ii],exp_[iexp],exprn_[iexp]);
+    };
+
+    // insert into the database, in propid order, so the properties
+    // committed before a failure are those with the lowest ids
+    long int ninsert = 0, ninsert0 = 0, nzero = 0;
+    long int ndone = 0, ncommit = 0, lastcommit = 0;
     for (auto it = propmap.begin(); it != propmap.end(); it++){
       int n = 0;
       int nstride = stridemap[it->first];
+      const std::vector<bool> &iszero = zeromap[it->first];
       for (int ii = 0; ii < zat_.size(); ii++){
 	for (int iexp = 0; iexp < exp_.size(); iexp++){
-	  ninsert++;
 	  n++;
+	  if (iszero[ii]){
+	    nzero++;
+	    continue;
+	  }
+	  ninsert++;
 	  stinsert.reset();
 	  stinsert.bind((char *) ":METHOD",methodid);
 	  stinsert.bind((char *) ":PROPID",it->first);
@@ -990,7 +1627,14 @@ WHERE Properties.property_type = ?1 AND Training_Set.propid = Properties.id;)SQL
 	  stinsert.bind((char *) ":L",(int) l_[ii]);
 	  stinsert.bind((char *) ":EXP",exp_[iexp]);
 	  stinsert.bind((char *) ":EXPRN",exprn_[iexp]);
-	  if (stinsert.step() != SQLITE_DONE){
+	  std::string err;
+	  try {
+	    if (stinsert.step() != SQLITE_DONE)
+	      err = "unexpected row";
+	  } catch (const std::exception &e) {
+	    err = e.what();
+	  }
+	  if (!err.empty()){
 	    std::cout << "method = " << methodkey << std::endl;
 	    std::cout << "propid = " << it->first << std::endl;
 	    if (nstride == 1)
@@ -998,17 +1642,35 @@ WHERE Properties.property_type = ?1 AND Training_Set.propid = Properties.id;)SQL
 	    else
 	      std::cout << "value = " << it->second[(n-1)*nstride] << " ... " << it->second[n*nstride-1] <<
 		" (" << n << " of " << it->second.size()/nstride << "elements)" << std::endl;
-	    throw std::runtime_error("Failed inserting data in the database (INSERT CALC,assume_order)");
+	    throw std::runtime_error("Failed inserting data in the database (INSERT CALC): " + err + "; " + std::to_string(ncommit) +
+				     " of " + std::to_string(propmap.size()) + " properties committed" +
+				     (ncommit > 0 ? " (propid <= " + std::to_string(lastcommit) + ")" : "") + ", rerun with OR_REPLACE");
 	  }
+
 	}
       }
+
+      // commit in batches of whole properties to release the lock
+      ndone++;
+      if (ninsert - ninsert0 >= commit_batch){
+	touch_columns();
+	commit_transaction();
+	begin_transaction();
+	ninsert0 = ninsert;
+	ncommit = ndone;
+	lastcommit = it->first;
+      }
     }
+    if (ninsert > ninsert0)
+      touch_columns();
 
     // write inserted and rejected
     std::cout << "# Number of terms inserted/rejected/total: " << ninsert << "/"
-	      << nprop * zat_.size() * exp_.size() - ninsert << "/"
+	      << nprop * zat_.size() * exp_.size() - ninsert - nzero << "/"
 	      << nprop * zat_.size() * exp_.size()
 	      << std::endl;
+    if (nzero > 0)
+      std::cout << "# Number of implicit zero terms (atoms not in the structures): " << nzero << std::endl;
     std::cout << "# Number of structures accepted/rejected/total: "
 	      << accept.size() << "/" << reject.size() << "/"
 	      << accept.size() + reject.size() << std::endl;
@@ -1022,7 +1684,7 @@ WHERE Properties.property_type = ?1 AND Training_Set.propid = Properties.id;)SQL
 
     // build the property map
     int nprop = 0;
-    std::unordered_map<int,std::vector<double>> propmap;
+    std::map<int,std::vector<double>> propmap;
     ststruct.reset();
     ststruct.bind(1,ptid);
     while (ststruct.step() != SQLITE_DONE){
@@ -1034,10 +1696,7 @@ WHERE Properties.property_type = ?1 AND Training_Set.propid = Properties.id;)SQL
       bool found = true;
 
       for (int i = 0; i < nstr; i++){
-	stkey.reset();
-	stkey.bind(1,istr[i]);
-	stkey.step();
-	std::string strname = (char *) sqlite3_column_text(stkey.ptr(),0);
+	std::string strname = strmap[istr[i]].first;
 
 	if (datmap.find(strname) == datmap.end()){
 	  found = false;
@@ -1068,7 +1727,9 @@ WHERE Properties.property_type = ?1 AND Training_Set.propid = Properties.id;)SQL
     }
     os << "# Inserted " << nprop << " properties" << std::endl;
 
-    // insert into the database
+    // insert into the database, in propid order, so the properties
+    // committed before a failure are those with the lowest ids
+    long int ninsert = 0, ncommit = 0, lastcommit = 0;
     for (auto it = propmap.begin(); it != propmap.end(); it++){
       stinsert.reset();
       stinsert.bind((char *) ":METHOD",methodid);
@@ -1076,13 +1737,34 @@ WHERE Properties.property_type = ?1 AND Training_Set.propid = Properties.id;)SQL
       stinsert.bind((char *) ":VALUE",(void *) &it->second[0],false,(it->second).size()*sizeof(double));
       if (globals::verbose)
 	os << "# INSERT EVALUATION (method=" << methodkey << ";property=" << it->first << ";nvalue=" << it->second.size() << ")" << std::endl;
-      if (stinsert.step() != SQLITE_DONE){
+      std::string err;
+      try {
+	if (stinsert.step() != SQLITE_DONE)
+	  err = "unexpected row";
+      } catch (const std::exception &e) {
+	err = e.what();
+      }
+      if (!err.empty()){
 	std::cout << "method = " << methodkey << std::endl;
 	std::cout << "propid = " << it->first << std::endl;
 	std::cout << "value = " << it->second[0] << "(" << it->second.size() << "elements)" << std::endl;
-	throw std::runtime_error("Failed inserting data in the database (INSERT CALC)");
+	throw std::runtime_error("Failed inserting data in the database (INSERT CALC): " + err + "; " + std::to_string(ncommit) +
+				 " of " + std::to_string(propmap.size()) + " properties committed" +
+				 (ncommit > 0 ? " (propid <= " + std::to_string(lastcommit) + ")" : "") + ", rerun with OR_REPLACE");
+      }
+
+      // commit in batches to release the lock, with the data version
+      // of the method updated in each batch
+      if (++ninsert % commit_batch == 0){
+	touch("METHOD",methodid);
+	commit_transaction();
+	begin_transaction();
+	ncommit = ninsert;
+	lastcommit = it->first;
       }
     }
+    if (ninsert % commit_batch != 0)
+      touch("METHOD",methodid);
   }
   datmap.clear();
 
@@ -1184,14 +1866,14 @@ void sqldb::insert_set_xyz(std::ostream &os, const std::string &key, const std::
 
   // prepared statements
   statement st(db,R"SQL(
-INSERT INTO Structures (key,ismolecule,charge,multiplicity,nat,cell,zatoms,coordinates)
-       VALUES(:KEY,:ISMOLECULE,:CHARGE,:MULTIPLICITY,:NAT,:CELL,:ZATOMS,:COORDINATES);
+INSERT INTO Structures (key,ismolecule,charge,multiplicity,nat,cell,zatoms,coordinates,hash)
+       VALUES(:KEY,:ISMOLECULE,:CHARGE,:MULTIPLICITY,:NAT,:CELL,:ZATOMS,:COORDINATES,:HASH);
 )SQL");
   statement stp(db,R"SQL(
 INSERT INTO Properties (key,property_type,setid,orderid,nstructures,structures,coefficients)
        VALUES(:KEY,:PROPERTY_TYPE,:SETID,:ORDERID,:NSTRUCTURES,:STRUCTURES,:COEFFICIENTS)
 )SQL");
-  statement stplast(db,"SELECT last_insert_rowid();");
+  bool dedupe = (kmap.find("DEDUPE") != kmap.end());
 
   // prefix
   std::string prefix = key + ".";
@@ -1252,10 +1934,8 @@ INSERT INTO Properties (key,property_type,setid,orderid,nstructures,structures,c
 	std::string filename = file.filename();
 	if (std::regex_match(filename.begin(),filename.end(),rgx)){
 	  std::string skey = std::string(file.stem());
-	  int idx = find_id_from_key(skey,"Structures");
+	  int idx = find_structure_id(skey);
 	  if (idx <= 0) {
-	    st.bind((char *) ":KEY",skey);
-
 	    structure s;
 	    if (ixyz == 0) {
 	      if (s.readxyz(file.string()))
@@ -1264,23 +1944,7 @@ INSERT INTO Properties (key,property_type,setid,orderid,nstructures,structures,c
 	      if (s.readposcar(file.string()))
 		throw std::runtime_error("Error reading file: " + *it);
 	    }
-	    int nat = s.get_nat();
-	    st.bind((char *) ":ISMOLECULE",s.ismolecule()?1:0);
-	    st.bind((char *) ":CHARGE",s.get_charge());
-	    st.bind((char *) ":MULTIPLICITY",s.get_mult());
-	    st.bind((char *) ":NAT",nat);
-	    if (!s.ismolecule())
-	      st.bind((char *) ":CELL",(void *) s.get_r(),false,9 * sizeof(double));
-	    st.bind((char *) ":ZATOMS",(void *) s.get_z(),false,nat * sizeof(unsigned char));
-	    st.bind((char *) ":COORDINATES",(void *) s.get_x(),false,3 * nat * sizeof(double));
-	    if (st.step() != SQLITE_DONE)
-	      throw std::runtime_error("Failed inserting structure in INSERT_SET_XYZ");
-	    if (ppid >= 0){
-	      // get the row id after the last insert
-	      stplast.reset();
-	      stplast.step();
-	      idx = sqlite3_column_int(stplast.ptr(),0);
-	    }
+	    idx = insert_structure_row(os,st,skey,s,dedupe);
 	  }
 
 	  // insert property if requested
@@ -1297,6 +1961,7 @@ INSERT INTO Properties (key,property_type,setid,orderid,nstructures,structures,c
 	    stp.bind((char *) ":COEFFICIENTS",(void *) &coef1,true,sizeof(double));
 	    if (stp.step() != SQLITE_DONE)
 	      throw std::runtime_error("Failed inserting property in INSERT_SET_XYZ");
+	    insert_property_structures(sqlite3_last_insert_rowid(db),1,&idx,&coef1);
 	  }
 	}
       }
@@ -1307,11 +1972,9 @@ INSERT INTO Properties (key,property_type,setid,orderid,nstructures,structures,c
       for (auto it = tokens.begin(); it != tokens.end(); it++){
 	if (fs::is_regular_file(*it)){
 	  std::string skey = std::string(fs::path(*it).stem());
-	  int idx = find_id_from_key(skey,"Structures");
+	  int idx = find_structure_id(skey);
 
 	  if (idx <= 0){
-	    st.bind((char *) ":KEY",skey);
-
 	    structure s;
 	    if (ixyz == 0) {
 	      if (s.readxyz(*it))
@@ -1320,24 +1983,7 @@ INSERT INTO Properties (key,property_type,setid,orderid,nstructures,structures,c
 	      if (s.readposcar(*it))
 		throw std::runtime_error("Error reading file: " + *it);
 	    }
-	    int nat = s.get_nat();
-	    st.bind((char *) ":ISMOLECULE",s.ismolecule()?1:0);
-	    st.bind((char *) ":CHARGE",s.get_charge());
-	    st.bind((char *) ":MULTIPLICITY",s.get_mult());
-	    st.bind((char *) ":NAT",nat);
-	    if (!s.ismolecule())
-	      st.bind((char *) ":CELL",(void *) s.get_r(),false,9 * sizeof(double));
-	    st.bind((char *) ":ZATOMS",(void *) s.get_z(),false,nat * sizeof(unsigned char));
-	    st.bind((char *) ":COORDINATES",(void *) s.get_x(),false,3 * nat * sizeof(double));
-	    if (st.step() != SQLITE_DONE)
-	      throw std::runtime_error("Failed inserting structure in INSERT_SET_XYZ");
-
-	    if (ppid >= 0){
-	      // get the row id after the last insert
-	      stplast.reset();
-	      stplast.step();
-	      idx = sqlite3_column_int(stplast.ptr(),0);
-	    }
+	    idx = insert_structure_row(os,st,skey,s,dedupe);
 	  }
 
 	  // insert property if requested
@@ -1354,6 +2000,7 @@ INSERT INTO Properties (key,property_type,setid,orderid,nstructures,structures,c
 	    stp.bind((char *) ":COEFFICIENTS",(void *) &coef1,true,sizeof(double));
 	    if (stp.step() != SQLITE_DONE)
 	      throw std::runtime_error("Failed inserting property in INSERT_SET_XYZ");
+	    insert_property_structures(sqlite3_last_insert_rowid(db),1,&idx,&coef1);
 	  }
 	} else {
 	  throw std::runtime_error("File or directory not found: " + *it);
@@ -1477,20 +2124,20 @@ void sqldb::insert_set_din(std::ostream &os, const std::string &key, const std::
   // process the entries
   std::unordered_map<std::string,bool> used;
   std::string skey;
+  bool dedupe = (kmap.find("DEDUPE") != kmap.end());
   for (int k = 0; k < info.size(); k++){
 
     // insert structures
     statement st(db,R"SQL(
-INSERT INTO Structures (key,ismolecule,charge,multiplicity,nat,cell,zatoms,coordinates)
-       VALUES(:KEY,:ISMOLECULE,:CHARGE,:MULTIPLICITY,:NAT,:CELL,:ZATOMS,:COORDINATES);
+INSERT INTO Structures (key,ismolecule,charge,multiplicity,nat,cell,zatoms,coordinates,hash)
+       VALUES(:KEY,:ISMOLECULE,:CHARGE,:MULTIPLICITY,:NAT,:CELL,:ZATOMS,:COORDINATES,:HASH);
 )SQL");
     int n = info[k].names.size();
     for (int i = 0; i < n; i++){
       if (used.find(info[k].names[i]) == used.end()){
 	skey = info[k].names[i];
-	int idx = find_id_from_key(skey,"Structures");
+	int idx = find_structure_id(skey);
 	if (idx > 0) continue;
-	st.bind((char *) ":KEY",skey);
 
 	structure s;
 	std::string filename = dir + "/" + info[k].names[i] + ".xyz";
@@ -1504,17 +2151,7 @@ INSERT INTO Structures (key,ismolecule,charge,multiplicity,nat,cell,zatoms,coord
 	  if (s.readxyz(filename))
 	    throw std::runtime_error("Error reading file: " + filename);
 	}
-	int nat = s.get_nat();
-	st.bind((char *) ":ISMOLECULE",s.ismolecule()?1:0);
-	st.bind((char *) ":CHARGE",s.get_charge());
-	st.bind((char *) ":MULTIPLICITY",s.get_mult());
-	st.bind((char *) ":NAT",nat);
-	if (!s.ismolecule())
-	  st.bind((char *) ":CELL",(void *) s.get_r(),false,9 * sizeof(double));
-	st.bind((char *) ":ZATOMS",(void *) s.get_z(),false,nat * sizeof(unsigned char));
-	st.bind((char *) ":COORDINATES",(void *) s.get_x(),false,3 * nat * sizeof(double));
-	if (st.step() != SQLITE_DONE)
-	  throw std::runtime_error("Failed inserting structure in INSERT_SET_XYZ");
+	insert_structure_row(os,st,skey,s,dedupe);
 	used[info[k].names[i]] = true;
       }
     }
@@ -1542,17 +2179,18 @@ INSERT INTO Properties (id,key,property_type,setid,orderid,nstructures,structure
     double coef[n];
     for (int i = 0; i < n; i++){
       std::string strkey = info[k].names[i];
-      strid[i] = find_id_from_key(strkey,"Structures");
+      strid[i] = find_structure_id(strkey);
       coef[i] = info[k].coefs[i];
     }
     st.bind((char *) ":STRUCTURES",(void *) &strid,false,n * sizeof(int));
     st.bind((char *) ":COEFFICIENTS",(void *) &coef,false,n * sizeof(double));
     if (st.step() != SQLITE_DONE)
       throw std::runtime_error("Failed inserting property in INSERT_SET_XYZ");
+    insert_property_structures(sqlite3_last_insert_rowid(db),n,strid,coef);
 
     // insert the evaluation
     if (havemethod){
-      st.recycle("INSERT INTO Evaluations (methodid,propid,value) VALUES(:METHODID,:PROPID,:VALUE)");
+      st.recycle("INSERT INTO main.Evaluations (methodid,propid,value) VALUES(:METHODID,:PROPID,:VALUE)");
       std::string methodkey;
       int methodid;
       if (!get_key_and_id(kmap.at("METHOD"),"Methods",methodkey,methodid))
@@ -1571,6 +2209,14 @@ INSERT INTO Properties (id,key,property_type,setid,orderid,nstructures,structure
     }
   }
 
+  // update the data version of the method
+  if (havemethod){
+    std::string methodkey;
+    int methodid;
+    if (get_key_and_id(kmap.at("METHOD"),"Methods",methodkey,methodid))
+      touch("METHOD",methodid);
+  }
+
   // commit the transaction
   commit_transaction();
 }
@@ -1580,7 +2226,7 @@ void sqldb::copy_method(std::ostream &os, const std::unordered_map<std::string,s
   if (!db) throw std::runtime_error("A database file must be connected before using INSERT METHOD");
 
   statement st(db,R"SQL(
-INSERT OR REPLACE INTO Evaluations (methodid, propid, value)
+INSERT OR REPLACE INTO main.Evaluations (methodid, propid, value)
 SELECT :TARGET, propid, value
 FROM Evaluations
 WHERE methodid = :SOURCE;
@@ -1606,7 +2252,7 @@ WHERE methodid = :SOURCE;
   st.reset();
 
   st.recycle(R"SQL(
-INSERT OR REPLACE INTO Terms (methodid, zatom, symbol, l, exponent, exprn, propid, value, maxcoef)
+INSERT OR REPLACE INTO main.Terms (methodid, zatom, symbol, l, exponent, exprn, propid, value, maxcoef)
 SELECT :TARGET, zatom, symbol, l, exponent, exprn, propid, value, maxcoef
 FROM Terms
 WHERE methodid = :SOURCE;
@@ -1615,6 +2261,10 @@ WHERE methodid = :SOURCE;
   st.bind((char *) ":TARGET",targetid);
   st.step();
   st.reset();
+
+  // update the data versions of the target method
+  touch("METHOD",targetid);
+  touch_terms(targetid);
 }
 
 // Calculate energy differences from total energies
@@ -1624,17 +2274,19 @@ SELECT id, nstructures, structures, coefficients
 FROM Properties
 WHERE property_type = 1;)SQL");
   statement stetot(db,R"SQL(
-SELECT id
-FROM Properties
-WHERE property_type = 2 AND nstructures = 1 AND structures = :ID;)SQL");
+SELECT Properties.id
+FROM Property_structures
+INNER JOIN Properties ON Properties.id = Property_structures.propid
+WHERE Property_structures.strid = :ID AND Properties.property_type = 2 AND Properties.nstructures = 1;)SQL");
   statement stinsert(db,R"SQL(
-INSERT OR REPLACE into Evaluations (methodid,propid,value) VALUES (?1,?2,?3);
+INSERT OR REPLACE into main.Evaluations (methodid,propid,value) VALUES (?1,?2,?3);
 )SQL");
 
   // begin the transaction
   begin_transaction();
 
   // run over energy_difference properties
+  std::set<int> methods;
   while (stedif.step() != SQLITE_DONE){
     int propid = sqlite3_column_int(stedif.ptr(),0);
     int nstr = sqlite3_column_int(stedif.ptr(),1);
@@ -1646,7 +2298,7 @@ INSERT OR REPLACE into Evaluations (methodid,propid,value) VALUES (?1,?2,?3);
     int iprop[nstr];
     for (int i = 0; i < nstr; i++){
       stetot.reset();
-      stetot.bind(1,(void *) &(istr[i]),false,sizeof(int));
+      stetot.bind(1,istr[i]);
       stetot.step();
       if (sqlite3_column_type(stetot.ptr(),0) == SQLITE_NULL){
 	found = false;
@@ -1691,10 +2343,15 @@ INSERT OR REPLACE into Evaluations (methodid,propid,value) VALUES (?1,?2,?3);
 	stinsert.bind(3,(void *) &de,false,sizeof(double));
 	if (stinsert.step() != SQLITE_DONE)
 	  throw std::runtime_error("Failed inserting evaluation in CALC_EDIFF");
+	methods.insert(methodid);
       }
     }
   }
 
+  // update the data versions of the methods
+  for (auto it = methods.begin(); it != methods.end(); it++)
+    touch("METHOD",*it);
+
   // commit the transaction
   commit_transaction();
 }
@@ -1724,25 +2381,43 @@ void sqldb::erase(std::ostream &os, const std::string &category, const std::list
 
   // execute
   if (category == "MAXCOEF") {
-    statement st(db,"UPDATE Terms SET maxcoef = NULL");
+    statement st(db,"UPDATE main.Terms SET maxcoef = NULL");
     st.step();
+    touch_terms(-1);
   } else if (tokens.empty()){
-    statement st(db,"DELETE FROM " + table + ";");
+    // update the data versions of everything that depends on the table
+    if (category == "SET" || category == "METHOD" || category == "PROPERTY" || category == "EVALUATION")
+      touch_ids("METHOD","SELECT id FROM Methods");
+    if (category == "SET" || category == "PROPERTY")
+      touch_ids("SET","SELECT id FROM Sets");
+    if (category == "SET" || category == "METHOD" || category == "PROPERTY" || category == "TERM")
+      touch_terms(-1);
+
+    statement st(db);
+    if (category == "SET" || category == "METHOD" || category == "PROPERTY")
+      st.recycle("BEGIN TRANSACTION; DELETE FROM main.Terms; DELETE FROM main.Evaluations; DELETE FROM main." + table + "; COMMIT TRANSACTION;");
+    else
+      st.recycle("DELETE FROM main." + table + ";");
     st.execute();
+  } else if (category == "SET" || category == "METHOD" || category == "PROPERTY") {
+    erase_bulk(os,category,table,tokens);
   } else if (category == "EVALUATION") {
-    statement st(db,"DELETE FROM Evaluations WHERE methodid = (SELECT id FROM Methods WHERE key = ?1) AND propid = (SELECT id FROM Properties WHERE key = ?2);");
+    statement st(db,"DELETE FROM main.Evaluations WHERE methodid = (SELECT id FROM Methods WHERE key = ?1) AND propid = (SELECT id FROM Properties WHERE key = ?2);");
     for (auto it = tokens.begin(); it != tokens.end(); it++){
       if (globals::verbose)
 	os << "# DELETE " << category << " (method=" << *it;
+      int methodid = find_id_from_key(*it,"Methods");
       st.bind(1,*it++);
       if (globals::verbose)
 	os << ";property=" << *it << ")" << std::endl;
       st.bind(2,*it);
       st.step();
+      if (methodid)
+	touch("METHOD",methodid);
     }
   } else if (category == "TERM") {
     statement st(db,R"SQL(
-DELETE FROM Terms WHERE
+DELETE FROM main.Terms WHERE
   methodid = (SELECT id FROM Methods WHERE key = ?1) AND
   propid = (SELECT id FROM Properties WHERE key = ?2) AND
   zatom = ?3 AND symbol = ?4 AND l = ?5 AND exponent = ?6 AND exprn = ?7;
@@ -1750,6 +2425,7 @@ DELETE FROM Terms WHERE
     for (auto it = tokens.begin(); it != tokens.end(); it++){
       if (globals::verbose)
 	os << "# DELETE " << category << " (method=" << *it;
+      int methodid = find_id_from_key(*it,"Methods");
       st.bind(1,*it++);
       if (globals::verbose)
 	os << ";property=" << *it;
@@ -1767,18 +2443,22 @@ DELETE FROM Terms WHERE
 
       if (globals::verbose)
 	os << ";l=" << *it;
-      st.bind(5,std::stoi(*it++));
+      int l = std::stoi(*it++);
+      st.bind(5,l);
       if (globals::verbose)
 	os << ";exp=" << *it << ")" << std::endl;
-      st.bind(6,std::stod(*it++));
+      double exp = std::stod(*it++);
+      st.bind(6,exp);
       if (globals::verbose)
 	os << ";exprn=" << *it << ")" << std::endl;
       st.bind(7,std::stod(*it));
       st.step();
+      if (methodid)
+	touch_term(methodid,iz,atom,l,exp,std::stoi(*it));
     }
   } else {
-    statement st_id(db,"DELETE FROM " + table + " WHERE id = ?1;");
-    statement st_key(db,"DELETE FROM " + table + " WHERE key = ?1;");
+    statement st_id(db,"DELETE FROM main." + table + " WHERE id = ?1;");
+    statement st_key(db,"DELETE FROM main." + table + " WHERE key = ?1;");
     for (auto it = tokens.begin(); it != tokens.end(); it++){
       if (globals::verbose)
 	os << "# DELETE " << category << " " << *it << std::endl;
@@ -1794,6 +2474,111 @@ DELETE FROM Terms WHERE
   os << std::endl;
 }
 
+// Delete the sets, methods, or properties given by the tokens (ids
+// or keys) from the table, together with their evaluations and
+// terms. The victims are collected in temporary tables and the
+// dependent rows are deleted in batches of properties using the
+// indexes, so the foreign key cascade on the parent rows has nothing
+// left to scan. Each batch is a separate transaction, so the write
+// lock is released between batches, and the data versions of the
+// affected methods, sets, and terms columns are updated in the same
+// transaction as the rows.
+void sqldb::erase_bulk(std::ostream &os, const std::string &category, const std::string &table, const std::list<std::string> &tokens){
+  const size_t batchsize = 1000;
+
+  begin_transaction();
+
+  // collect the ids of the deleted rows
+  statement st(db,R"SQL(
+CREATE TEMP TABLE IF NOT EXISTS Erase_ids (id INTEGER PRIMARY KEY);
+CREATE TEMP TABLE IF NOT EXISTS Erase_props (id INTEGER PRIMARY KEY);
+DELETE FROM temp.Erase_ids;
+DELETE FROM temp.Erase_props;
+)SQL");
+  st.execute();
+  statement st_id(db,"INSERT OR IGNORE INTO temp.Erase_ids SELECT id FROM " + table + " WHERE id = ?1;");
+  statement st_key(db,"INSERT OR IGNORE INTO temp.Erase_ids SELECT id FROM " + table + " WHERE key = ?1;");
+  for (auto it = tokens.begin(); it != tokens.end(); it++){
+    if (globals::verbose)
+      os << "# DELETE " << category << " " << *it << std::endl;
+    if (isinteger(*it)){
+      st_id.bind(1,*it);
+      st_id.step();
+    } else {
+      st_key.bind(1,*it);
+      st_key.step();
+    }
+  }
+
+  // collect the affected properties, in order
+  std::string cond;
+  if (category == "METHOD"){
+    st.recycle("SELECT id FROM Properties ORDER BY id;");
+    cond = "methodid IN (SELECT id FROM temp.Erase_ids)";
+  } else {
+    if (category == "SET")
+      st.recycle("INSERT INTO temp.Erase_props SELECT id FROM Properties WHERE setid IN (SELECT id FROM temp.Erase_ids);");
+    else
+      st.recycle("INSERT INTO temp.Erase_props SELECT id FROM temp.Erase_ids;");
+    st.execute();
+    st.recycle("SELECT id FROM temp.Erase_props ORDER BY id;");
+    cond = "propid IN (SELECT id FROM temp.Erase_props)";
+  }
+  std::vector<int> propid;
+  while (st.step() != SQLITE_DONE)
+    propid.push_back(sqlite3_column_int(st.ptr(),0));
+  commit_transaction();
+
+  // update the data versions of the methods, sets, and terms columns
+  // affected by the deletion of the properties with ids between lo
+  // and hi
+  auto touch_range = [&](int lo, int hi){
+    if (category == "METHOD"){
+      touch_ids("METHOD","SELECT id FROM temp.Erase_ids");
+    } else {
+      std::string range = " BETWEEN " + std::to_string(lo) + " AND " + std::to_string(hi) + " AND ";
+      touch_ids("SET","SELECT DISTINCT setid AS id FROM Properties WHERE id" + range + "id IN (SELECT id FROM temp.Erase_props)");
+      touch_ids("METHOD","SELECT DISTINCT methodid AS id FROM Evaluations WHERE propid" + range + cond);
+      touch_terms_where("propid" + range + cond);
+    }
+  };
+
+  // delete the terms and evaluations in batches of properties,
+  // report progress if there is more than one batch
+  statement st_terms(db,"DELETE FROM main.Terms WHERE propid BETWEEN ?1 AND ?2 AND " + cond + ";");
+  statement st_evals(db,"DELETE FROM main.Evaluations WHERE propid BETWEEN ?1 AND ?2 AND " + cond + ";");
+  size_t nterms = 0, nevals = 0;
+  for (size_t i = 0; i < propid.size(); i += batchsize){
+    size_t iend = std::min(i + batchsize,propid.size());
+    begin_transaction();
+    touch_range(propid[i],propid[iend-1]);
+    st_terms.bind(1,propid[i]);
+    st_terms.bind(2,propid[iend-1]);
+    st_terms.step();
+    nterms += sqlite3_changes(db);
+    st_evals.bind(1,propid[i]);
+    st_evals.bind(2,propid[iend-1]);
+    st_evals.step();
+    nevals += sqlite3_changes(db);
+    commit_transaction();
+    if (globals::verbose && propid.size() > batchsize)
+      os << "# DELETE " << category << ": " << iend << "/" << propid.size() << " properties processed, "
+	 << nterms << " terms and " << nevals << " evaluations deleted" << std::endl;
+  }
+
+  // delete the rows themselves
+  begin_transaction();
+  if (!propid.empty())
+    touch_range(propid.front(),propid.back());
+  else if (category == "METHOD")
+    touch_ids("METHOD","SELECT id FROM temp.Erase_ids");
+  st.recycle("DELETE FROM main." + table + " WHERE id IN (SELECT id FROM temp.Erase_ids);");
+  st.execute();
+  st.recycle("DELETE FROM temp.Erase_ids; DELETE FROM temp.Erase_props;");
+  st.execute();
+  commit_transaction();
+}
+
 // List items from the database
 void sqldb::print(std::ostream &os, const std::string &category, bool dobib){
   if (!db) throw std::runtime_error("A database file must be connected before using LIST");
@@ -1841,6 +2626,27 @@ ORDER BY id;
 SELECT id,key,ismolecule,charge,multiplicity,nat,cell,zatoms,coordinates
 FROM Structures
 ORDER BY id;
+)SQL";
+  } else if (category == "ALIAS"){
+    headers = {  "key","strid","structure"};
+    types   = {  t_str,  t_int,      t_str};
+    cols    = {      0,      1,          2};
+    stmt = R"SQL(
+SELECT Structure_aliases.key, Structure_aliases.strid, Structures.key
+FROM Structure_aliases
+INNER JOIN Structures ON Structures.id = Structure_aliases.strid
+ORDER BY Structure_aliases.strid, Structure_aliases.key;
+)SQL";
+  } else if (category == "DUPLICATES"){
+    headers = { "hash","nstructures","ids","keys"};
+    types   = {  t_str,        t_int,t_str, t_str};
+    cols    = {      0,            1,    2,     3};
+    stmt = R"SQL(
+SELECT hash, COUNT(id), group_concat(id,' '), group_concat(key,' ')
+FROM (SELECT id, key, hash FROM Structures WHERE hash IS NOT NULL ORDER BY id)
+GROUP BY hash
+HAVING COUNT(id) > 1
+ORDER BY MIN(id);
 )SQL";
   } else if (category == "PROPERTY"){
     headers = { "id","key","property_type","setid","orderid","nstructures"};
@@ -2113,6 +2919,337 @@ ORDER BY Properties.orderid;
   os << std::endl;
 }
 
+// Rebuild the Terms table as a WITHOUT ROWID table, with the rows
+// inserted in primary key order (term, then property). Must be run
+// inside a transaction.
+void sqldb::rebuild_terms(){
+  statement st(db,R"SQL(
+CREATE TABLE Terms_repack (
+  methodid      INTEGER NOT NULL,
+  zatom         INTEGER NOT NULL,
+  symbol        TEXT NOT NULL,
+  l             INTEGER NOT NULL,
+  exponent      REAL NOT NULL,
+  exprn         INTEGER NOT NULL,
+  propid        INTEGER NOT NULL,
+  value         BLOB NOT NULL,
+  maxcoef       REAL,
+  PRIMARY KEY(methodid,zatom,symbol,l,exponent,exprn,propid),
+  FOREIGN KEY(methodid) REFERENCES Methods(id) ON DELETE CASCADE,
+  FOREIGN KEY(propid) REFERENCES Properties(id) ON DELETE CASCADE
+) WITHOUT ROWID;
+INSERT INTO Terms_repack (methodid,zatom,symbol,l,exponent,exprn,propid,value,maxcoef)
+  SELECT methodid,zatom,symbol,l,exponent,exprn,propid,value,maxcoef FROM main.Terms
+  ORDER BY methodid,zatom,symbol,l,exponent,exprn,propid;
+DROP TABLE main.Terms;
+ALTER TABLE Terms_repack RENAME TO Terms;
+CREATE INDEX Terms_propid_idx ON Terms (propid);
+)SQL");
+  st.execute();
+}
+
+// Rebuild the Terms table, so the pages of the table and its index
+// are filled and in order, and compact the database file.
+void sqldb::repack(std::ostream &os){
+  if (!db) throw std::runtime_error("A database file must be connected before using REPACK");
+
+  // the views on the attached databases are rebuilt afterwards
+  update_views(false);
+
+  begin_transaction();
+  statement st(db,"SELECT COUNT(*) FROM main.Terms;");
+  st.step();
+  long int nterms = sqlite3_column_int64(st.ptr(),0);
+  st.reset();
+  rebuild_terms();
+  commit_transaction();
+  if (globals::verbose)
+    os << "# REPACK Terms: " << nterms << " rows" << std::endl;
+
+  st.recycle("VACUUM; ANALYZE main;");
+  st.execute();
+  update_views();
+  os << std::endl;
+}
+
+// Run an SQL statement on the database and print the resulting
+// rows. BLOB columns are interpreted as arrays of doubles. Only one
+// statement is accepted, and it must not modify the database
+// because the data versions would not be updated.
+void sqldb::sql(std::ostream &os, const std::string &cmd){
+  if (!db) throw std::runtime_error("A database file must be connected before using SQL");
+  if (cmd.empty())
+    throw std::runtime_error("Empty statement in SQL");
+
+  statement st(db,cmd);
+  st.prepare();
+  if (!st)
+    throw std::runtime_error("Empty statement in SQL");
+  if (st.get_tail().find_first_not_of(" \t\n\r;") != std::string::npos)
+    throw std::runtime_error("Only one statement is allowed in SQL");
+  if (!sqlite3_stmt_readonly(st.ptr()))
+    throw std::runtime_error("SQL statements that modify the database are not allowed (use INSERT, DELETE, etc.)");
+
+  // the format of the numbers does not depend on the previous output
+  bool header = true;
+  std::ios_base::fmtflags flags = os.flags();
+  std::streamsize prec = os.precision(10);
+  os << std::defaultfloat;
+  while (st.step() != SQLITE_DONE){
+    int n = sqlite3_column_count(st.ptr());
+
+    // print the header
+    if (header){
+      for (int i = 0; i < n; i++)
+	os << "| " << sqlite3_column_name(st.ptr(),i);
+      os << "|" << std::endl;
+      header = false;
+    }
+
+    // print the row
+    for (int i = 0; i < n; i++){
+      int type = sqlite3_column_type(st.ptr(),i);
+      if (type == SQLITE_INTEGER)
+	os << "| " << sqlite3_column_int64(st.ptr(),i);
+      else if (type == SQLITE_FLOAT)
+	os << "| " << sqlite3_column_double(st.ptr(),i);
+      else if (type == SQLITE_TEXT)
+	os << "| " << sqlite3_column_text(st.ptr(),i);
+      else if (type == SQLITE_BLOB){
+	int nval = sqlite3_column_bytes(st.ptr(),i) / sizeof(double);
+	double *ptr = (double *) sqlite3_column_blob(st.ptr(),i);
+	if (nval == 1)
+	  os << "| " << ptr[0];
+	else if (nval > 1)
+	  os << "| " << ptr[0] << " ... " << ptr[nval-1] << " (" << nval << " values)";
+	else
+	  os << "| ";
+      } else
+	os << "| NULL";
+    }
+    os << "|" << std::endl;
+  }
+  os.flags(flags);
+  os.precision(prec);
+  os << std::endl;
+}
+
+// Find near-duplicate molecular structures: molecules with the same
+// charge, multiplicity, and composition whose interatomic distances,
+// sorted by the pair of elements they join, differ by at most tol
+// (angstrom). The molecules are grouped by composition and each
+// molecule is compared with the representatives (the molecules that
+// are not near-duplicates) of lower id. If merge, replace each
+// near-duplicate by its representative and keep its key as an
+// alias, unless it is used by a property that depends on the
+// orientation or the atom order.
+void sqldb::similar(std::ostream &os, double tol, bool merge){
+  if (!db) throw std::runtime_error("A database file must be connected before using SIMILAR");
+  if (tol < 0)
+    throw std::runtime_error("The tolerance in SIMILAR must be positive");
+
+  // group the molecules by charge, multiplicity, and composition
+  std::map<std::string,std::vector<int>> groups;
+  statement st(db,"SELECT id, charge, multiplicity, nat, zatoms FROM Structures WHERE ismolecule = 1 ORDER BY id;");
+  while (st.step() != SQLITE_DONE){
+    int nat = sqlite3_column_int(st.ptr(),3);
+    std::string comp((const char *) sqlite3_column_blob(st.ptr(),4),nat);
+    std::sort(comp.begin(),comp.end());
+    std::string gkey = std::to_string(sqlite3_column_int(st.ptr(),1)) + " " +
+      std::to_string(sqlite3_column_int(st.ptr(),2)) + " " + comp;
+    groups[gkey].push_back(sqlite3_column_int(st.ptr(),0));
+  }
+
+  // maximum deviation between two distance lists, sorted by element
+  // pair and then by distance, stopping when it exceeds stop. The
+  // molecules in a group have the same composition, so the lists
+  // have the same element pairs in the same positions.
+  typedef std::vector<std::pair<int,double>> distlist;
+  auto maxdev = [](const distlist &a, const distlist &b, double stop) -> double {
+    double dev = 0;
+    for (int k = 0; k < a.size() && dev <= stop; k++)
+      dev = std::max(dev,std::abs(a[k].second - b[k].second));
+    return dev;
+  };
+
+  // find the near-duplicates in each group
+  std::vector<std::array<int,2>> dup; // near-duplicate and representative ids
+  std::vector<double> dupdev;
+  int ngroup = 0;
+  st.recycle("SELECT nat, coordinates, zatoms FROM Structures WHERE id = ?1;");
+  for (auto it = groups.begin(); it != groups.end(); it++){
+    const std::vector<int> &ids = it->second;
+    int n = ids.size();
+    if (n < 2) continue;
+
+    // interatomic distances labeled by the pair of elements they
+    // join, sorted by element pair and then by distance, and the
+    // largest distance
+    std::vector<distlist> d(n);
+    std::vector<double> dmax(n,0.);
+    for (int i = 0; i < n; i++){
+      st.reset();
+      st.bind(1,ids[i]);
+      st.step();
+      int nat = sqlite3_column_int(st.ptr(),0);
+      const double *x = (const double *) sqlite3_column_blob(st.ptr(),1);
+      const unsigned char *z = (const unsigned char *) sqlite3_column_blob(st.ptr(),2);
+      for (int j = 0; j < nat; j++)
+	for (int k = j+1; k < nat; k++){
+	  double dd = std::sqrt((x[3*j]-x[3*k])*(x[3*j]-x[3*k]) + (x[3*j+1]-x[3*k+1])*(x[3*j+1]-x[3*k+1]) +
+				(x[3*j+2]-x[3*k+2])*(x[3*j+2]-x[3*k+2]));
+	  d[i].push_back({256 * std::min(z[j],z[k]) + std::max(z[j],z[k]),dd});
+	  dmax[i] = std::max(dmax[i],dd);
+	}
+      std::sort(d[i].begin(),d[i].end());
+    }
+    st.reset();
+
+    // assign the molecules in order of id: each one is a
+    // near-duplicate of the representative with the lowest id within
+    // tol, or it becomes a representative itself. The comparison is
+    // always with the representative, so every near-duplicate is
+    // within tol of the structure that replaces it. The
+    // representatives are sorted by their largest distance, and only
+    // those within tol of the molecule in that distance are compared.
+    std::multimap<double,int> reps;
+    std::vector<int> root(n);
+    for (int i = 0; i < n; i++){
+      root[i] = i;
+      for (auto r = reps.lower_bound(dmax[i] - tol); r != reps.end() && r->first <= dmax[i] + tol; r++)
+	if (r->second < root[i] && maxdev(d[i],d[r->second],tol) <= tol)
+	  root[i] = r->second;
+      if (root[i] == i)
+	reps.insert({dmax[i],i});
+    }
+
+    // list the near-duplicates with their representative
+    bool found = false;
+    for (int i = 0; i < n; i++){
+      int r = root[i];
+      if (r == i) continue;
+      found = true;
+      dup.push_back({ids[i],ids[r]});
+      dupdev.push_back(maxdev(d[i],d[r],HUGE_VAL));
+    }
+    if (found) ngroup++;
+  }
+
+  // report
+  os << "# Near-duplicate molecules (tolerance = " << tol << " angstrom)" << std::endl;
+  os << "| id | key | duplicate of id | key | max. deviation |" << std::endl;
+  std::streamsize prec = os.precision(4);
+  std::vector<std::string> dupkey(dup.size()), repkey(dup.size());
+  for (int i = 0; i < dup.size(); i++){
+    dupkey[i] = find_key_from_id(dup[i][0],"Structures");
+    repkey[i] = find_key_from_id(dup[i][1],"Structures");
+    os << "| " << dup[i][0] << " | " << dupkey[i] << " | " << dup[i][1] << " | " << repkey[i]
+       << " | " << std::scientific << dupdev[i] << std::defaultfloat << " |" << std::endl;
+  }
+  os.precision(prec);
+  os << "# Found " << dup.size() << " near-duplicates in " << ngroup << " groups" << std::endl;
+  if (!merge || dup.empty()) {
+    os << std::endl;
+    return;
+  }
+
+  // merge the near-duplicates into their representatives. The
+  // near-duplicates may be rotated, translated, or have their atoms
+  // in a different order, so those used by properties whose values
+  // depend on the orientation or on the atom order (all but the
+  // energies and orbital energies) are not merged.
+  begin_transaction();
+  statement stkind(db,R"SQL(
+SELECT Properties.key, Property_types.key
+FROM Property_structures
+INNER JOIN Properties ON Properties.id = Property_structures.propid
+INNER JOIN Property_types ON Property_types.id = Properties.property_type
+WHERE Property_structures.strid = ?1 AND Property_types.key NOT IN ('ENERGY_DIFFERENCE','ENERGY','HOMO','LUMO')
+LIMIT 1;)SQL");
+  statement stprop(db,"SELECT DISTINCT propid FROM Property_structures WHERE strid = ?1;");
+  statement stget(db,"SELECT nstructures, structures, coefficients FROM Properties WHERE id = ?1;");
+  statement stset(db,"UPDATE Properties SET structures = ?2 WHERE id = ?1;");
+  statement stalias(db,"UPDATE Structure_aliases SET strid = ?2 WHERE strid = ?1;");
+  statement stins(db,"INSERT OR REPLACE INTO Structure_aliases (key,strid) VALUES(?1,?2);");
+  statement stdel(db,"DELETE FROM Structures WHERE id = ?1;");
+  std::set<int> props;
+  int nmerged = 0;
+  for (int i = 0; i < dup.size(); i++){
+    stkind.bind(1,dup[i][0]);
+    if (stkind.step() == SQLITE_ROW){
+      os << "# Not merged: " << dupkey[i] << " is used by property " << (const char *) sqlite3_column_text(stkind.ptr(),0)
+	 << " (" << (const char *) sqlite3_column_text(stkind.ptr(),1) << ")" << std::endl;
+      stkind.reset();
+      continue;
+    }
+    nmerged++;
+
+    // properties that use the near-duplicate
+    std::vector<int> plist;
+    stprop.bind(1,dup[i][0]);
+    while (stprop.step() != SQLITE_DONE)
+      plist.push_back(sqlite3_column_int(stprop.ptr(),0));
+
+    // replace it in their list of structures
+    for (int j = 0; j < plist.size(); j++){
+      stget.bind(1,plist[j]);
+      stget.step();
+      int nstr = sqlite3_column_int(stget.ptr(),0);
+      std::vector<int> strid((const int *) sqlite3_column_blob(stget.ptr(),1),(const int *) sqlite3_column_blob(stget.ptr(),1) + nstr);
+      const double *cptr = (const double *) sqlite3_column_blob(stget.ptr(),2);
+      std::vector<double> coef;
+      if (cptr)
+	coef.assign(cptr,cptr+nstr);
+      stget.reset();
+
+      std::replace(strid.begin(),strid.end(),dup[i][0],dup[i][1]);
+
+      // warn if the representative now appears more than once, and
+      // if its coefficients cancel (for instance, an energy
+      // difference between two merged conformers)
+      if (std::count(strid.begin(),strid.end(),dup[i][1]) > 1){
+	double csum = 0;
+	for (int k = 0; k < nstr; k++)
+	  if (strid[k] == dup[i][1])
+	    csum += cptr ? coef[k] : 1.;
+	os << "# WARNING: property " << find_key_from_id(plist[j],"Properties") << " uses structure " << repkey[i]
+	   << " more than once after the merge";
+	if (cptr && std::abs(csum) < 1e-10)
+	  os << " (its contributions cancel)";
+	os << std::endl;
+      }
+
+      stset.bind(1,plist[j]);
+      stset.bind(2,(void *) strid.data(),true,nstr * sizeof(int));
+      stset.step();
+      insert_property_structures(plist[j],nstr,strid.data(),cptr?coef.data():nullptr);
+      props.insert(plist[j]);
+    }
+
+    // keep the key as an alias and delete the structure
+    stalias.bind(1,dup[i][0]);
+    stalias.bind(2,dup[i][1]);
+    stalias.step();
+    stins.bind(1,dupkey[i]);
+    stins.bind(2,dup[i][1]);
+    stins.step();
+    stdel.bind(1,dup[i][0]);
+    stdel.step();
+  }
+
+  // update the data versions of the sets with modified properties
+  if (!props.empty()){
+    std::string plist;
+    for (auto it = props.begin(); it != props.end(); it++)
+      plist += (plist.empty()?"":",") + std::to_string(*it);
+    touch_ids("SET","SELECT DISTINCT setid AS id FROM Properties WHERE id IN (" + plist + ")");
+  }
+  commit_transaction();
+
+  os << "# Merged " << nmerged << " structures (" << props.size() << " properties modified)" << std::endl;
+  os << std::endl;
+}
+
 // Verify the consistency of the database
 void sqldb::verify(std::ostream &os){
   if (!db) throw std::runtime_error("A database file must be connected before using VERIFY");
@@ -2149,29 +3286,61 @@ void sqldb::verify(std::ostream &os){
 
   // check structures in properties
   os << "Checking the structures in properties are known" << std::endl;
-  st.recycle("SELECT key,nstructures,structures FROM Properties;");
-  statement stcheck(db,"SELECT id FROM Structures WHERE id = ?1;");
+  st.recycle(R"SQL(
+SELECT Properties.key, Property_structures.strid
+FROM Property_structures
+INNER JOIN Properties ON Properties.id = Property_structures.propid
+LEFT JOIN Structures ON Structures.id = Property_structures.strid
+WHERE Structures.id IS NULL
+ORDER BY Properties.id, Property_structures.position;
+)SQL");
+  while (st.step() != SQLITE_DONE)
+    os << "STRUCTURES (" + std::to_string(sqlite3_column_int(st.ptr(), 1)) + ") in Properties (" + std::string((char *) sqlite3_column_text(st.ptr(), 0)) + ") not found" << std::endl;
+  st.recycle(R"SQL(
+SELECT Properties.key, Properties.nstructures, Properties.structures, COUNT(Property_structures.strid)
+FROM Properties
+LEFT JOIN Property_structures ON Property_structures.propid = Properties.id
+GROUP BY Properties.id
+ORDER BY Properties.id;
+)SQL");
+  statement stcheck(db,"SELECT strid FROM Property_structures WHERE propid = (SELECT id FROM Properties WHERE key = ?1) ORDER BY position;");
   while (st.step() != SQLITE_DONE){
+    std::string key = std::string((char *) sqlite3_column_text(st.ptr(), 0));
     int n = sqlite3_column_int(st.ptr(), 1);
-
     const int *str = (int *)sqlite3_column_blob(st.ptr(), 2);
-    for (int i = 0; i < n; i++){
-      stcheck.bind(1,str[i]);
+    bool ok = (n == sqlite3_column_int(st.ptr(), 3));
+    stcheck.reset();
+    stcheck.bind(1,key);
+    for (int i = 0; ok && i < n; i++){
       stcheck.step();
-      if (sqlite3_column_int(stcheck.ptr(),0) == 0)
-	os << "STRUCTURES (" + std::to_string(str[i]) + ") in Properties (" + std::string((char *) sqlite3_column_text(st.ptr(), 0)) + ") not found" << std::endl;
-      stcheck.reset();
+      ok = (str[i] == sqlite3_column_int(stcheck.ptr(),0));
     }
+    if (!ok)
+      os << "STRUCTURES in Properties (" + key + ") do not match the Property_structures table" << std::endl;
   }
 
+  // check the composition of the structures
+  os << "Checking the composition of the structures" << std::endl;
+  st.recycle(R"SQL(
+SELECT Structures.key
+FROM Structures
+LEFT JOIN Structure_atoms ON Structure_atoms.strid = Structures.id
+GROUP BY Structures.id
+HAVING Structures.nat != COALESCE(SUM(Structure_atoms.count),0)
+ORDER BY Structures.id;
+)SQL");
+  while (st.step() != SQLITE_DONE)
+    os << "STRUCTURE (" + std::string((char *) sqlite3_column_text(st.ptr(), 0)) + ") does not match the Structure_atoms table" << std::endl;
+
   // check the number of values and structures in evaluations
   os << "Checking the number of values and structures in the evaluations table" << std::endl;
   st.recycle(R"SQL(
-SELECT Evaluations.methodid, Evaluations.propid, Properties.property_type, length(Evaluations.value), Properties.nstructures, Properties.structures
-FROM Evaluations, Properties
-WHERE Evaluations.propid = Properties.id
+SELECT Evaluations.methodid, Evaluations.propid, Properties.property_type, length(Evaluations.value), Properties.nstructures, Structures.nat
+FROM Evaluations
+INNER JOIN Properties ON Evaluations.propid = Properties.id
+LEFT JOIN Property_structures ON Property_structures.propid = Properties.id AND Property_structures.position = 0
+LEFT JOIN Structures ON Structures.id = Property_structures.strid
 )SQL");
-  stcheck.recycle("SELECT nat FROM Structures WHERE id = ?1;");
   while (st.step() != SQLITE_DONE){
     int methodid = sqlite3_column_int(st.ptr(), 0);
     int propid = sqlite3_column_int(st.ptr(), 1);
@@ -2194,15 +3363,11 @@ WHERE Evaluations.propid = Properties.id
     } else if (ppty == globals::ppty_stress && nvalue != 6){
       os << "EVALUATIONS (method=" << methodid << ";property=" << propid << ") should have 6 values, but has " << nvalue << std::endl;
     } else if (ppty == globals::ppty_d1e || ppty == globals::ppty_d2e){
-      int idstr = sqlite3_column_int(st.ptr(),5);
-      stcheck.bind(1,idstr);
-      stcheck.step();
-      int nat = sqlite3_column_int(stcheck.ptr(),0);
+      int nat = sqlite3_column_int(st.ptr(),5);
       if (ppty == globals::ppty_d1e && nvalue != 3 * nat)
 	os << "EVALUATIONS (method=" << methodid << ";property=" << propid << ") should have 3*nat values (nat=" << nat << "), but has " << nvalue << std::endl;
       else if (ppty == globals::ppty_d2e && nvalue != (3*nat) * (3*nat+1) / 2)
 	os << "EVALUATIONS (method=" << methodid << ";property=" << propid << ") should have (3*nat)*(3*nat+1)/2 values (nat=" << nat << "), but has " << nvalue << std::endl;
-      stcheck.reset();
     }
   }
 
@@ -2210,11 +3375,12 @@ WHERE Evaluations.propid = Properties.id
   os << "Checking the number of values and structures in the terms table" << std::endl;
   st.recycle(R"SQL(
 SELECT Terms.methodid, Terms.zatom, Terms.symbol, Terms.l, Terms.exponent, Terms.exprn, Terms.propid, Properties.property_type,
-       length(Terms.value), Properties.nstructures, Properties.structures
-FROM Terms, Properties
-WHERE Terms.propid = Properties.id
+       length(Terms.value), Properties.nstructures, Structures.nat
+FROM Terms
+INNER JOIN Properties ON Terms.propid = Properties.id
+LEFT JOIN Property_structures ON Property_structures.propid = Properties.id AND Property_structures.position = 0
+LEFT JOIN Structures ON Structures.id = Property_structures.strid
 )SQL");
-  stcheck.recycle("SELECT nat FROM Structures WHERE id = ?1;");
   while (st.step() != SQLITE_DONE){
     int methodid = sqlite3_column_int(st.ptr(), 0);
     int zatom = sqlite3_column_int(st.ptr(), 1);
@@ -2246,17 +3412,13 @@ WHERE Terms.propid = Properties.id
       os << "TERMS (method=" << methodid << ";zatom=" << zatom << ";symbol=" << symbol << ";l=" << l << ";exp=" << exp << ";exprn=" << exprn << ";property=" << propid
 	 << ") should have 6 values, but has " << nvalue << std::endl;
     } else if (ppty == globals::ppty_d1e || ppty == globals::ppty_d2e){
-      int idstr = sqlite3_column_int(st.ptr(),8);
-      stcheck.bind(1,idstr);
-      stcheck.step();
-      int nat = sqlite3_column_int(stcheck.ptr(),0);
+      int nat = sqlite3_column_int(st.ptr(),10);
       if (ppty == globals::ppty_d1e && nvalue != 3 * nat)
 	os << "TERMS (method=" << methodid << ";zatom=" << zatom << ";symbol=" << symbol << ";l=" << l << ";exp=" << exp<< ";exprn=" << exprn << ";property=" << propid
 	   << ") should have 3*nat values (nat=" << nat << "), but has " << nvalue << std::endl;
       else if (ppty == globals::ppty_d2e && nvalue != (3*nat) * (3*nat+1) / 2)
 	os << "TERMS (method=" << methodid << ";zatom=" << zatom << ";symbol=" << symbol << ";l=" << l << ";exp=" << exp << ";exprn=" << exprn << ";property=" << propid
 	   << ") should have nat*(nat+1)/2 values (nat=" << nat << "), but has " << nvalue << std::endl;
-      stcheck.reset();
     }
   }
 
@@ -2730,7 +3892,8 @@ void sqldb::write_structures(std::ostream &os, const std::unordered_map<std::str
 // information in ACP a. For the loop expansion, use the list of
 // atomic IDs (atid), atomic numbers (zat), angular momenta (l), exponents (exp), and
 // coefficients (coef). If rename, incorporate the atom, l, exponent
-// info into the file name.
+// info into the file name and skip the atoms that are not in the
+// structure, also in the loop expansion.
 void sqldb::write_many_structures(std::ostream &os,
 				  const std::string &template_m, const std::string &template_c,
 				  const std::string &ext_m, const std::string &ext_c,
@@ -2757,15 +3920,48 @@ void sqldb::write_many_structures(std::ostream &os,
   strtemplate *tptr;
   strtemplate tm(template_m);
   strtemplate tc(template_c);
-  strtemplate tmexp, tcexp;
-  if (tm.hasloop()){
-    tmexp = tm;
-    tmexp.expand_loop(atid,zat,symbol,termstring,l,exp,exprn,coef);
-  }
-  if (tc.hasloop()){
-    tcexp = tc;
-    tcexp.expand_loop(atid,zat,symbol,termstring,l,exp,exprn,coef);
-  }
+
+  // With the full list of terms (rename), skip the atoms that are not
+  // in the structure: their terms are zero and INSERT CALC does not
+  // need them. present(id) gives the mask of atoms to write.
+  statement stzat(db,"SELECT zatom FROM Structure_atoms WHERE strid = ?1;");
+  auto present = [&](int id) -> std::vector<bool> {
+    std::vector<bool> mask(zat.size(),true);
+    if (!rename) return mask;
+    std::set<int> zs;
+    stzat.reset();
+    stzat.bind(1,id);
+    while (stzat.step() != SQLITE_DONE)
+      zs.insert(sqlite3_column_int(stzat.ptr(),0));
+    for (int ii = 0; ii < zat.size(); ii++)
+      mask[ii] = (zat[ii] == 0 || zs.find(zat[ii]) != zs.end());
+    return mask;
+  };
+
+  // The loop templates are expanded with the atoms present in each
+  // structure. The expansions are cached by template and atom mask.
+  std::map<std::pair<bool,std::vector<bool>>,strtemplate> loopcache;
+  auto looptemplate = [&](int id, bool ismol) -> const strtemplate & {
+    auto key = std::make_pair(ismol,present(id));
+    auto ic = loopcache.find(key);
+    if (ic != loopcache.end())
+      return ic->second;
+
+    std::vector<int> atid_;
+    std::vector<unsigned char> zat_, l_;
+    std::vector<std::string> symbol_, termstring_;
+    for (int ii = 0; ii < zat.size(); ii++){
+      if (!key.second[ii]) continue;
+      atid_.push_back(atid[ii]);
+      zat_.push_back(zat[ii]);
+      l_.push_back(l[ii]);
+      symbol_.push_back(symbol[ii]);
+      termstring_.push_back(termstring[ii]);
+    }
+    strtemplate t = (ismol ? tm : tc);
+    t.expand_loop(atid_,zat_,symbol_,termstring_,l_,exp,exprn,coef);
+    return loopcache.emplace(key,t).first->second;
+  };
 
   if (npack <= 0 || npack >= smap.size()){
     for (auto it = smap.begin(); it != smap.end(); it++){
@@ -2775,11 +3971,13 @@ void sqldb::write_many_structures(std::ostream &os,
 	tptr = &tc;
 
       if (tptr->hasloop()){
-	write_one_structure(os,it->first, (it->second?tmexp:tcexp), (it->second?ext_m:ext_c),
+	write_one_structure(os,it->first, looptemplate(it->first,it->second), (it->second?ext_m:ext_c),
 			    a, atid[0], zat[0], symbol[0], termstring[0], l[0], exp[0], exprn[0], 0,
 			    coef[0], 0, 0, dir, prefix);
       } else {
+	std::vector<bool> mask = present(it->first);
 	for (int ii = 0; ii < zat.size(); ii++){
+	  if (!mask[ii]) continue;
 	  for (int iexp = 0; iexp < exp.size(); iexp++){
 	    for (int icoef = 0; icoef < coef.size(); icoef++){
 	      write_one_structure(os,it->first, (it->second?tm:tc), (it->second?ext_m:ext_c), a,
@@ -2812,12 +4010,14 @@ void sqldb::write_many_structures(std::ostream &os,
 	tptr = &tc;
 
       if (tptr->hasloop()){
-	written.push_back(fs::path(write_one_structure(os, srand[i], (smap.at(srand[i])?tmexp:tcexp),
+	written.push_back(fs::path(write_one_structure(os, srand[i], looptemplate(srand[i],smap.at(srand[i])),
 						       (smap.at(srand[i])?ext_m:ext_c),
 						       a, atid[0], zat[0], symbol[0], termstring[0], l[0], exp[0], exprn[0],
 						       0, coef[0], 0, 0, dir, prefix)));
       } else {
+	std::vector<bool> mask = present(srand[i]);
 	for (int ii = 0; ii < zat.size(); ii++){
+	  if (!mask[ii]) continue;
 	  for (int iexp = 0; iexp < exp.size(); iexp++){
 	    for (int icoef = 0; icoef < coef.size(); icoef++){
 	      written.push_back(fs::path(write_one_structure(os, srand[i], (smap.at(srand[i])?tm:tc), (smap.at(srand[i])?ext_m:ext_c),
@@ -23,11 +23,14 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <unordered_map>
 #include <vector>
 #include <list>
+#include <chrono>
 #include "sqlite3.h"
 #include "statement.h"
 #include "acp.h"
 #include "strtemplate.h"
 
+class structure;
+
 // A SQLite3 database class.
 class sqldb {
 
@@ -62,9 +65,34 @@ class sqldb {
   // Create the database skeleton.
   void create();
 
+  // Get the schema version of the connected database.
+  int get_version();
+
+  // Data versions. The evaluations of each method (kind METHOD), the
+  // properties of each set (kind SET), and each terms column (method
+  // and term) have a version number that changes every time the
+  // insert and delete commands modify them. Versions are taken from a
+  // global counter, so they increase across all kinds of data and a
+  // cache can be validated by comparing the maximum of the versions
+  // it depends on. A zero version means the data was never modified
+  // since versioning started.
+  long int version();
+  long int version(const std::string &kind, int id);
+  long int version_term(int methodid, int zatom, const std::string &symbol, int l, double exp, int exprn);
+  void touch(const std::string &kind, int id);
+  void touch_term(int methodid, int zatom, const std::string &symbol, int l, double exp, int exprn);
+  void touch_terms(int methodid);
+
   // Close a database connection if open and reset the pointer to NULL
   void close();
 
+  // Attach a database file (shard or read-only reference data) and
+  // merge its Terms and Evaluations with those of the main database
+  void attach(std::ostream &os, const std::string &file, const std::string &alias, bool readonly);
+
+  // Detach a database file
+  void detach(std::ostream &os, const std::string &alias);
+
   // Insert items into the database manually
   void insert_litref(std::ostream &os, const std::string &key, const std::unordered_map<std::string,std::string> &kmap);
   void insert_set(std::ostream &os, const std::string &key, const std::unordered_map<std::string,std::string> &kmap);
@@ -109,6 +137,19 @@ class sqldb {
   // List sets of properties in the database (din format)
   void print_din(std::ostream &os, const std::unordered_map<std::string,std::string> &kmap);
 
+  // Rebuild the Terms table clustered by term and property, and
+  // compact the database file
+  void repack(std::ostream &os);
+
+  // Run an SQL statement that does not modify the database and
+  // print the resulting rows
+  void sql(std::ostream &os, const std::string &cmd);
+
+  // Find near-duplicate molecules (same composition, interatomic
+  // distances of each element pair within tol) and optionally merge
+  // them
+  void similar(std::ostream &os, double tol, bool merge);
+
   // Verify the consistency of the database
   void verify(std::ostream &os);
 
@@ -197,9 +238,11 @@ class sqldb {
   int get_key_and_id(const std::string &input, const std::string &table,
 		     std::string &key, int &id, bool toupperi=false, bool touppero=false);
 
-  // Begin a transaction
+  // Begin a transaction. The write lock is taken at the start, so
+  // concurrent writers wait in the busy handler instead of failing
+  // when the transaction tries to write.
   void begin_transaction(){
-    statement st(db,"BEGIN TRANSACTION;");
+    statement st(db,"BEGIN IMMEDIATE TRANSACTION;");
     st.execute();
   }
   // Commit a transaction
@@ -218,9 +261,56 @@ class sqldb {
 
  private:
 
+  // Upgrade the database schema from the given version to the
+  // current version.
+  void upgrade(int version);
+
+  // Rebuild the Terms table as a WITHOUT ROWID table in primary key
+  // order
+  void rebuild_terms();
+
+  // Busy handler: wait with exponential backoff while another
+  // process holds the lock on the database file
+  static int busy_handler(void *ptr, int count);
+
+  // Increase the global data version and return it
+  long int next_version();
+
+  // Mark as changed the methods or sets returned by a query
+  void touch_ids(const std::string &kind, const std::string &sqlids);
+
+  // Mark as changed the terms columns with rows satisfying a condition
+  void touch_terms_where(const std::string &where);
+
+  // Rebuild the views on the Terms and Evaluations of the attached
+  // databases
+  void update_views(bool create=true);
+
+  // Insert the structures and coefficients of a property in the
+  // Property_structures table
+  void insert_property_structures(int propid, int nstr, const int *strid, const double *coef);
+
+  // Insert the number of atoms of each element of a structure in the
+  // Structure_atoms table
+  void insert_structure_atoms(int strid, int nat, const unsigned char *z);
+
+  // Find the ID of a structure from its key or alias
+  int find_structure_id(const std::string &key);
+
+  // Insert a structure (or an alias, if dedupe and the geometry is
+  // already in the database) and return its ID
+  int insert_structure_row(std::ostream &os, statement &st, const std::string &key, const structure &s, bool dedupe);
+
+  // Delete sets, methods, or properties and their evaluations and
+  // terms using bulk set operations.
+  void erase_bulk(std::ostream &os, const std::string &category, const std::string &table, const std::list<std::string> &tokens);
+
   // database info
   std::string dbfilename;
   sqlite3 *db;
+
+  // start of the current wait in the busy handler
+  std::chrono::steady_clock::time_point busy_start;
 };
 
 #endif
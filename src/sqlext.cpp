@@ -0,0 +1,132 @@
+/*
+Copyright (c) 2020 Alberto Otero de la Roza <aoterodelaroza@gmail.com>
+
+acpdb is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or (at
+your option) any later version.
+
+acpdb is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifdef SQLEXT_LOADABLE
+#include "sqlite3ext.h"
+SQLITE_EXTENSION_INIT1
+#endif
+#include "sqlext.h"
+#include <vector>
+
+// Number of doubles in the BLOB argument
+static int nblob(sqlite3_value *x){
+  return sqlite3_value_bytes(x) / sizeof(double);
+}
+
+// blob_length(x): number of doubles in x
+static void blob_length(sqlite3_context *ctx, int, sqlite3_value **argv){
+  if (sqlite3_value_type(argv[0]) == SQLITE_NULL)
+    return sqlite3_result_null(ctx);
+  sqlite3_result_int(ctx,nblob(argv[0]));
+}
+
+// blob_element(x,i): i-th double in x, starting at zero
+static void blob_element(sqlite3_context *ctx, int, sqlite3_value **argv){
+  if (sqlite3_value_type(argv[0]) == SQLITE_NULL || sqlite3_value_type(argv[1]) == SQLITE_NULL)
+    return sqlite3_result_null(ctx);
+  const double *x = (const double *) sqlite3_value_blob(argv[0]);
+  int n = nblob(argv[0]);
+  int i = sqlite3_value_int(argv[1]);
+  if (!x || i < 0 || i >= n)
+    return sqlite3_result_null(ctx);
+  sqlite3_result_double(ctx,x[i]);
+}
+
+// blob_scale(x,c): x multiplied by c
+static void blob_scale(sqlite3_context *ctx, int, sqlite3_value **argv){
+  if (sqlite3_value_type(argv[0]) == SQLITE_NULL || sqlite3_value_type(argv[1]) == SQLITE_NULL)
+    return sqlite3_result_null(ctx);
+  const double *x = (const double *) sqlite3_value_blob(argv[0]);
+  int n = nblob(argv[0]);
+  double c = sqlite3_value_double(argv[1]);
+  std::vector<double> y(n);
+  for (int i = 0; i < n; i++)
+    y[i] = c * x[i];
+  sqlite3_result_blob(ctx,y.data(),n * sizeof(double),SQLITE_TRANSIENT);
+}
+
+// blob_dot(x,y): dot product of x and y
+static void blob_dot(sqlite3_context *ctx, int, sqlite3_value **argv){
+  if (sqlite3_value_type(argv[0]) == SQLITE_NULL || sqlite3_value_type(argv[1]) == SQLITE_NULL)
+    return sqlite3_result_null(ctx);
+  const double *x = (const double *) sqlite3_value_blob(argv[0]);
+  const double *y = (const double *) sqlite3_value_blob(argv[1]);
+  int n = nblob(argv[0]);
+  if (n != nblob(argv[1]))
+    return sqlite3_result_error(ctx,"blob_dot: arguments have different lengths",-1);
+  double dot = 0;
+  for (int i = 0; i < n; i++)
+    dot += x[i] * y[i];
+  sqlite3_result_double(ctx,dot);
+}
+
+// blob_sum(x[,c]) accumulation step
+static void blob_sum_step(sqlite3_context *ctx, int argc, sqlite3_value **argv){
+  if (sqlite3_value_type(argv[0]) == SQLITE_NULL || (argc > 1 && sqlite3_value_type(argv[1]) == SQLITE_NULL))
+    return;
+  std::vector<double> **sum = (std::vector<double> **) sqlite3_aggregate_context(ctx,sizeof(std::vector<double> *));
+  if (!sum)
+    return sqlite3_result_error_nomem(ctx);
+
+  const double *x = (const double *) sqlite3_value_blob(argv[0]);
+  unsigned long int n = nblob(argv[0]);
+  double c = (argc > 1) ? sqlite3_value_double(argv[1]) : 1.0;
+  if (!*sum)
+    *sum = new std::vector<double>(n,0.0);
+  else if ((*sum)->size() != n)
+    return sqlite3_result_error(ctx,"blob_sum: arguments have different lengths",-1);
+  for (unsigned long int i = 0; i < n; i++)
+    (**sum)[i] += c * x[i];
+}
+
+// blob_sum(x[,c]) final result
+static void blob_sum_final(sqlite3_context *ctx){
+  std::vector<double> **sum = (std::vector<double> **) sqlite3_aggregate_context(ctx,0);
+  if (!sum || !*sum)
+    return sqlite3_result_null(ctx);
+  sqlite3_result_blob(ctx,(*sum)->data(),(*sum)->size() * sizeof(double),SQLITE_TRANSIENT);
+  delete *sum;
+  *sum = nullptr;
+}
+
+// Register the acpdb SQL functions in database connection db.
+int register_sqlext(sqlite3 *db){
+  const int flags = SQLITE_UTF8 | SQLITE_DETERMINISTIC | SQLITE_INNOCUOUS;
+  int rc;
+  if ((rc = sqlite3_create_function_v2(db,"blob_length",1,flags,nullptr,blob_length,nullptr,nullptr,nullptr)))
+    return rc;
+  if ((rc = sqlite3_create_function_v2(db,"blob_element",2,flags,nullptr,blob_element,nullptr,nullptr,nullptr)))
+    return rc;
+  if ((rc = sqlite3_create_function_v2(db,"blob_scale",2,flags,nullptr,blob_scale,nullptr,nullptr,nullptr)))
+    return rc;
+  if ((rc = sqlite3_create_function_v2(db,"blob_dot",2,flags,nullptr,blob_dot,nullptr,nullptr,nullptr)))
+    return rc;
+  if ((rc = sqlite3_create_function_v2(db,"blob_sum",1,flags,nullptr,nullptr,blob_sum_step,blob_sum_final,nullptr)))
+    return rc;
+  if ((rc = sqlite3_create_function_v2(db,"blob_sum",2,flags,nullptr,nullptr,blob_sum_step,blob_sum_final,nullptr)))
+    return rc;
+  return SQLITE_OK;
+}
+
+#ifdef SQLEXT_LOADABLE
+// Entry point for the loadable extension (.load libacpdbext in the
+// sqlite3 shell).
+extern "C" int sqlite3_acpdbext_init(sqlite3 *db, char **, const sqlite3_api_routines *pApi){
+  SQLITE_EXTENSION_INIT2(pApi);
+  return register_sqlext(db);
+}
+#endif
@@ -0,0 +1,41 @@
+/*
+Copyright (c) 2020 Alberto Otero de la Roza <aoterodelaroza@gmail.com>
+
+acpdb is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or (at
+your option) any later version.
+
+acpdb is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SQLEXT_H
+#define SQLEXT_H
+
+#include "sqlite3.h"
+
+// Register the acpdb SQL functions in database connection db. The
+// functions operate on the BLOBs of doubles used for the values in
+// the Evaluations and Terms tables:
+//
+//   blob_length(x)     number of doubles in x
+//   blob_element(x,i)  i-th double in x (starting at zero) or NULL
+//                      if i is out of range
+//   blob_scale(x,c)    x multiplied by the number c
+//   blob_dot(x,y)      dot product of x and y, which must have the
+//                      same length
+//   blob_sum(x[,c])    aggregate: element-wise sum of x (multiplied by
+//                      c, if given) over all rows; all x in the group
+//                      must have the same length
+//
+// All functions return NULL if x is NULL, and blob_sum skips the
+// rows where x or c are NULL. Returns the SQLite error code.
+int register_sqlext(sqlite3 *db);
+
+#endif
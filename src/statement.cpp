@@ -98,8 +98,10 @@ void statement::prepare(){
     throw std::runtime_error("A database file must be connected before preparing a statement");
 
   int rc = 0;
-  rc = sqlite3_prepare_v2(db, text.c_str(), -1, &stmt, NULL);
+  const char *ptail = nullptr;
+  rc = sqlite3_prepare_v2(db, text.c_str(), -1, &stmt, &ptail);
   if (rc) throw_exception(db);
+  tail = ptail ? ptail : "";
 
   rc = sqlite3_bind_parameter_count(stmt);
   has_bind = (rc>0);
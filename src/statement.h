@@ -70,6 +70,9 @@ class statement {
   // Prepare the statement and record whether the statement has bindings.
   void prepare();
 
+  // Text after the first SQL statement (after prepare)
+  const std::string &get_tail() const { return tail; }
+
   //// Public template functions ////
 
   // Bind arguments to the parameters of the statement
@@ -103,6 +106,7 @@ class statement {
   sqlite3 *db; // the database pointer
   sqlite3_stmt *stmt; // statement pointer
   std::string text; // text of a custom statement
+  std::string tail; // text after the first statement in text
 
   //// Template function code ////
   template<typename Tcol, typename Targ> struct bind_dispatcher; // bind dispatcher, for generic bind selection
@@ -113,6 +117,10 @@ template<> struct statement::bind_dispatcher< int, int > {
   static int impl(sqlite3_stmt *stmt, const int col, const int arg, bool transient, int nbytes){
     return sqlite3_bind_int(stmt,col,arg);}};
 
+template<> struct statement::bind_dispatcher< int, long int > {
+  static int impl(sqlite3_stmt *stmt, const int col, const long int arg, bool transient, int nbytes){
+    return sqlite3_bind_int64(stmt,col,arg);}};
+
 template<> struct statement::bind_dispatcher< int, std::string > {
   static int impl(sqlite3_stmt *stmt, const int col, const std::string &arg, bool transient, int nbytes){
     return sqlite3_bind_text(stmt,col,arg.c_str(),-1,transient?SQLITE_TRANSIENT:SQLITE_STATIC);}};
@@ -25,6 +25,9 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <map>
 #include <vector>
 #include <cstring>
+#include <array>
+#include <sstream>
+#include <cstdint>
 #include "parseutils.h"
 #include "globals.h"
 
@@ -410,6 +413,50 @@ int structure::readdbrow(sqlite3_stmt *stmt){
   return 0;
 }
 
+// Canonical hash of the geometry (FNV-1a, 64 bits). The atoms are
+// sorted by atomic number and rounded coordinates before hashing, so
+// the hash does not depend on the atomic order.
+std::string structure::hash() const{
+  const double eps = 1e4;
+  const uint64_t fnv_prime = 1099511628211ULL;
+  uint64_t h = 14695981039346656037ULL;
+  auto add = [&h,fnv_prime](int64_t v){
+    for (int i = 0; i < 8; i++){
+      h ^= (v >> (8*i)) & 0xff;
+      h *= fnv_prime;
+    }
+  };
+
+  // header and cell
+  add(ismol);
+  add(charge);
+  add(mult);
+  add(nat);
+  if (!ismol)
+    for (int i = 0; i < 9; i++)
+      add(std::llround(r[i] * eps));
+
+  // atoms, in canonical order
+  std::vector<std::array<int64_t,4>> atoms(nat);
+  for (int i = 0; i < nat; i++){
+    atoms[i][0] = z[i];
+    for (int j = 0; j < 3; j++){
+      int64_t xr = std::llround(x[3*i+j] * eps);
+      if (!ismol)
+	xr = ((xr % (int64_t) eps) + (int64_t) eps) % (int64_t) eps;
+      atoms[i][j+1] = xr;
+    }
+  }
+  std::sort(atoms.begin(),atoms.end());
+  for (int i = 0; i < nat; i++)
+    for (int j = 0; j < 4; j++)
+      add(atoms[i][j]);
+
+  std::ostringstream oss;
+  oss << std::hex << std::setw(16) << std::setfill('0') << h;
+  return oss.str();
+}
+
 // Write the atomic coordinates block as:
 //  symbol x y z
 //  ..
@@ -99,6 +99,14 @@ class structure {
   // (id,key,setid,ismolecule,charge,multiplicity,nat,cell,zatoms,coordinates)
   int readdbrow (sqlite3_stmt *stmt);
 
+  // Canonical hash of the geometry, as a string of 16 hexadecimal
+  // digits. Two structures have the same hash if they are both
+  // molecules or both crystals with the same charge, multiplicity,
+  // cell, and atoms (in any order) at the same positions, with
+  // coordinates rounded to 1e-4 angstrom (molecules) or 1e-4
+  // fractional units (crystals, modulo lattice translations).
+  std::string hash() const;
+
   // c++ accessor functions
   bool ismolecule() const { return ismol; }
   int get_nat() const { return nat; }
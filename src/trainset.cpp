@@ -19,10 +19,13 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "statement.h"
 #include "sqldb.h"
 #include "trainset.h"
+#include "trainvtab.h"
 #include "parseutils.h"
 #include "outputeval.h"
 #include "globals.h"
 #include "acp.h"
+#include "sparsemat.h"
+#include "fit.h"
 #include <iostream>
 #include <fstream>
 #include <algorithm>
@@ -30,6 +33,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <cmath>
 #include <filesystem>
 #include <map>
+#include <set>
 #include <cstring>
 #include <list>
 #include <tuple>
@@ -39,26 +43,138 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 namespace fs = std::filesystem;
 
+// Columns of the Terms table for the properties in the training set
+// (all of them or only those in the fit). The terms of the atoms
+// that are not in any of the structures of a property are zero and
+// may be missing from the Terms table; for those, the query returns
+// the number of items (from the reference method) and a NULL
+// value. There is no ORDER BY: the rows come in primary key order
+// and are placed with the offsets from column_layout.
+static const std::string term_column_sql = R"SQL(
+SELECT Terms.propid, length(Terms.value), Terms.value
+FROM Terms
+WHERE Terms.methodid = :METHOD AND Terms.zatom = :ZATOM AND Terms.symbol = :SYMBOL AND Terms.l = :L AND Terms.exponent = :EXP
+      AND Terms.exprn = :EXPRN AND Terms.propid IN (SELECT propid FROM Training_set)
+UNION ALL
+SELECT T.propid, length(Evaluations.value), NULL
+FROM (SELECT DISTINCT propid FROM Training_set) AS T
+INNER JOIN Evaluations ON Evaluations.methodid = :REFMETHOD AND Evaluations.propid = T.propid
+WHERE NOT EXISTS (SELECT 1 FROM Property_structures
+                  INNER JOIN Structure_atoms ON Structure_atoms.strid = Property_structures.strid AND Structure_atoms.zatom = :ZATOM
+                  WHERE Property_structures.propid = T.propid)
+      AND NOT EXISTS (SELECT 1 FROM Terms
+                      WHERE Terms.methodid = :METHOD AND Terms.zatom = :ZATOM AND Terms.symbol = :SYMBOL AND Terms.l = :L
+                            AND Terms.exponent = :EXP AND Terms.exprn = :EXPRN AND Terms.propid = T.propid);
+)SQL";
+static const std::string term_column_fit_sql = R"SQL(
+SELECT Terms.propid, length(Terms.value), Terms.value
+FROM Terms
+WHERE Terms.methodid = :METHOD AND Terms.zatom = :ZATOM AND Terms.symbol = :SYMBOL AND Terms.l = :L AND Terms.exponent = :EXP
+      AND Terms.exprn = :EXPRN AND Terms.propid IN (SELECT propid FROM Training_set WHERE isfit IS NOT NULL)
+UNION ALL
+SELECT T.propid, length(Evaluations.value), NULL
+FROM (SELECT DISTINCT propid FROM Training_set WHERE isfit IS NOT NULL) AS T
+INNER JOIN Evaluations ON Evaluations.methodid = :REFMETHOD AND Evaluations.propid = T.propid
+WHERE NOT EXISTS (SELECT 1 FROM Property_structures
+                  INNER JOIN Structure_atoms ON Structure_atoms.strid = Property_structures.strid AND Structure_atoms.zatom = :ZATOM
+                  WHERE Property_structures.propid = T.propid)
+      AND NOT EXISTS (SELECT 1 FROM Terms
+                      WHERE Terms.methodid = :METHOD AND Terms.zatom = :ZATOM AND Terms.symbol = :SYMBOL AND Terms.l = :L
+                            AND Terms.exponent = :EXP AND Terms.exprn = :EXPRN AND Terms.propid = T.propid);
+)SQL";
+
+// Same as term_column_fit_sql, for the properties in the fit with
+// Training_set.id between :IDINI and :IDFIN (a block of rows).
+static const std::string term_column_block_sql = R"SQL(
+SELECT Terms.propid, length(Terms.value), Terms.value
+FROM Terms
+WHERE Terms.methodid = :METHOD AND Terms.zatom = :ZATOM AND Terms.symbol = :SYMBOL AND Terms.l = :L AND Terms.exponent = :EXP
+      AND Terms.exprn = :EXPRN AND Terms.propid IN (SELECT propid FROM Training_set WHERE isfit IS NOT NULL
+                                                    AND id BETWEEN :IDINI AND :IDFIN)
+UNION ALL
+SELECT T.propid, length(Evaluations.value), NULL
+FROM (SELECT DISTINCT propid FROM Training_set WHERE isfit IS NOT NULL AND id BETWEEN :IDINI AND :IDFIN) AS T
+INNER JOIN Evaluations ON Evaluations.methodid = :REFMETHOD AND Evaluations.propid = T.propid
+WHERE NOT EXISTS (SELECT 1 FROM Property_structures
+                  INNER JOIN Structure_atoms ON Structure_atoms.strid = Property_structures.strid AND Structure_atoms.zatom = :ZATOM
+                  WHERE Property_structures.propid = T.propid)
+      AND NOT EXISTS (SELECT 1 FROM Terms
+                      WHERE Terms.methodid = :METHOD AND Terms.zatom = :ZATOM AND Terms.symbol = :SYMBOL AND Terms.l = :L
+                            AND Terms.exponent = :EXP AND Terms.exprn = :EXPRN AND Terms.propid = T.propid);
+)SQL";
+
+// Sum of the terms columns of an ACP for each property in the
+// training set, calculated in the database with the blob_sum
+// aggregate. The ACP terms and coefficients are in the temporary
+// table Eval_acp. Also returns the number of terms missing for each
+// property (terms for atoms that are not in the structures of the
+// property are zero and are not counted), and the number of items
+// from the reference method, used if all terms are zero.
+static const std::string acp_column_sql = R"SQL(
+SELECT T.propid,
+       SUM(Terms.value IS NULL AND EXISTS (SELECT 1 FROM Property_structures
+                                           INNER JOIN Structure_atoms ON Structure_atoms.strid = Property_structures.strid
+                                           WHERE Property_structures.propid = T.propid AND Structure_atoms.zatom = Eval_acp.zatom)),
+       blob_sum(Terms.value,Eval_acp.coef), length(Evaluations.value)
+FROM (SELECT DISTINCT propid FROM Training_set) AS T
+INNER JOIN Evaluations ON Evaluations.methodid = :REFMETHOD AND Evaluations.propid = T.propid
+CROSS JOIN temp.Eval_acp
+LEFT JOIN Terms ON Terms.methodid = :METHOD AND Terms.zatom = Eval_acp.zatom AND Terms.symbol = Eval_acp.symbol AND
+                   Terms.l = Eval_acp.l AND Terms.exponent = Eval_acp.exponent AND Terms.exprn = Eval_acp.exprn AND
+                   Terms.propid = T.propid
+GROUP BY T.propid;
+)SQL";
+
+// Marker at the start of the octavedump.dat files with the terms
+// in single precision (DUMP SINGLE).
+static const char dump_single_marker[] = "ACPDBF32";
+
 // Register the database and create the Training_set table
 void trainset::setdb(sqldb *db_){
   db = db_;
 
-  // Drop the Training_set table if it exists, then create it
+  // Create the Training_set table if it does not exist, then empty
+  // it. The table is temporary so that each connection has its own
+  // training set and processes sharing the database file do not
+  // overwrite each other's. A temporary table cannot reference the
+  // main Properties table, so the cascade on deletion is a trigger.
   if (db){
     statement st(db->ptr(),R"SQL(
-CREATE TABLE IF NOT EXISTS Training_set (
+CREATE TEMP TABLE IF NOT EXISTS Training_set (
   id INTEGER PRIMARY KEY,
   propid INTEGER NOT NULL,
-  isfit INTEGER,
-  FOREIGN KEY(propid) REFERENCES Properties(id) ON DELETE CASCADE
+  isfit INTEGER
 );
-DELETE FROM Training_set;
-CREATE INDEX IF NOT EXISTS Training_set_idx ON Training_set (propid,isfit);
+DELETE FROM temp.Training_set;
+CREATE INDEX IF NOT EXISTS temp.Training_set_idx ON Training_set (propid,isfit);
+CREATE TEMP TRIGGER IF NOT EXISTS Training_set_cascade AFTER DELETE ON main.Properties
+BEGIN
+  DELETE FROM Training_set WHERE propid = old.id;
+END;
+DROP TABLE IF EXISTS temp.Training_matrix;
 )SQL");
     st.execute();
+
+    // register the virtual table module for the training matrix
+    if (register_trainvtab(db->ptr(),this))
+      throw std::runtime_error("Error registering the training set virtual table module");
   }
 }
 
+// Create the Training_matrix virtual table for the current training
+// set, replacing the previous one. The table keeps the reference,
+// empty method, and weights it was created with, so it is recreated
+// whenever the training set changes. If the training set is not
+// defined, only drop the previous table.
+void trainset::create_vtab(){
+  if (!db || !(*db)) return;
+  statement st(db->ptr(),"DROP TABLE IF EXISTS temp.Training_matrix;");
+  st.execute();
+  if (!isdefined()) return;
+  st.recycle("CREATE VIRTUAL TABLE temp.Training_matrix USING acpdb_training;");
+  st.execute();
+}
+
 // Add atoms and max. angular momentum.
 void trainset::addatoms(const std::list<std::string> &tokens){
 
@@ -82,6 +198,8 @@ void trainset::addatoms(const std::list<std::string> &tokens){
     nat++;
   }
   complete = c_unknown;
+  gram_version = -1;
+  create_vtab();
 }
 
 // Set term strings.
@@ -110,6 +228,8 @@ void trainset::settermstring(const std::list<std::string> &tokens){
     throw std::runtime_error("ATOM not found: " + atom_);
   termstring[iatom] = str_;
   complete = c_unknown;
+  gram_version = -1;
+  create_vtab();
 }
 
 // Add exponents.
@@ -123,6 +243,8 @@ void trainset::addexp(const std::list<std::string> &tokens){
     exprn.push_back(2);
   }
   complete = c_unknown;
+  gram_version = -1;
+  create_vtab();
 }
 
 // Add exponents.
@@ -138,6 +260,8 @@ void trainset::addexprn(const std::list<std::string> &tokens){
     throw std::runtime_error("Size of exponent r^n does not match size of exponent in TRAINING");
 
   complete = c_unknown;
+  gram_version = -1;
+  create_vtab();
 }
 
 // Add a subset (combination of set, mask, weights)
@@ -232,54 +356,41 @@ void trainset::addsubset(const std::string &key, std::unordered_map<std::string,
 	throw std::runtime_error("Invalid conditional operator in MASK_SIZE, TRAINING/SUBSET");
     }
 
-    int n = -1;
-    statement st(db->ptr(),"SELECT nstructures, structures FROM Properties WHERE setid = " + std::to_string(idx) + " ORDER BY orderid;");
-    statement ststr(db->ptr(),"SELECT nat,zatoms,charge FROM Structures WHERE id = ?1");
-    while (st.step() != SQLITE_DONE){
-      bool accept = true;
-
-      int nstr = sqlite3_column_int(st.ptr(),0);
-      int *str = (int *) sqlite3_column_blob(st.ptr(),1);
-      for (int i = 0; i < nstr; i++){
-	ststr.reset();
-	ststr.bind(1,str[i]);
-	ststr.step();
-	int nat = sqlite3_column_int(ststr.ptr(),0);
-	unsigned char *zat_ = (unsigned char *) sqlite3_column_blob(ststr.ptr(),1);
-	int charge = sqlite3_column_int(ststr.ptr(),2);
-
-	if (kmap.find("MASK_ATOMS") != kmap.end()){
-	  for (int j = 0; j < nat; j++){
-	    bool found = false;
-	    for (int k = 0; k < zat.size(); k++){
-	      if (zat[k] == zat_[j]){
-		found = true;
-		break;
-	      }
-	    }
-	    if (!found){
-	      accept = false;
-	      break;
-	    }
-	  }
-	}
-	if (kmap.find("MASK_NOANIONS") != kmap.end() && charge < 0) accept = false;
-	if (kmap.find("MASK_NOCHARGED") != kmap.end() && charge != 0) accept = false;
-	if (kmap.find("MASK_SIZE") != kmap.end()){
-	  if (mcomp == "<"  && !(nat < msize))  accept = false;
-	  if (mcomp == "<=" && !(nat <= msize)) accept = false;
-	  if (mcomp == ">"  && !(nat > msize))  accept = false;
-	  if (mcomp == ">=" && !(nat >= msize)) accept = false;
-	  if (mcomp == "==" && !(nat == msize)) accept = false;
-	  if (mcomp == "!=" && !(nat != msize)) accept = false;
-	}
-	if (!accept) break;
-      }
-      n++;
+    // condition for a structure that is rejected by the mask
+    std::string reject;
+    if (kmap.find("MASK_ATOMS") != kmap.end()){
+      std::string zlist;
+      for (int k = 0; k < zat.size(); k++)
+	zlist += (k>0?",":"") + std::to_string(zat[k]);
+      reject += " OR EXISTS (SELECT 1 FROM Structure_atoms WHERE Structure_atoms.strid = Structures.id AND Structure_atoms.zatom NOT IN (" + zlist + "))";
+    }
+    if (kmap.find("MASK_NOANIONS") != kmap.end())
+      reject += " OR Structures.charge < 0";
+    if (kmap.find("MASK_NOCHARGED") != kmap.end())
+      reject += " OR Structures.charge != 0";
+    if (kmap.find("MASK_SIZE") != kmap.end())
+      reject += " OR NOT (Structures.nat " + mcomp + " " + std::to_string(msize) + ")";
+
+    // accept the properties without rejected structures, in property order
+    std::vector<bool> accept;
+    statement st(db->ptr(),R"SQL(
+SELECT NOT EXISTS (SELECT 1 FROM Property_structures
+                   INNER JOIN Structures ON Structures.id = Property_structures.strid
+                   WHERE Property_structures.propid = Properties.id AND (0)SQL" + reject + R"SQL())
+FROM Properties
+WHERE Properties.setid = ?1 AND Properties.property_type = ?2
+ORDER BY Properties.orderid, Properties.id;)SQL");
+    st.bind(1,idx);
+    st.bind(2,ppid);
+    while (st.step() != SQLITE_DONE)
+      accept.push_back(sqlite3_column_int(st.ptr(),0));
+    if (accept.size() != set_mask.size())
+      throw std::runtime_error("Inconsistent number of properties in the MASK of TRAINING/SUBSET");
+    for (int n = 0; n < accept.size(); n++){
       if (imask_and)
-	set_mask[n] = set_mask[n] & accept;
+	set_mask[n] = set_mask[n] & accept[n];
       else
-	set_mask[n] = set_mask[n] | accept;
+	set_mask[n] = set_mask[n] | accept[n];
     }
   }
 
@@ -408,6 +519,9 @@ void trainset::addsubset(const std::string &key, std::unordered_map<std::string,
       propid.push_back(propid_);
     }
   }
+  // release the read snapshot: a write transaction cannot start
+  // from a stale snapshot if another process has committed meanwhile
+  st.reset();
 
   // populate the Training_set table
   insert_subset_db(sid);
@@ -498,6 +612,8 @@ WHERE Properties.setid = :SETID AND Training_set.propid = Properties.id AND Trai
     w[id] = witem[i].second;
   }
   complete = c_unknown;
+  gram_version = -1;
+  create_vtab();
 }
 
 // Set the reference method
@@ -514,6 +630,8 @@ void trainset::setreference(const std::list<std::string> &tokens){
   if (refid == 0)
     throw std::runtime_error("METHOD identifier not found in database (" + refname + ") in TRAINING REFRENCE");
   complete = c_unknown;
+  gram_version = -1;
+  create_vtab();
 }
 
 // Set the empty method
@@ -531,6 +649,8 @@ void trainset::setempty(const std::list<std::string> &tokens){
   emptyname = name;
   emptyid = idx;
   complete = c_unknown;
+  gram_version = -1;
+  create_vtab();
 }
 
 // Add an additional method
@@ -551,6 +671,8 @@ void trainset::addadditional(const std::list<std::string> &tokens){
   addid.push_back(idx);
   addisfit.push_back(++it != tokens.end() && equali_strings(*it,"FIT"));
   complete = c_unknown;
+  gram_version = -1;
+  create_vtab();
 }
 
 // Describe the current training set
@@ -579,6 +701,9 @@ void trainset::describe(std::ostream &os, bool except_on_undefined, bool full, b
 
   std::streamsize prec = os.precision(10);
 
+  // the training matrix virtual table
+  create_vtab();
+
   // Atoms and lmax //
   if (!quiet){
     os << "# List of atoms and maximum angular momentum channels (" << nat << ")" << std::endl;
@@ -730,12 +855,16 @@ WHERE Evaluations.methodid = :METHOD AND Evaluations.propid = Training_set.propi
 	os << "# Additional (" << addname[j] << "): " << ncalc_add[j] << "/" << ncalc_all << (ncalc_add[j]==ncalc_all?" (complete)":" (missing)") << std::endl;
     }
 
-    // terms
+    // terms (the terms for atoms not in the structures of a property are zero)
     st.recycle(R"SQL(
-SELECT COUNT(DISTINCT Training_set.propid)
-FROM Terms
-INNER JOIN Training_set ON Training_set.propid = Terms.propid
-WHERE Terms.methodid = :METHOD AND Terms.zatom = :ZATOM AND Terms.symbol = :SYMBOL AND Terms.l = :L AND Terms.exponent = :EXP AND Terms.exprn = :EXPRN;)SQL");
+SELECT COUNT(*)
+FROM (SELECT DISTINCT propid FROM Training_set) AS T
+WHERE EXISTS (SELECT 1 FROM Terms
+              WHERE Terms.methodid = :METHOD AND Terms.zatom = :ZATOM AND Terms.symbol = :SYMBOL AND Terms.l = :L
+                    AND Terms.exponent = :EXP AND Terms.exprn = :EXPRN AND Terms.propid = T.propid)
+   OR NOT EXISTS (SELECT 1 FROM Property_structures
+                  INNER JOIN Structure_atoms ON Structure_atoms.strid = Property_structures.strid AND Structure_atoms.zatom = :ZATOM
+                  WHERE Property_structures.propid = T.propid);)SQL");
     int ncall = 0, ntall = 0;
     if (!quiet)
       os << "# Terms: " << std::endl;
@@ -775,6 +904,7 @@ WHERE Terms.methodid = :METHOD AND Terms.zatom = :ZATOM AND Terms.symbol = :SYMB
       os << "# The training set is NOT COMPLETE." << std::endl;
       complete = c_no;
     }
+    complete_version = data_version();
   }
   os << std::endl;
 
@@ -841,6 +971,23 @@ ORDER BY Properties.orderid;
     }
   }
 }
+// Data version of the training set: the largest version of the
+// methods, sets, and terms columns it uses.
+long int trainset::data_version(){
+  if (!db || !(*db))
+    throw std::runtime_error("A database file must be connected before using the training set");
+
+  long int v = std::max(db->version("METHOD",refid),db->version("METHOD",emptyid));
+  for (int i = 0; i < addid.size(); i++)
+    v = std::max(v,db->version("METHOD",addid[i]));
+  for (int i = 0; i < setid.size(); i++)
+    v = std::max(v,db->version("SET",setid[i]));
+  for (int iat = 0; iat < nat; iat++)
+    for (int il = 0; il <= lmax[iat]; il++)
+      for (int iexp = 0; iexp < exp.size(); iexp++)
+	v = std::max(v,db->version_term(emptyid,zat[iat],symbol[iat],il,exp[iexp],exprn[iexp]));
+  return v;
+}
 
 // Evaluate an ACP on the current training set.
 void trainset::eval_acp(std::ostream &os, const acp &a) {
@@ -849,7 +996,7 @@ void trainset::eval_acp(std::ostream &os, const acp &a) {
   if (!isdefined())
     throw std::runtime_error("The training set needs to be defined before using TRAINING EVAL");
 
-  if (complete == c_unknown)
+  if (complete == c_unknown || complete_version != data_version())
     describe(os,false,true,true);
   if (complete == c_no)
     throw std::runtime_error("The training set needs to be complete before using TRAINING EVAL");
@@ -948,35 +1095,12 @@ ORDER BY Training_set.id;
   }
 
   // get the ACP contribution
-  st.recycle(R"SQL(
-SELECT length(Terms.value), Terms.value
-FROM Terms, Training_set
-WHERE Terms.methodid = :METHOD AND Terms.zatom = :ZATOM AND Terms.symbol = :SYMBOL AND Terms.l = :L AND Terms.exponent = :EXP 
-      AND Terms.exprn = :EXPRN AND Terms.propid = Training_set.propid
-ORDER BY Training_set.id;
-)SQL");
-  for (int i = 0; i < a.size(); i++){
-    acp::term t = a.get_term(i);
-    st.reset();
-    st.bind((char *) ":METHOD",emptyid);
-    st.bind((char *) ":ZATOM",(int) t.atom);
-    st.bind((char *) ":SYMBOL",std::string(t.sym));
-    st.bind((char *) ":L",(int) t.l);
-    st.bind((char *) ":EXP",t.exp);
-    st.bind((char *) ":EXPRN",t.exprn);
-
-    n = 0;
-    while (st.step() != SQLITE_DONE){
-      int nitem = sqlite3_column_int(st.ptr(),0) / sizeof(double);
-      double *rval = (double *) sqlite3_column_blob(st.ptr(),1);
-      for (int j = 0; j < nitem; j++)
-	yacp[n++] += rval[j] * t.coef;
-    }
-    if (n != nall){
-      std::cout << "exponent: " << t.exp << "exprn: " << t.exprn << " atom: " << (int) t.atom << " sym: " << t.sym << " l: " << (int) t.l
-		<< " method: " << emptyid << " n: " << n << " nall: " << nall << std::endl;
-      throw std::runtime_error("In TRAINING EVAL, unexpected end of the database column in ACP term number " + std::to_string(i));
-    }
+  if (a.size() > 0){
+    std::unordered_multimap<int,unsigned long int> offset;
+    if (column_layout(offset,false) != nall)
+      throw std::runtime_error("In TRAINING EVAL, inconsistent number of items in the training set layout");
+    if (add_acp_column(a,offset,yacp) != nall)
+      throw std::runtime_error("In TRAINING EVAL, unexpected end of the database column in the ACP terms");
   }
 
   // calculate statistics
@@ -1117,7 +1241,7 @@ WHERE Properties.id = Training_set.propid;
     // CALC
 
     // check that the mini-training set is complete
-    if (complete == c_unknown)
+    if (complete == c_unknown || complete_version != data_version())
       describe(os,false,true,true);
     if (complete == c_no)
       throw std::runtime_error("The training set needs to be complete before using TRAINING MAXCOEF");
@@ -1137,31 +1261,63 @@ WHERE Properties.id = Training_set.propid;
       throw std::runtime_error("Invalid SOURCE file in TRAINING MAXCOEF (not a file)");
     std::unordered_map<std::string,std::vector<double>> datmap = read_data_file_vector(file,1.);
 
-    // verify the number of entries and decide whether the user gives the empty or not
-    int ntotal = 0;
+    // Position of the entries for each structure in the source
+    // file. The entries are either for all the terms or only for the
+    // atoms present in the structure (WRITE skips the rest), in both
+    // cases optionally preceded by the empty calculation. The terms
+    // of the missing atoms use the empty calculation.
+    int nblock = 0, ntotal = 0;
     for (int i = 0; i < zat.size(); i++)
       for (int il = 0; il <= lmax[i]; il++)
-	ntotal += exp.size() * coef.size();
-    int ncoef = 0;
-    for (auto it = datmap.begin(); it != datmap.end(); it++){
-      if (it->second.size() != ntotal && it->second.size() != ntotal+1){
-	std::cout << "Structure = " << it->first << std::endl;
-	std::cout << "Entries for structure = " << it->second.size() << std::endl;
-	std::cout << "Entries expected = " << ntotal << " or " << ntotal+1 << std::endl;
-	throw std::runtime_error("Invalid number of entries in TRAINING MAXCOEF for structure " + it->first);
-      }
-      if (it->second.size() != ncoef){
-	if (ncoef == 0)
-	  ncoef = it->second.size();
-	else{
-	  std::cout << "Structure = " << it->first << std::endl;
-	  std::cout << "Entries for structure = " << it->second.size() << std::endl;
-	  std::cout << "Entries for previous structures = " << ncoef << std::endl;
-	  throw std::runtime_error("Inconsistent number of entries in TRAINING MAXCOEF");
+	nblock += exp.size();
+    ntotal = nblock * coef.size();
+    statement stzat(db->ptr(),"SELECT zatom FROM Structure_atoms WHERE strid = ?1;");
+    std::unordered_map<std::string,std::vector<int>> startmap;
+    auto entry_start = [&](int strid, const std::string &strname) -> const std::vector<int>& {
+      auto it = startmap.find(strname);
+      if (it != startmap.end())
+	return it->second;
+      if (datmap.find(strname) == datmap.end())
+	throw std::runtime_error("Structure not found in source file: " + strname);
+
+      std::set<int> zs;
+      stzat.reset();
+      stzat.bind(1,strid);
+      while (stzat.step() != SQLITE_DONE)
+	zs.insert(sqlite3_column_int(stzat.ptr(),0));
+      std::vector<bool> present;
+      int nsparse = 0;
+      for (int i = 0; i < zat.size(); i++){
+	for (int il = 0; il <= lmax[i]; il++){
+	  for (int ie = 0; ie < exp.size(); ie++){
+	    present.push_back(zs.find(zat[i]) != zs.end());
+	    if (present.back()) nsparse += coef.size();
+	  }
 	}
       }
-    }
-    bool skipempty = (ncoef == ntotal+1);
+
+      int n = datmap[strname].size();
+      bool sparse = (n != ntotal && n != ntotal+1);
+      if (sparse && n != nsparse && n != nsparse+1){
+	std::cout << "Structure = " << strname << std::endl;
+	std::cout << "Entries for structure = " << n << std::endl;
+	std::cout << "Entries expected = " << ntotal << " or " << ntotal+1 << " (all atoms), "
+		  << nsparse << " or " << nsparse+1 << " (atoms in the structure)" << std::endl;
+	throw std::runtime_error("Invalid number of entries in TRAINING MAXCOEF for structure " + strname);
+      }
+      int k = (sparse ? n - nsparse : n - ntotal); // 1 if the empty calculation is given
+      std::vector<int> &start = startmap[strname];
+      start.resize(nblock,-1);
+      for (int b = 0; b < nblock; b++){
+	if (!sparse || present[b]){
+	  start[b] = k;
+	  k += coef.size();
+	} else if (n == nsparse)
+	  throw std::runtime_error("The empty calculation is required in the SOURCE file for structure " + strname +
+				   ", which is missing some atoms (TRAINING MAXCOEF)");
+      }
+      return start;
+    };
 
     // statements
     statement steval(db->ptr(),R"SQL(
@@ -1229,13 +1385,12 @@ WHERE Properties.id = Training_set.propid AND Properties.id = ?1;
 		stkey.step();
 		std::string name = (char *) sqlite3_column_text(stkey.ptr(), 0);
 		std::string strname = "maxcoef-" + name;
+		int istart = entry_start(str[k],strname)[nbefore / coef.size()];
 		int nthis;
-		if (skipempty)
-		  nthis = nbefore + ic + 1; // +1 to account for the empty calculation
+		if (istart < 0)
+		  nthis = 0; // the atom is not in the structure: empty calculation
 		else
-		  nthis = nbefore + ic;
-		if (datmap.find(strname) == datmap.end())
-		  throw std::runtime_error("Structure not found in source file: " + strname);
+		  nthis = istart + ic;
 		escf += pcoef[k] * datmap[strname][nthis];
 	      }
 	      if (ptid == globals::ppty_energy_difference)
@@ -1316,6 +1471,7 @@ WHERE key = ?1;
   int nsize = sqlite3_column_int(st.ptr(),0);
   const char *ptr = (const char *) sqlite3_column_blob(st.ptr(),1);
   ss.write(ptr,nsize);
+  st.reset();
   cereal::BinaryInputArchive iarchive(ss);
   iarchive(*this);
 
@@ -1328,6 +1484,8 @@ WHERE key = ?1;
   throw std::runtime_error("Cannot use TRAINING SAVE: not compiled with cereal support");
 #endif
   complete = c_unknown;
+  gram_version = -1;
+  create_vtab();
 }
 
 // Delete a training set from the database (or all the t.s.)
@@ -1362,7 +1520,7 @@ void trainset::listdb(std::ostream &os) const {
 }
 
 // Write the octavedump.dat file
-void trainset::dump(std::ostream &os, const std::string &keyw/*=""*/) {
+void trainset::dump(std::ostream &os, const std::unordered_map<std::string,std::string> &kmap) {
   if (!db || !(*db))
     throw std::runtime_error("A database file must be connected before using DUMP");
   if (!isdefined())
@@ -1371,12 +1529,22 @@ void trainset::dump(std::ostream &os, const std::string &keyw/*=""*/) {
   os << "* TRAINING: dumping to an octave file " << std::endl;
 
   // check the completeness of the training set
-  if (complete == c_unknown)
+  if (complete == c_unknown || complete_version != data_version())
     describe(os,false,true,true);
   if (complete == c_no)
     throw std::runtime_error("The training set needs to be complete before using DUMP");
 
   std::ofstream ofile("octavedump.dat",std::ios::trunc | std::ios::binary);
+  bool single = (kmap.find("SINGLE") != kmap.end());
+  bool sketch = (kmap.find("SKETCH") != kmap.end());
+  unsigned long int msketch = 0, seed = 1;
+  if (sketch){
+    if (!isinteger(kmap.at("SKETCH")) || std::stol(kmap.at("SKETCH")) <= 0)
+      throw std::runtime_error("SKETCH in TRAINING DUMP requires a positive number of rows");
+    msketch = std::stoul(kmap.at("SKETCH"));
+    if (kmap.find("SEED") != kmap.end() && !kmap.at("SEED").empty())
+      seed = std::stoul(kmap.at("SEED"));
+  }
 
   // permutation for the additional methods (first fit, then nofit)
   uint64_t nyfit = 0;
@@ -1419,13 +1587,32 @@ WHERE Evaluations.methodid = :METHOD AND Evaluations.propid = :PROPID;
     }
   }
 
-  // write the dimension integers first
+  // sketch of the weighted rows: the dumped rows are the sketched
+  // rows and their weights are one
+  std::vector<uint32_t> bucket;
+  std::vector<double> sign, wsqrt;
+  unsigned long int nout = nrows;
+  if (sketch){
+    nout = sketch_map(nrows,msketch,seed,nullptr,bucket,sign);
+    wsqrt.resize(nrows);
+    for (unsigned long int i = 0; i < nrows; i++)
+      wsqrt[i] = std::sqrt(wtrain[i]);
+  }
+
+  // files with single-precision terms start with a marker, so the
+  // readers can tell them from the double-precision ones
+  if (single){
+    ofile.write(dump_single_marker,8);
+    os << "# Dumped: single precision marker (" << std::string(dump_single_marker,8) << ")" << std::endl;
+  }
+
+  // write the dimension integers
   uint64_t ncols = 0, addmaxl = 0;
   for (int i = 0; i < zat.size(); i++)
     ncols += exp.size() * (lmax[i]+1);
   for (int i = 0; i < addname.size(); i++)
     addmaxl = std::max(addmaxl,(uint64_t) addname[i].size());
-  uint64_t sizes[7] = {zat.size(), exp.size(), nrows, ncols, addid.size(), nyfit, addmaxl};
+  uint64_t sizes[7] = {zat.size(), exp.size(), nout, ncols, addid.size(), nyfit, addmaxl};
   ofile.write((const char *) &sizes,7*sizeof(uint64_t));
   os << "# Dumped: " << 7 << " size integers " << std::endl;
 
@@ -1474,43 +1661,50 @@ WHERE Evaluations.methodid = :METHOD AND Evaluations.propid = :PROPID;
   os << "# Dumped: " << exprn.size() << " exponent r^n" << std::endl;
 
   // write the w vector
+  if (sketch)
+    wtrain.assign(nout,1.0);
   const double *w_c = wtrain.data();
   ofile.write((const char *) w_c,wtrain.size()*sizeof(double));
   os << "# Dumped: " << wtrain.size() << " weights" << std::endl;
 
   // write the x matrix
-  st.recycle(R"SQL(
-SELECT length(Terms.value), Terms.value
-FROM Terms, Training_set
-WHERE Terms.methodid = :METHOD AND Terms.zatom = :ZATOM AND Terms.symbol = :SYMBOL AND Terms.l = :L AND Terms.exponent = :EXP
-      AND Terms.exprn = :EXPRN AND Terms.propid = Training_set.propid AND Training_set.isfit IS NOT NULL
-ORDER BY Training_set.id;
-)SQL");
+  std::unordered_multimap<int,unsigned long int> offset;
+  if (column_layout(offset,true) != nrows)
+    throw std::runtime_error("Inconsistent number of rows in the training set layout dumping terms data");
+  std::vector<double> col(nrows), colk(sketch?nout:0);
+  std::vector<float> colf(single?nout:0);
+  st.recycle(term_column_fit_sql);
   for (int iz = 0; iz < zat.size(); iz++){
     for (int il = 0; il <= lmax[iz]; il++){
       for (int ie = 0; ie < exp.size(); ie++){
-	st.reset();
-	st.bind((char *) ":METHOD",emptyid);
-	st.bind((char *) ":ZATOM",(int) zat[iz]);
-	st.bind((char *) ":SYMBOL",symbol[iz]);
-	st.bind((char *) ":L",il);
-	st.bind((char *) ":EXP",exp[ie]);
-	st.bind((char *) ":EXPRN",exprn[ie]);
-	int n = 0;
-	while (st.step() != SQLITE_DONE){
-	  int len = sqlite3_column_int(st.ptr(),0) / sizeof(double);
-	  double *value = (double *) sqlite3_column_blob(st.ptr(),1);
-	  n += len;
-	  if (n > nrows)
-	    throw std::runtime_error("Too many rows dumping terms data");
-	  ofile.write((const char *) value,len * sizeof(double));
-	}
+	std::fill(col.begin(),col.end(),0.0);
+	unsigned long int n = add_term_column(st,offset,(int) zat[iz],symbol[iz],il,exp[ie],exprn[ie],1.0,col);
+	if (n > nrows)
+	  throw std::runtime_error("Too many rows dumping terms data");
 	if (n != nrows)
 	  throw std::runtime_error("Too few rows dumping terms data. Is the training data complete?");
+	const double *xout = col.data();
+	if (sketch){
+	  for (unsigned long int i = 0; i < nrows; i++)
+	    col[i] *= wsqrt[i];
+	  sketch_vector(col.data(),bucket,sign,nout,colk.data());
+	  xout = colk.data();
+	}
+	if (single){
+	  for (unsigned long int i = 0; i < nout; i++)
+	    colf[i] = (float) xout[i];
+	  ofile.write((const char *) colf.data(),nout * sizeof(float));
+	} else
+	  ofile.write((const char *) xout,nout * sizeof(double));
       }
     }
   }
-  os << "# Dumped: terms (x) with " << nrows << " rows and " << ncols << " columns" << std::endl;
+  os << "# Dumped: terms (x) with " << nout << " rows and " << ncols << " columns";
+  if (single)
+    os << " (single precision)";
+  if (sketch)
+    os << " (sketched from " << nrows << " rows, seed = " << seed << ")";
+  os << std::endl;
 
   // write the yref, yempty, and yadd columns
   st.recycle(R"SQL(
@@ -1529,19 +1723,27 @@ ORDER BY Training_set.id;
     while (st.step() != SQLITE_DONE){
       int len = sqlite3_column_int(st.ptr(),0) / sizeof(double);
       double *value = (double *) sqlite3_column_blob(st.ptr(),1);
-      n += len;
-      if (n > nrows)
+      if (n + len > nrows)
 	throw std::runtime_error("Too many rows dumping y data");
-      ofile.write((const char *) value,len * sizeof(double));
+      if (sketch){
+	for (int k = 0; k < len; k++)
+	  col[n+k] = value[k] * wsqrt[n+k];
+      } else
+	ofile.write((const char *) value,len * sizeof(double));
+      n += len;
     }
     if (n != nrows)
       throw std::runtime_error("Too few rows dumping y data");
+    if (sketch){
+      sketch_vector(col.data(),bucket,sign,nout,colk.data());
+      ofile.write((const char *) colk.data(),nout * sizeof(double));
+    }
   }
-  os << "# Dumped: evaluations (y) for " << ids.size() << " methods with " << nrows << " items each" << std::endl;
+  os << "# Dumped: evaluations (y) for " << ids.size() << " methods with " << nout << " items each" << std::endl;
 
   // write the maxcoef vector
   std::vector<double> maxc;
-  if (keyw != "NOMAXCOEF"){
+  if (kmap.find("NOMAXCOEF") == kmap.end()){
     st.recycle(R"SQL(
 SELECT MIN(Terms.maxcoef)
 FROM Terms, Training_set
@@ -1585,57 +1787,29 @@ WHERE Terms.methodid = :METHOD AND Terms.zatom = :ZATOM AND Terms.symbol = :SYMB
   os << "# DONE" << std::endl << std::endl;
 }
 
-// Generate an ACP
-void trainset::generate(std::ostream &os, const bool maxcoef0, const std::vector<double> lambdav){
-
-#ifndef LASSO_LIB
-  throw std::runtime_error("Cannot use TRAINING GENERATE without linking the external LASSO library.");
-  return;
-#else
-
-  os << "* TRAINING: generating ACPs " << std::endl << std::endl;
-
-  // build the lambda list
-  std::vector<double> lam;
-  double ini, end, step;
-  if (lambdav.size() == 0 || lambdav.size() > 3)
-    throw std::runtime_error("Incorrect number of elements in TRAINING GENERATE");
-  ini = lambdav[0];
-  if (lambdav.size() > 1)
-    end = lambdav[1];
-  else
-    end = ini;
-  if (lambdav.size() > 2)
-    step = lambdav[2];
-  else
-    step = 1;
-  for (double d = ini; d <= end; d += step)
-    lam.push_back(d);
-  if (lam.empty()) return;
-
-  // check the completeness of the training set
-  if (complete == c_unknown)
-    describe(os,false,true,true);
-  if (complete == c_no)
-    throw std::runtime_error("The training set needs to be complete before using GENERATE");
-
-  //// collect the information for the fit ////
-  // permutation for the additional methods (first fit, then nofit)
-  uint64_t nyfit = 0;
-  std::vector<int> iaddperm;
-  for (int i = 0; i < addid.size(); i++){
-    if (addisfit[i]){
-      iaddperm.push_back(i);
-      nyfit++;
-    }
-  }
-  for (int i = 0; i < addid.size(); i++)
-    if (!addisfit[i]) iaddperm.push_back(i);
+// Build the weighted least-squares problem for the fit, using the
+// properties in the fit only. The term matrix is stored in xs
+// (sparse, dropping the elements with absolute value below thr) if
+// xs is not null, or in x (dense, column-major) otherwise. The
+// target is y = yref - yempty. Both are multiplied by the square
+// root of the weights. If maxcoef, read the maximum coefficients
+// into maxc (empty if not available). If colmask is not null, only
+// the columns with colmask true are used. The precision of xs is
+// not changed. At least one of x and xs must be given. Returns the
+// number of rows.
+unsigned long int trainset::fit_problem(std::vector<double> *x, sparsemat *xs, double thr,
+					std::vector<double> &y, std::vector<double> &maxc, bool maxcoef,
+					const std::vector<bool> *colmask/*=nullptr*/){
+  if (xs)
+    x = nullptr;
+  else if (!x)
+    throw std::runtime_error("No term matrix given to fit_problem");
+
+  // the additional methods are not used in the fit yet
   if (addid.size() > 0)
     throw std::runtime_error("FIXME: additional terms not implemented yet");
 
   // calculate the number of rows and the weights with only the dofit sets
-  // write the yref, yempty, and yadd columns
   statement st(db->ptr(),R"SQL(
 SELECT length(Evaluations.value)
 FROM Evaluations
@@ -1650,7 +1824,7 @@ WHERE Evaluations.methodid = :METHOD AND Evaluations.propid = :PROPID;
 	st.bind((char *) ":METHOD",refid);
 	st.bind((char *) ":PROPID",propid[j]);
 	if (st.step() != SQLITE_ROW)
-	  throw std::runtime_error("Invalid evaluation in octave dump");
+	  throw std::runtime_error("Missing reference evaluation for a property in the fit");
 
 	int len = sqlite3_column_int(st.ptr(),0) / sizeof(double);
 	for (int k = 0; k < len; k++)
@@ -1661,65 +1835,101 @@ WHERE Evaluations.methodid = :METHOD AND Evaluations.propid = :PROPID;
     }
   }
 
-  // the dimension integers
-  uint64_t ncols = 0, addmaxl = 0;
+  // the number of columns
+  uint64_t ncols = 0;
   for (int i = 0; i < zat.size(); i++)
     ncols += exp.size() * (lmax[i]+1);
-  for (int i = 0; i < addname.size(); i++)
-    addmaxl = std::max(addmaxl,(uint64_t) addname[i].size());
+  if (colmask && colmask->size() != ncols)
+    throw std::runtime_error("Inconsistent column mask in the fit");
+  uint64_t nsel = colmask ? std::count(colmask->begin(),colmask->end(),true) : ncols;
 
   // the w vector
   std::vector<double> wsqrt = wtrain;
-  wsqrt.reserve(wtrain.size());
   for (int i = 0; i < wtrain.size(); i++)
     wsqrt[i] = std::sqrt(wtrain[i]);
 
   // the x matrix
-  std::vector<double> x;
-  st.recycle(R"SQL(
-SELECT length(Terms.value), Terms.value
-FROM Terms, Training_set
-WHERE Terms.methodid = :METHOD AND Terms.zatom = :ZATOM AND Terms.symbol = :SYMBOL AND Terms.l = :L AND Terms.exponent = :EXP
-      AND Terms.exprn = :EXPRN AND Terms.propid = Training_set.propid AND Training_set.isfit IS NOT NULL
-ORDER BY Training_set.id;
-)SQL");
+  if (x){
+    x->clear();
+    x->reserve(nrows*nsel);
+  } else
+    xs->clear(nrows,xs->is_single());
+  std::unordered_multimap<int,unsigned long int> offset;
+  if (column_layout(offset,true) != nrows)
+    throw std::runtime_error("Inconsistent number of rows in the training set layout");
+  std::vector<double> col(nrows);
+  st.recycle(term_column_fit_sql);
+  unsigned long int icol = 0;
   for (int iz = 0; iz < zat.size(); iz++){
     for (int il = 0; il <= lmax[iz]; il++){
       for (int ie = 0; ie < exp.size(); ie++){
-	st.reset();
-	st.bind((char *) ":METHOD",emptyid);
-	st.bind((char *) ":ZATOM",(int) zat[iz]);
-	st.bind((char *) ":SYMBOL",symbol[iz]);
-	st.bind((char *) ":L",il);
-	st.bind((char *) ":EXP",exp[ie]);
-	st.bind((char *) ":EXPRN",exprn[ie]);
-	int m = 0;
-	while (st.step() != SQLITE_DONE){
-	  int len = sqlite3_column_int(st.ptr(),0) / sizeof(double);
-	  double *value = (double *) sqlite3_column_blob(st.ptr(),1);
-	  for (int i = 0; i < len; i++)
-	    x.push_back(value[i] * wsqrt[m++]);
-	}
-	if (m != nrows)
+	if (colmask && !(*colmask)[icol++]) continue;
+	std::fill(col.begin(),col.end(),0.0);
+	if (add_term_column(st,offset,(int) zat[iz],symbol[iz],il,exp[ie],exprn[ie],1.0,col) != nrows)
 	  throw std::runtime_error("Too few rows in terms data. Is the training data complete?");
+	if (x)
+	  for (int i = 0; i < nrows; i++)
+	    x->push_back(col[i] * wsqrt[i]);
+	else
+	  xs->add_column(col.data(),thr,wsqrt.data());
       }
     }
   }
-  if (x.size() != nrows*ncols)
+  if (x && x->size() != nrows*nsel)
     throw std::runtime_error("Error count number of terms (nrows*ncols). Is the training data complete?");
 
   // calculate the y = yref - yempty - ynofit
   // crash if there are any yadd columns
-  std::vector<double> y;
-  st.recycle(R"SQL(
+  fit_target(refid,wsqrt,y);
+
+  // the maxcoef vector
+  maxc.clear();
+  if (maxcoef){
+    st.recycle(R"SQL(
+SELECT MIN(Terms.maxcoef)
+FROM Terms, Training_set
+WHERE Terms.methodid = :METHOD AND Terms.zatom = :ZATOM AND Terms.symbol = :SYMBOL AND Terms.l = :L AND Terms.exponent = :EXP
+      AND Terms.exprn = :EXPRN AND Terms.propid = Training_set.propid AND Training_set.isfit IS NOT NULL;
+)SQL");
+    unsigned long int icol = 0;
+    for (int iz = 0; iz < zat.size(); iz++){
+      for (int il = 0; il <= lmax[iz]; il++){
+	for (int ie = 0; ie < exp.size(); ie++){
+	  if (colmask && !(*colmask)[icol++]) continue;
+	  st.reset();
+	  st.bind((char *) ":METHOD",emptyid);
+	  st.bind((char *) ":ZATOM",(int) zat[iz]);
+	  st.bind((char *) ":SYMBOL",symbol[iz]);
+	  st.bind((char *) ":L",il);
+	  st.bind((char *) ":EXP",exp[ie]);
+	  st.bind((char *) ":EXPRN",exprn[ie]);
+	  st.step();
+	  if (sqlite3_column_type(st.ptr(),0) == SQLITE_NULL){
+	    maxc.clear();
+	    return nrows;
+	  }
+	  maxc.push_back(sqlite3_column_double(st.ptr(),0));
+	}
+      }
+    }
+  }
+  return nrows;
+}
+
+// Calculate the target of the fit, y = yref - yempty, with method
+// methodid as the reference, and multiply it by the square root of
+// the weights (wsqrt, one per row).
+void trainset::fit_target(int methodid, const std::vector<double> &wsqrt, std::vector<double> &y){
+  unsigned long int nrows = wsqrt.size(), n = 0;
+  y.clear();
+  statement st(db->ptr(),R"SQL(
 SELECT length(Evaluations.value), Evaluations.value
 FROM Evaluations, Training_set
 WHERE Evaluations.methodid = :METHOD
       AND Evaluations.propid = Training_set.propid AND Training_set.isfit IS NOT NULL
 ORDER BY Training_set.id;
 )SQL");
-  st.bind((char *) ":METHOD",refid);
-  n = 0;
+  st.bind((char *) ":METHOD",methodid);
   while (st.step() != SQLITE_DONE){
     int len = sqlite3_column_int(st.ptr(),0) / sizeof(double);
     double *value = (double *) sqlite3_column_blob(st.ptr(),1);
@@ -1728,7 +1938,7 @@ ORDER BY Training_set.id;
     n += len;
   }
   if (n != nrows)
-    throw std::runtime_error("Too few rows dumping y data");
+    throw std::runtime_error("Wrong number of rows in the reference evaluations for the fit target. Is the training data complete?");
   st.bind((char *) ":METHOD",emptyid);
   n = 0;
   while (st.step() != SQLITE_DONE){
@@ -1740,110 +1950,1003 @@ ORDER BY Training_set.id;
     }
   }
   if (n != nrows)
-    throw std::runtime_error("Too few rows dumping y data");
+    throw std::runtime_error("Wrong number of rows in the empty evaluations for the fit target. Is the training data complete?");
+}
 
-  // the maxcoef vector
-  std::vector<double> maxc;
-  bool maxcoef = false;
-  if (maxcoef0){
-    st.recycle(R"SQL(
-SELECT MIN(Terms.maxcoef)
-FROM Terms, Training_set
-WHERE Terms.methodid = :METHOD AND Terms.zatom = :ZATOM AND Terms.symbol = :SYMBOL AND Terms.l = :L AND Terms.exponent = :EXP
-      AND Terms.exprn = :EXPRN AND Terms.propid = Training_set.propid AND Training_set.isfit IS NOT NULL;
+// For each row of the fit, the index of its set, the index of its
+// property among the properties in the fit, and its weight.
+void trainset::fit_rows(std::vector<int> &rset, std::vector<int> &rprop, std::vector<double> &wrow){
+  statement st(db->ptr(),R"SQL(
+SELECT length(Evaluations.value)
+FROM Evaluations
+WHERE Evaluations.methodid = :METHOD AND Evaluations.propid = :PROPID;
 )SQL");
+  rset.clear();
+  rprop.clear();
+  wrow.clear();
+  int n = 0;
+  for (int i = 0; i < setid.size(); i++){
+    if (!set_dofit[i]) continue;
+    for (int j = set_initial_idx[i]; j < set_final_idx[i]; j++){
+      st.reset();
+      st.bind((char *) ":METHOD",refid);
+      st.bind((char *) ":PROPID",propid[j]);
+      if (st.step() != SQLITE_ROW)
+	throw std::runtime_error("Invalid evaluation in the training set");
+      int len = sqlite3_column_int(st.ptr(),0) / sizeof(double);
+      for (int k = 0; k < len; k++){
+	rset.push_back(i);
+	rprop.push_back(n);
+	wrow.push_back(w[j]);
+      }
+      n++;
+    }
+  }
+}
+
+// Assign the rows of the fit to cross-validation folds: the
+// properties are assigned to the nfold folds in turn or, if cvset,
+// there is one fold per set in the fit. Returns the number of
+// folds.
+int trainset::cv_folds(int nfold, bool cvset, std::vector<int> &fold){
+  std::vector<int> rset, rprop;
+  std::vector<double> wrow;
+  fit_rows(rset,rprop,wrow);
+  unsigned long int nrows = rset.size();
+  fold.resize(nrows);
+  if (cvset){
+    std::vector<int> setfold(setid.size(),-1);
+    nfold = 0;
+    for (int i = 0; i < setid.size(); i++)
+      if (set_dofit[i]) setfold[i] = nfold++;
+    if (nfold < 2)
+      throw std::runtime_error("CVSET in TRAINING GENERATE requires at least two sets in the fit");
+    for (unsigned long int i = 0; i < nrows; i++)
+      fold[i] = setfold[rset[i]];
+  } else {
+    if (nrows == 0 || rprop.back() + 1 < nfold)
+      throw std::runtime_error("More folds than properties in TRAINING GENERATE CV");
+    for (unsigned long int i = 0; i < nrows; i++)
+      fold[i] = rprop[i] % nfold;
+  }
+  return nfold;
+}
+
+// Calculate the normal equations of the fit (gram) reading the term
+// matrix from the database in blocks of consecutive training set
+// entries, so the whole matrix is never in memory. Each block is
+// read column by column into a dense matrix of at most membudget
+// bytes (but at least one entry). y is the weighted target from
+// fit_problem. If fold is not null, also calculate the normal
+// equations of the rows in each of the nfold cross-validation folds
+// (gfold). Returns the number of blocks.
+unsigned long int trainset::stream_gram(double membudget, const std::vector<double> &y,
+					const std::vector<int> *fold, int nfold, std::vector<gramsys> &gfold){
+  std::vector<int> rset, rprop;
+  std::vector<double> wrow;
+  fit_rows(rset,rprop,wrow);
+  unsigned long int nrows = y.size();
+  if (rset.size() != nrows)
+    throw std::runtime_error("Inconsistent number of rows in the training set layout");
+  std::vector<double> wsqrt(nrows);
+  for (unsigned long int i = 0; i < nrows; i++)
+    wsqrt[i] = std::sqrt(wrow[i]);
+  unsigned long int ncols = 0;
+  for (int i = 0; i < zat.size(); i++)
+    ncols += exp.size() * (lmax[i]+1);
+
+  // the entries in the fit and their number of rows
+  statement st(db->ptr(),R"SQL(
+SELECT Training_set.id, length(Evaluations.value)
+FROM Training_set, Evaluations
+WHERE Evaluations.methodid = :METHOD AND Evaluations.propid = Training_set.propid AND Training_set.isfit IS NOT NULL
+ORDER BY Training_set.id;
+)SQL");
+  st.bind((char *) ":METHOD",refid);
+  std::vector<int> ids;
+  std::vector<unsigned long int> len;
+  while (st.step() != SQLITE_DONE){
+    ids.push_back(sqlite3_column_int(st.ptr(),0));
+    len.push_back(sqlite3_column_int(st.ptr(),1) / sizeof(double));
+  }
+
+  // maximum number of rows in a block (the rows of the folds are
+  // copied to a second matrix)
+  unsigned long int maxrows = (unsigned long int) (membudget / (sizeof(double) * std::max(ncols,1ul) * (fold ? 2 : 1)));
+  maxrows = std::max(maxrows,1ul);
+
+  // initialize the normal equations
+  auto gram_zero = [ncols](gramsys &g){
+    g.nrows = 0;
+    g.ncols = ncols;
+    g.G.assign(ncols*ncols,0.);
+    g.xty.assign(ncols,0.);
+    g.yty = 0.;
+  };
+  gram_zero(gram);
+  if (fold){
+    gfold.resize(nfold);
+    for (int f = 0; f < nfold; f++)
+      gram_zero(gfold[f]);
+  }
+
+  // run over the blocks
+  int nth = fit_nthreads();
+  unsigned long int nblock = 0, r0 = 0;
+  std::vector<double> xb, col, xf, yf;
+  std::unordered_multimap<int,unsigned long int> offset;
+  st.recycle(term_column_block_sql);
+  for (unsigned long int i0 = 0; i0 < ids.size(); ){
+    // entries i0 to i1-1, rows r0 to r0+nr-1
+    unsigned long int i1 = i0, nr = 0;
+    while (i1 < ids.size() && (nr == 0 || nr + len[i1] <= maxrows))
+      nr += len[i1++];
+    if (column_layout(offset,true,ids[i0],ids[i1-1]) != nr || r0 + nr > nrows)
+      throw std::runtime_error("Inconsistent number of rows in the training set layout");
+
+    // read the block
+    xb.resize(nr * ncols);
+    col.resize(nr);
+    unsigned long int icol = 0;
     for (int iz = 0; iz < zat.size(); iz++){
       for (int il = 0; il <= lmax[iz]; il++){
 	for (int ie = 0; ie < exp.size(); ie++){
-	  st.reset();
-	  st.bind((char *) ":METHOD",emptyid);
-	  st.bind((char *) ":ZATOM",(int) zat[iz]);
-	  st.bind((char *) ":SYMBOL",symbol[iz]);
-	  st.bind((char *) ":L",il);
-	  st.bind((char *) ":EXP",exp[ie]);
-	  st.bind((char *) ":EXPRN",exprn[ie]);
-	  st.step();
-	  if (sqlite3_column_type(st.ptr(),0) == SQLITE_NULL){
-	    maxc.clear();
-	    goto exit_loop;
-	  }
-	  maxc.push_back(sqlite3_column_double(st.ptr(),0));
+	  std::fill(col.begin(),col.end(),0.0);
+	  if (add_term_column(st,offset,(int) zat[iz],symbol[iz],il,exp[ie],exprn[ie],1.0,col,ids[i0],ids[i1-1]) != nr)
+	    throw std::runtime_error("Too few rows in terms data. Is the training data complete?");
+	  for (unsigned long int i = 0; i < nr; i++)
+	    xb[icol*nr+i] = col[i] * wsqrt[r0+i];
+	  icol++;
 	}
       }
     }
+
+    // accumulate the normal equations
+    gram_add(xb.data(),y.data()+r0,nr,gram,nth);
+    if (fold){
+      for (int f = 0; f < nfold; f++){
+	std::vector<unsigned long int> rows;
+	for (unsigned long int i = 0; i < nr; i++)
+	  if ((*fold)[r0+i] == f) rows.push_back(i);
+	if (rows.empty()) continue;
+	unsigned long int nf = rows.size();
+	xf.resize(nf * ncols);
+	yf.resize(nf);
+	for (unsigned long int j = 0; j < ncols; j++)
+	  for (unsigned long int k = 0; k < nf; k++)
+	    xf[j*nf+k] = xb[j*nr+rows[k]];
+	for (unsigned long int k = 0; k < nf; k++)
+	  yf[k] = y[r0+rows[k]];
+	gram_add(xf.data(),yf.data(),nf,gfold[f],nth);
+      }
+    }
+
+    r0 += nr;
+    i0 = i1;
+    nblock++;
+  }
+  if (r0 != nrows)
+    throw std::runtime_error("Inconsistent number of rows in the training set layout");
+
+  return nblock;
+}
+
+// Build the ACP with the given name from the fit coefficients in
+// beta and write it to the name.acp file. The header contains the
+// number of rows in the fit (nrows), the reference method if ref is
+// not empty, whether the maxcoef were applied, and the wrms.
+acp trainset::write_fit_acp(const std::string &name, const double *beta, unsigned long int nrows, double wrms,
+			    bool maxcoef, const std::string &ref/*=""*/) const{
+  // make the ACP
+  std::vector<acp::term> t;
+  int n = 0;
+  for (int iz = 0; iz < zat.size(); iz++){
+    for (unsigned char il = 0; il <= lmax[iz]; il++){
+      for (int ie = 0; ie < exp.size(); ie++){
+	if (std::abs(beta[n]) > 1e-20){
+	  acp::term t_;
+	  t_.block = iz;
+	  t_.atom = zat[iz];
+	  strcpy(&(t_.sym[0]),symbol[iz].c_str());
+	  t_.l = il;
+	  t_.exp = exp[ie];
+	  t_.exprn = exprn[ie];
+	  t_.coef = beta[n];
+	  t.push_back(t_);
+	}
+	n++;
+      }
+    }
+  }
+  acp a(name,t);
+
+  // generate the ACP
+  std::ofstream fp(name + ".acp");
+  if (!fp.is_open())
+    throw std::runtime_error("Could not open output file: " + name + ".acp");
+
+  // write the ACP header
+  fp << "! This ACP was generated with acpdb" << std::endl
+     << "! Atoms(lmax) ";
+  for (int iz = 0; iz < zat.size(); iz++)
+    fp << nameguess(zat[iz]) << "(" << globals::inttol[lmax[iz]] << ") ";
+  fp << std::endl;
+  fp << "! Exponents: " << std::fixed << std::setprecision(2);
+  for (int ie = 0; ie < exp.size(); ie++)
+    fp << exp[ie] << " ";
+  fp << "! Exponent r^n: ";
+  for (int ie = 0; ie < exprn.size(); ie++)
+    fp << exprn[ie] << " ";
+  fp << std::endl;
+  fp << "! ACP terms in training set: " << a.size() << std::endl;
+  fp << "! Data points in training set: " << nrows << std::endl;
+  if (!ref.empty())
+    fp << "! Reference method: " << ref << std::endl;
+  if (maxcoef)
+    fp << "! Maximum coefficients applied" << std::endl;
+  fp << std::fixed << std::setprecision(4);
+  fp << "! norm-1 = " << a.norm1() << std::endl;
+  fp << "! norm-2 = " << a.norm2() << std::endl;
+  fp << "! norm-inf = " << a.norminf() << std::endl;
+  fp << "! wrms = " << wrms << std::endl;
+
+  // write the ACP body and close
+  a.writeacp_gaussian(fp);
+  fp.close();
+
+  return a;
+}
+
+// Parse the options of TRAINING GENERATE in kmap (see generate),
+// check that they can be used together, and set the options they
+// imply.
+trainset::genopts::genopts(const std::unordered_map<std::string,std::string> &kmap){
+  auto has = [&kmap](const std::string &key){ return kmap.find(key) != kmap.end(); };
+
+  // options that cannot be used together
+  static const std::vector<std::pair<std::string,std::vector<std::string>>> incompatible = {
+    {"SKETCH",{"STREAM"}},
+    {"OMP",{"GRAM","CV","CVSET","STREAM","RIDGE","ENET"}},
+    {"RIDGE",{"ENET"}},
+    {"BOOTSTRAP",{"GRAM","CV","CVSET","STREAM","RIDGE","OMP","SKETCH"}},
+    {"REFERENCE",{"GRAM","CV","CVSET","STREAM","RIDGE","OMP","SKETCH","BOOTSTRAP"}},
+  };
+  for (auto it = incompatible.begin(); it != incompatible.end(); it++)
+    for (auto jt = it->second.begin(); jt != it->second.end(); jt++)
+      if (has(it->first) && has(*jt))
+	throw std::runtime_error(it->first + " and " + *jt + " cannot be used together in TRAINING GENERATE");
+
+  // keywords
+  maxcoef = !has("NOMAXCOEF");
+  sparse = has("SPARSE");
+  single = has("SINGLE");
+  usegram = has("GRAM");
+  screen = has("SCREEN");
+  cvset = has("CVSET");
+  stream = has("STREAM");
+  sketch = has("SKETCH");
+  omp = has("OMP");
+  ridge = has("RIDGE");
+  enet = has("ENET");
+  boot = has("BOOTSTRAP");
+  byrow = has("BYROW");
+  multiref = has("REFERENCE");
+
+  // values
+  if (sparse && !kmap.at("SPARSE").empty())
+    thr = std::stod(kmap.at("SPARSE"));
+  if (has("CV")){
+    nfold = 5;
+    if (!kmap.at("CV").empty()){
+      if (!isinteger(kmap.at("CV")))
+	throw std::runtime_error("Invalid number of folds in TRAINING GENERATE CV");
+      nfold = std::stoi(kmap.at("CV"));
+    }
+    if (nfold < 2)
+      throw std::runtime_error("The number of folds in TRAINING GENERATE CV must be at least 2");
+  }
+  cv = (nfold > 0 || cvset);
+  if (stream && !kmap.at("STREAM").empty())
+    membudget = std::stod(kmap.at("STREAM"));
+  if (stream && membudget <= 0.)
+    throw std::runtime_error("The memory budget in TRAINING GENERATE STREAM must be positive");
+  if (has("SEED") && !kmap.at("SEED").empty())
+    seed = std::stoul(kmap.at("SEED"));
+  if (sketch){
+    if (!isinteger(kmap.at("SKETCH")) || std::stol(kmap.at("SKETCH")) <= 0)
+      throw std::runtime_error("SKETCH in TRAINING GENERATE requires a positive number of rows");
+    msketch = std::stoul(kmap.at("SKETCH"));
+  }
+  if (enet){
+    if (kmap.at("ENET").empty() || !isfloat(kmap.at("ENET")) || std::stod(kmap.at("ENET")) <= 0.)
+      throw std::runtime_error("ENET in TRAINING GENERATE requires a positive ridge penalty");
+    l2 = std::stod(kmap.at("ENET"));
+  }
+  if (boot){
+    nboot = 100;
+    if (!kmap.at("BOOTSTRAP").empty()){
+      if (!isinteger(kmap.at("BOOTSTRAP")))
+	throw std::runtime_error("Invalid number of replicates in TRAINING GENERATE BOOTSTRAP");
+      nboot = std::stoi(kmap.at("BOOTSTRAP"));
+    }
+    if (nboot < 2)
+      throw std::runtime_error("The number of replicates in TRAINING GENERATE BOOTSTRAP must be at least 2");
   }
- exit_loop:
+  if (multiref)
+    refs = list_all_words(kmap.at("REFERENCE"));
+
+  // implied options
+  if (cv || stream || ridge)
+    usegram = true;
+  if (stream || sketch || ridge || omp || multiref)
+    single = false;
+  if (ridge || omp)
+    screen = false;
+#ifndef LASSO_LIB
+  sparse = true;
+#endif
+  if (single || usegram || screen || sketch || omp || enet || boot || multiref) sparse = true;
+}
+
+// Generate ACPs for the lambda values in lambdav (ini, end, step)
+// with the options in kmap.
+void trainset::generate(std::ostream &os, const std::vector<double> &lambdav,
+			const std::unordered_map<std::string,std::string> &kmap){
+  os << "* TRAINING: generating ACPs " << std::endl << std::endl;
+
+  genopts opt(kmap);
+  screening scr;
+  scr.active = opt.screen;
 
-  printf(" Id      lambda      norm-1      norm-2      norm-inf    wrms     nterm  filename\n");
-  std::vector<double> beta;
-  beta.reserve(ncols);
-  // double *beta = new double[ncols];
-  double wrms;
+  // build the lambda list
+  std::vector<double> lam;
+  double ini, end, step;
+  if (lambdav.size() == 0 || lambdav.size() > 3)
+    throw std::runtime_error("Incorrect number of elements in TRAINING GENERATE");
+  ini = lambdav[0];
+  if (lambdav.size() > 1)
+    end = lambdav[1];
+  else
+    end = ini;
+  if (lambdav.size() > 2)
+    step = lambdav[2];
+  else
+    step = 1;
+  for (double d = ini; d <= end; d += step)
+    lam.push_back(d);
+  if (lam.empty()) return;
+
+  // with OMP, the list contains the number of terms in each ACP
+  std::vector<unsigned long int> kv;
+  if (opt.omp){
+    for (int i = 0; i < lam.size(); i++){
+      if (lam[i] < 1. || lam[i] != std::round(lam[i]))
+	throw std::runtime_error("The number of terms in TRAINING GENERATE OMP must be a positive integer");
+      kv.push_back((unsigned long int) lam[i]);
+    }
+  }
+  if (opt.ridge){
+    for (int i = 0; i < lam.size(); i++)
+      if (lam[i] < 0.)
+	throw std::runtime_error("The ridge penalties in TRAINING GENERATE RIDGE must be positive or zero");
+  }
+
+  // check the completeness of the training set
+  if (complete == c_unknown || complete_version != data_version())
+    describe(os,false,true,true);
+  if (complete == c_no)
+    throw std::runtime_error("The training set needs to be complete before using GENERATE");
+
+  // the reference methods for the fits (the training set reference
+  // if none is given)
+  std::vector<std::string> refnames;
+  std::vector<int> refids;
+  if (opt.multiref){
+    std::list<std::string> tokens = opt.refs;
+    if (tokens.empty())
+      tokens.push_back(refname);
+    for (auto it = tokens.begin(); it != tokens.end(); it++){
+      int idx = db->find_id_from_key(*it,"Methods");
+      if (idx == 0)
+	throw std::runtime_error("METHOD identifier not found in database (" + *it + ") in TRAINING GENERATE REFERENCE");
+      if (std::find(refids.begin(),refids.end(),idx) != refids.end())
+	throw std::runtime_error("Repeated METHOD (" + *it + ") in TRAINING GENERATE REFERENCE");
+      refnames.push_back(*it);
+      refids.push_back(idx);
+    }
+  }
+
+  // collect the information for the fit
+  std::vector<double> x, y, maxc, yex;
+  sparsemat xs(0,opt.single), xex;
+  std::vector<gramsys> gfold;
+  int nfold = opt.nfold;
+  unsigned long int nrows = generate_problem(os,opt,x,xs,y,maxc,xex,yex,gfold,nfold);
+  uint64_t ncols = 0;
+  for (int i = 0; i < zat.size(); i++)
+    ncols += exp.size() * (lmax[i]+1);
+
+  // cross-validation: validation wrms along the lambda path
+  if (opt.cv)
+    generate_cv(os,opt,lam,maxc,gfold,nfold);
+
+  // the methods that calculate all the ACPs at once (OMP, ridge, and
+  // the grid of references) leave the coefficients and wrms in bpath
+  // and wpath
+  std::vector<double> bpath, wpath;
+  std::vector<unsigned long int> nscr;
+  if (opt.omp)
+    generate_omp(os,xs,y,kv,maxc,bpath,wpath);
+  if (opt.ridge)
+    generate_ridge(os,lam,maxc,bpath,wpath);
+  if (opt.enet)
+    os << "# Elastic net with ridge penalty = " << opt.l2 << std::endl << std::endl;
+  if (opt.multiref)
+    generate_grid(os,opt,xs,y,lam,maxc,refids,bpath,wpath,nscr);
+
+  // In single precision, the selected terms of each LASSO fit are
+  // refitted in double precision. The path is calculated first, so
+  // the double-precision columns of all the selected terms (and the
+  // targets for all the references) are read only once.
+  bool refit = opt.single && !opt.omp && !opt.ridge;
+  std::vector<bool> umask;
+  sparsemat xu;
+  std::vector<double> yu, maxcu;
+  if (refit){
+    if (bpath.empty()){
+      std::vector<double> beta(ncols,0.0);
+      double wrms;
+      for (unsigned long int i = 0; i < lam.size(); i++){
+	if (opt.usegram)
+	  lasso_gram(gram,lam[i],beta.data(),&wrms,maxc.empty()?NULL:maxc.data(),&scr,opt.l2);
+	else
+	  lasso_cd(xs,y.data(),lam[i],beta.data(),&wrms,maxc.empty()?NULL:maxc.data(),&scr,opt.l2);
+	bpath.insert(bpath.end(),beta.begin(),beta.end());
+	wpath.push_back(wrms);
+	if (scr.active) nscr.push_back(scr.nscreened());
+      }
+    }
+    umask.assign(ncols,false);
+    for (unsigned long int k = 0; k < bpath.size(); k++)
+      if (bpath[k] != 0.) umask[k % ncols] = true;
+    if (std::find(umask.begin(),umask.end(),true) != umask.end()){
+      fit_problem(nullptr,&xu,opt.thr,yu,maxcu,opt.maxcoef,&umask);
+      if (opt.multiref){
+	std::vector<double> wsqrt, yr;
+	std::vector<int> rset, rprop;
+	fit_rows(rset,rprop,wsqrt);
+	for (unsigned long int k = 0; k < wsqrt.size(); k++)
+	  wsqrt[k] = std::sqrt(wsqrt[k]);
+	std::vector<double> y0 = yu;
+	yu.clear();
+	for (int r = 0; r < refids.size(); r++){
+	  if (refids[r] == refid)
+	    yr = y0;
+	  else
+	    fit_target(refids[r],wsqrt,yr);
+	  yu.insert(yu.end(),yr.begin(),yr.end());
+	}
+      }
+    }
+  }
+
+  // the ACPs, by reference and then by lambda
+  int wref = 9;
+  for (int r = 0; r < refnames.size(); r++)
+    wref = std::max(wref,(int) refnames[r].size());
+  printf(" Id  ");
+  if (opt.multiref) printf("%-*s  ",wref,"reference");
+  printf(opt.omp ? "         k" : "    lambda");
+  printf("      norm-1      norm-2      norm-inf    wrms     nterm  ");
+  if (scr.active) printf("screened  ");
+  if (opt.sketch) printf("   sk-wrms  ");
+  printf("filename\n");
+  std::string prefix = opt.omp ? "omp-" : (opt.ridge ? "ridge-" : (opt.enet ? "enet-" : "lasso-"));
+  unsigned long int nacp = (opt.multiref ? refids.size() : 1) * lam.size();
+  std::vector<double> beta(ncols,0.0), ball;
+  std::vector<std::string> names;
+  double wrms, wrmsk = 0., skerr = 0.;
+  for (unsigned long int k = 0; k < nacp; k++){
+    int r = k / lam.size(), i = k % lam.size();
+
+    // run the lasso fit; the internal solver starts from the solution
+    // for the previous lambda
+    if (!bpath.empty()){
+      std::copy(bpath.begin()+k*ncols,bpath.begin()+(k+1)*ncols,beta.begin());
+      wrms = wpath[k];
+    } else if (opt.usegram)
+      lasso_gram(gram,lam[i],beta.data(),&wrms,maxc.empty()?NULL:maxc.data(),&scr,opt.l2);
+    else if (opt.sparse)
+      lasso_cd(xs,y.data(),lam[i],beta.data(),&wrms,maxc.empty()?NULL:maxc.data(),&scr,opt.l2);
+#ifdef LASSO_LIB
+    else
+      lasso_c(nrows,ncols,x.data(),y.data(),lam[i],beta.data(),&wrms,maxc.empty()?NULL:maxc.data());
+#endif
+
+    // in single precision, refit the selected terms in double
+    // precision with the same constraint, starting from the single
+    // precision solution; the columns are taken from the cache
+    std::vector<double> betaout = beta;
+    if (refit){
+      std::vector<bool> colmask;
+      std::vector<double> bsel, maxcsel;
+      for (unsigned long int j = 0, n = 0; j < ncols; j++){
+	if (!umask[j]) continue;
+	colmask.push_back(beta[j] != 0.);
+	if (beta[j] != 0.){
+	  bsel.push_back(beta[j]);
+	  if (!maxcu.empty()) maxcsel.push_back(maxcu[n]);
+	}
+	n++;
+      }
+      if (!bsel.empty()){
+	sparsemat xsel;
+	xu.colsubset(colmask,xsel);
+	lasso_cd(xsel,yu.data()+(opt.multiref?r*xu.get_nrows():0),lam[i],bsel.data(),&wrms,maxcsel.empty()?NULL:maxcsel.data(),nullptr,opt.l2);
+	for (unsigned long int j = 0, n = 0; j < ncols; j++)
+	  if (beta[j] != 0.) betaout[j] = bsel[n++];
+      }
+    }
+
+    // with a sketch, the wrms is recalculated with the exact problem
+    if (opt.sketch){
+      wrmsk = wrms;
+      wrms = fit_wrms(xex,yex.data(),betaout.data());
+      if (wrms > 0.)
+	skerr = std::max(skerr,std::abs(wrmsk - wrms) / wrms);
+    }
+
+    // make and write the ACP
+    std::string ref = opt.multiref ? refnames[r] : "";
+    std::string name = prefix + (ref.empty() ? "" : ref + "-") + std::to_string(i+1);
+    acp a = write_fit_acp(name,betaout.data(),nrows,wrms,!maxc.empty(),ref);
+    if (opt.boot){
+      ball.insert(ball.end(),betaout.begin(),betaout.end());
+      names.push_back(name);
+    }
+
+    // the output line
+    printf("%4lu  ",k+1);
+    if (opt.multiref) printf("%-*s  ",wref,ref.c_str());
+    if (opt.omp)
+      printf("%10lu  ",kv[i]);
+    else
+      printf("%10.5f  ",lam[i]);
+    printf("%10.5f  %10.5f  %10.5f  %10.5f  %4d  ",a.norm1(),a.norm2(),a.norminf(),wrms,a.size());
+    if (scr.active) printf("%8lu  ",nscr.empty() ? scr.nscreened() : nscr[k]);
+    if (opt.sketch) printf("%10.5f  ",wrmsk);
+    printf("%s.acp\n",name.c_str());
+  }
+  if (opt.sketch)
+    printf("# Largest relative difference between the sketched and the exact wrms = %.5f\n",skerr);
+  printf("\n");
+
+  // bootstrap of each ACP
+  if (opt.boot)
+    generate_bootstrap(os,opt,xs,y,lam,maxc,ball,names);
+}
+
+// Build the problem for GENERATE with the options in opt. The term
+// matrix is in x (dense) or xs (sparse), or only its normal
+// equations are calculated (in gram). The normal equations are
+// reused from the cache if the training set data has not changed.
+unsigned long int trainset::generate_problem(std::ostream &os, const genopts &opt, std::vector<double> &x, sparsemat &xs,
+					     std::vector<double> &y, std::vector<double> &maxc, sparsemat &xex,
+					     std::vector<double> &yex, std::vector<gramsys> &gfold, int &nfold){
+  uint64_t ncols = 0;
+  for (int i = 0; i < zat.size(); i++)
+    ncols += exp.size() * (lmax[i]+1);
+  unsigned long int nrows;
+  bool gramcached = opt.usegram && !opt.sketch && gram_version == data_version() && gram_thr == (opt.stream ? 0. : opt.thr) &&
+    gram_single == opt.single && gram.ncols == ncols;
+  if (gramcached && !opt.cv){
+    // the normal equations are cached; only y and maxc are needed
+    std::vector<bool> colmask(ncols,false);
+    nrows = fit_problem(nullptr,&xs,opt.thr,y,maxc,opt.maxcoef,&colmask);
+    os << "# Normal equations (" << ncols << " x " << ncols << ") for " << nrows
+       << " rows reused from the cache" << std::endl << std::endl;
+  } else if (opt.stream){
+    // read the term matrix in blocks of rows and accumulate the
+    // normal equations, without keeping the matrix in memory
+    std::vector<bool> colmask(ncols,false);
+    nrows = fit_problem(nullptr,&xs,opt.thr,y,maxc,opt.maxcoef,&colmask);
+    std::vector<int> fold;
+    if (opt.cv)
+      nfold = cv_folds(nfold,opt.cvset,fold);
+    unsigned long int nblock = stream_gram(opt.membudget * 1048576.,y,opt.cv?&fold:nullptr,nfold,gfold);
+    gram_version = data_version();
+    gram_thr = 0.;
+    gram_single = false;
+    os << "# Normal equations (" << ncols << " x " << ncols << ") for " << nrows
+       << " rows calculated from " << nblock << " blocks of rows (memory budget = " << opt.membudget
+       << " MB) with " << fit_nthreads() << " threads" << std::endl << std::endl;
+  } else {
+    nrows = fit_problem(opt.sparse?nullptr:&x,opt.sparse?&xs:nullptr,opt.thr,y,maxc,opt.maxcoef);
+    if (opt.sparse)
+      os << "# Sparse term matrix: " << xs.get_nnz() << " non-zero elements out of " << nrows * ncols
+	 << " (density = " << xs.density() << ")" << std::endl;
+    if (opt.single)
+      os << "# Single precision term matrix (" << xs.memory() / 1048576. << " MB); "
+	 << "the selected terms are refitted in double precision" << std::endl;
+
+    // the rows of the cross-validation folds: properties assigned to
+    // the k folds in turn, or one fold per fit set
+    std::vector<int> fold;
+    if (opt.cv){
+      nfold = cv_folds(nfold,opt.cvset,fold);
+      if (fold.size() != nrows)
+	throw std::runtime_error("Inconsistent number of rows in the cross-validation");
+    }
+
+    // sketch the rows of the problem, keeping the exact problem for
+    // the final residuals; the folds are sketched separately
+    if (opt.sketch){
+      std::vector<uint32_t> bucket;
+      std::vector<double> sign;
+      std::vector<int> sfold;
+      unsigned long int mk = sketch_map(nrows,opt.msketch,opt.seed,opt.cv?&fold:nullptr,bucket,sign,opt.cv?&sfold:nullptr);
+      std::swap(xs,xex);
+      std::swap(y,yex);
+      sketch_matrix(xex,bucket,sign,mk,xs);
+      y.resize(mk);
+      sketch_vector(yex.data(),bucket,sign,mk,y.data());
+      if (opt.cv)
+	fold = sfold;
+      os << "# Sketch of the rows (sparse random projection, seed = " << opt.seed << "): " << mk
+	 << " rows from " << nrows << " (" << xs.get_nnz() << " non-zero elements)" << std::endl;
+    }
+
+    if (gramcached)
+      os << "# Normal equations (" << ncols << " x " << ncols << ") for " << nrows
+	 << " rows reused from the cache" << std::endl;
+    else if (opt.usegram){
+      int nth = fit_nthreads();
+      gram_build(xs,y.data(),gram,nth);
+      gram_version = opt.sketch ? -1 : data_version();
+      gram_thr = opt.thr;
+      gram_single = opt.single;
+      os << "# Normal equations (" << ncols << " x " << ncols << ") for " << xs.get_nrows()
+	 << " rows calculated with " << nth << " threads" << std::endl;
+    }
+
+    // normal equations for the cross-validation folds
+    if (opt.cv){
+      gfold.resize(nfold);
+      int nth = fit_nthreads();
+      for (int f = 0; f < nfold; f++){
+	std::vector<bool> mask(y.size());
+	std::vector<double> yf;
+	for (unsigned long int i = 0; i < y.size(); i++){
+	  mask[i] = (fold[i] == f);
+	  if (mask[i]) yf.push_back(y[i]);
+	}
+	sparsemat xf;
+	xs.rowsubset(mask,xf);
+	gram_build(xf,yf.data(),gfold[f],nth);
+      }
+    }
+    if (opt.usegram)
+      xs.clear(0,opt.single);
+    if (opt.sparse)
+      os << std::endl;
+  }
+
+  return nrows;
+}
+
+// Cross-validation of the lambda values in lam for GENERATE, using
+// the cached normal equations and those of the nfold folds (gfold).
+// Print the validation wrms of each lambda and the best lambda.
+void trainset::generate_cv(std::ostream &os, const genopts &opt, const std::vector<double> &lam,
+			   const std::vector<double> &maxc, const std::vector<gramsys> &gfold, int nfold) const{
+  std::vector<double> sse;
+  if (opt.ridge)
+    ridge_gram_cv(gram,gfold,lam,fit_nthreads(),sse);
+  else
+    lasso_gram_cv(gram,gfold,lam,maxc.empty()?NULL:maxc.data(),fit_nthreads(),sse,opt.screen,opt.l2);
+  if (opt.cvset)
+    os << "# Cross-validation leaving out one set at a time (" << nfold << " sets)" << std::endl;
+  else
+    os << "# Cross-validation with " << nfold << " folds (properties assigned to the folds in turn)" << std::endl;
+  printf(" Id      lambda     cv-wrms    fold-min    fold-max\n");
+  int ibest = 0;
+  double cvbest = HUGE_VAL;
+  for (int l = 0; l < lam.size(); l++){
+    double s = 0., fmin = HUGE_VAL, fmax = 0.;
+    for (int f = 0; f < nfold; f++){
+      double sf = sse[f*lam.size()+l];
+      s += sf;
+      fmin = std::min(fmin,std::sqrt(sf));
+      fmax = std::max(fmax,std::sqrt(sf));
+    }
+    s = std::sqrt(s);
+    if (s < cvbest){
+      cvbest = s;
+      ibest = l;
+    }
+    printf("%4d  %10.5f  %10.5f  %10.5f  %10.5f\n",l+1,lam[l],s,fmin,fmax);
+  }
+  printf("# Best lambda = %.5f (Id %d, %s-%d.acp), cv-wrms = %.5f\n\n",lam[ibest],ibest+1,
+	 opt.ridge ? "ridge" : (opt.enet ? "enet" : "lasso"),ibest+1,cvbest);
+}
+
+// Greedy forward selection for GENERATE OMP: the ACPs with the
+// numbers of terms in kv, all in one pass.
+void trainset::generate_omp(std::ostream &os, const sparsemat &xs, const std::vector<double> &y,
+			    const std::vector<unsigned long int> &kv, const std::vector<double> &maxc,
+			    std::vector<double> &bpath, std::vector<double> &wpath) const{
+  unsigned long int nsel = omp_path(xs,y.data(),kv,maxc.empty()?NULL:maxc.data(),bpath,wpath);
+  os << "# Greedy forward selection (OMP): " << nsel << " terms selected" << std::endl << std::endl;
+}
+
+// Ridge regression for GENERATE RIDGE: all the ACPs from one
+// diagonalization of the cached normal equations. The maximum
+// coefficients are not applied, so maxc is cleared.
+void trainset::generate_ridge(std::ostream &os, const std::vector<double> &lam, std::vector<double> &maxc,
+			      std::vector<double> &bpath, std::vector<double> &wpath) const{
+  ridge_gram_path(gram,lam,bpath,wpath);
+  os << "# Ridge regression: eigendecomposition of the normal equations (" << gram.ncols << " x " << gram.ncols
+     << "); the lambda are the ridge penalties";
+  if (!maxc.empty())
+    os << " and the maximum coefficients are not applied";
+  os << std::endl << std::endl;
+  maxc.clear();
+}
+
+// Grid of fits for GENERATE REFERENCE: one ACP for each reference
+// method in refids and lambda in lam, distributed over the threads
+// and sharing the term matrix. The targets of the other references
+// are calculated with the weights of the fit rows. nscr is the
+// number of screened terms in each fit.
+void trainset::generate_grid(std::ostream &os, const genopts &opt, const sparsemat &xs, const std::vector<double> &y,
+			     const std::vector<double> &lam, const std::vector<double> &maxc,
+			     const std::vector<int> &refids, std::vector<double> &bpath, std::vector<double> &wpath,
+			     std::vector<unsigned long int> &nscr){
+  std::vector<double> wsqrt, ys, yr;
+  std::vector<int> rset, rprop;
+  fit_rows(rset,rprop,wsqrt);
+  if (wsqrt.size() != y.size())
+    throw std::runtime_error("Inconsistent number of rows in the fit");
+  for (unsigned long int k = 0; k < wsqrt.size(); k++)
+    wsqrt[k] = std::sqrt(wsqrt[k]);
+  for (int r = 0; r < refids.size(); r++){
+    if (refids[r] == refid)
+      yr = y;
+    else
+      fit_target(refids[r],wsqrt,yr);
+    ys.insert(ys.end(),yr.begin(),yr.end());
+  }
+
+  int nth = fit_nthreads();
+  lasso_grid(xs,ys,lam,maxc.empty()?NULL:maxc.data(),opt.l2,opt.screen,nth,bpath,wpath,nscr);
+  os << "# Grid of fits (reference x lambda): " << refids.size() << " x " << lam.size() << " = "
+     << refids.size() * lam.size() << " ACPs with " << nth << " threads" << std::endl << std::endl;
+}
+
+// Bootstrap of the ACPs for GENERATE BOOTSTRAP, resampling whole
+// properties or data points. ball contains the coefficients of the
+// ACPs fitted with all the data, and names their names.
+void trainset::generate_bootstrap(std::ostream &os, const genopts &opt, const sparsemat &xs, const std::vector<double> &y,
+				  const std::vector<double> &lam, const std::vector<double> &maxc,
+				  const std::vector<double> &ball, const std::vector<std::string> &names){
+  unsigned long int nrows = xs.get_nrows(), ncols = xs.get_ncols();
+  std::vector<int> rset, rprop, group;
+  std::vector<double> wrow;
+  fit_rows(rset,rprop,wrow);
+  if (rset.size() != nrows)
+    throw std::runtime_error("Inconsistent number of rows in the bootstrap");
+  if (opt.byrow){
+    group.resize(nrows);
+    for (unsigned long int k = 0; k < nrows; k++)
+      group[k] = k;
+  } else
+    group = rprop;
+  int nth = fit_nthreads();
+  os << "# Bootstrap with " << opt.nboot << " replicates resampling " << (opt.byrow ? "data points" : "properties")
+     << " (seed = " << opt.seed << ") with " << nth << " threads" << std::endl << std::endl;
   for (int i = 0; i < lam.size(); i++){
-    // run the lasso fit and generate the output line
-    lasso_c(nrows,ncols,x.data(),y.data(),lam[i],beta.data(),&wrms,maxc.empty()?NULL:maxc.data());
+    std::vector<double> bboot;
+    lasso_bootstrap(xs,y.data(),group,opt.nboot,opt.seed,lam[i],ball.data()+i*ncols,maxc.empty()?NULL:maxc.data(),
+		    opt.l2,nth,bboot);
+    bootstrap_report(os,names[i],xs,y,ball.data()+i*ncols,bboot,opt.nboot,rset,wrow);
+  }
+}
 
-    // make the ACP
-    std::string name = "lasso-" + std::to_string(i+1);
-    std::vector<acp::term> t;
-    int n = 0;
-    for (int iz = 0; iz < zat.size(); iz++){
-      for (unsigned char il = 0; il <= lmax[iz]; il++){
-	for (int ie = 0; ie < exp.size(); ie++){
-	  if (std::abs(beta[n]) > 1e-20){
-	    acp::term t_;
-	    t_.block = iz;
-	    t_.atom = zat[iz];
-	    strcpy(&(t_.sym[0]),symbol[iz].c_str());
-	    t_.l = il;
-	    t_.exp = exp[ie];
-	    t_.exprn = exprn[ie];
-	    t_.coef = beta[n];
-	    t.push_back(t_);
-	  }
-	  n++;
+// Print the bootstrap distributions of the coefficients (mean,
+// standard deviation, 95% interval, and fraction of the replicates
+// in which the term is selected) and, for each set in the fit, the
+// 95% interval of its wrms and the mean and maximum half-width of
+// the 95% prediction intervals of its data points (in the units of
+// the property, so without the weight).
+void trainset::bootstrap_report(std::ostream &os, const std::string &name, const sparsemat &x, const std::vector<double> &y,
+				const double *beta, const std::vector<double> &bboot, int nboot,
+				const std::vector<int> &rset, const std::vector<double> &wrow) const{
+  unsigned long int nrows = x.get_nrows(), ncols = x.get_ncols();
+  unsigned long int ilo = (unsigned long int) std::round(0.025 * (nboot-1));
+  unsigned long int ihi = (unsigned long int) std::round(0.975 * (nboot-1));
+  std::vector<double> v(nboot);
+
+  // coefficients
+  os << "# Bootstrap of " << name << ".acp: distribution of the coefficients" << std::endl;
+  printf(" atom  l       exp        coef        mean         std      low-95     high-95   freq\n");
+  unsigned long int n = 0;
+  for (int iz = 0; iz < zat.size(); iz++){
+    for (unsigned char il = 0; il <= lmax[iz]; il++){
+      for (int ie = 0; ie < exp.size(); ie++){
+	int nsel = 0;
+	double mean = 0., sd = 0.;
+	for (int b = 0; b < nboot; b++){
+	  v[b] = bboot[b*ncols+n];
+	  if (v[b] != 0.) nsel++;
+	  mean += v[b];
+	}
+	mean /= nboot;
+	for (int b = 0; b < nboot; b++)
+	  sd += (v[b] - mean) * (v[b] - mean);
+	sd = std::sqrt(sd / (nboot - 1));
+	if (beta[n] != 0. || nsel > 0){
+	  std::sort(v.begin(),v.end());
+	  printf("%5s  %c  %8.4f  %10.5f  %10.5f  %10.5f  %10.5f  %10.5f  %5.3f\n",nameguess(zat[iz]).c_str(),
+		 globals::inttol[il],exp[ie],beta[n],mean,sd,v[ilo],v[ihi],(double) nsel / nboot);
 	}
+	n++;
       }
     }
-    acp a(name,t);
-
-    // generate the ACP
-    std::ofstream fp(name + ".acp");
-    if (!fp.is_open())
-      throw std::runtime_error("Could not open output file: " + name + ".acp");
-
-    // write the ACP header
-    fp << "! This ACP was generated with acpdb" << std::endl
-       << "! Atoms(lmax) ";
-    for (int iz = 0; iz < zat.size(); iz++)
-      fp << nameguess(zat[iz]) << "(" << globals::inttol[lmax[iz]] << ") ";
-    fp << std::endl;
-    fp << "! Exponents: " << std::fixed << std::setprecision(2);
-    for (int ie = 0; ie < exp.size(); ie++)
-      fp << exp[ie] << " ";
-    fp << "! Exponent r^n: ";
-    for (int ie = 0; ie < exprn.size(); ie++)
-      fp << exprn[ie] << " ";
-    fp << std::endl;
-    fp << "! ACP terms in training set: " << a.size() << std::endl;
-    fp << "! Data points in training set: " << nrows << std::endl;
-    if (!maxc.empty())
-      fp << "! Maximum coefficients applied" << std::endl;
-    fp << std::fixed << std::setprecision(4);
-    fp << "! norm-1 = " << a.norm1() << std::endl;
-    fp << "! norm-2 = " << a.norm2() << std::endl;
-    fp << "! norm-inf = " << a.norminf() << std::endl;
-    fp << "! wrms = " << wrms << std::endl;
-
-    // write the ACP body and close
-    a.writeacp_gaussian(fp);
-    fp.close();
-
-    printf("%4d  %10.5f  %10.5f  %10.5f  %10.5f  %10.5f  %4d  %s.acp\n",i+1,lam[i],a.norm1(),
-	   a.norm2(),a.norminf(),wrms,a.size(),name.c_str());
+  }
+
+  // predictions of all replicates
+  std::vector<double> p0(nrows), pb((unsigned long int) nboot * nrows);
+  x.mult(beta,p0.data());
+  for (int b = 0; b < nboot; b++)
+    x.mult(bboot.data()+b*ncols,pb.data()+b*nrows);
+
+  // wrms and prediction intervals for each set
+  os << "# Bootstrap of " << name << ".acp: wrms and 95% prediction intervals of the sets in the fit" << std::endl;
+  printf(" set                   wrms     wrms-lo     wrms-hi     pi-mean      pi-max\n");
+  std::vector<double> sse0(setid.size(),0.), sseb((unsigned long int) nboot * setid.size(),0.);
+  std::vector<double> pisum(setid.size(),0.), pimax(setid.size(),0.);
+  std::vector<unsigned long int> npi(setid.size(),0);
+  for (unsigned long int i = 0; i < nrows; i++){
+    int s = rset[i];
+    sse0[s] += (y[i] - p0[i]) * (y[i] - p0[i]);
+    for (int b = 0; b < nboot; b++){
+      double r = y[i] - pb[b*nrows+i];
+      sseb[b*setid.size()+s] += r * r;
+    }
+    if (wrow[i] > 0.){
+      double ws = std::sqrt(wrow[i]);
+      for (int b = 0; b < nboot; b++)
+	v[b] = pb[b*nrows+i] / ws;
+      std::sort(v.begin(),v.end());
+      double hw = 0.5 * (v[ihi] - v[ilo]);
+      pisum[s] += hw;
+      pimax[s] = std::max(pimax[s],hw);
+      npi[s]++;
+    }
+  }
+  for (int s = 0; s < setid.size(); s++){
+    if (!set_dofit[s]) continue;
+    for (int b = 0; b < nboot; b++)
+      v[b] = std::sqrt(sseb[b*setid.size()+s]);
+    std::sort(v.begin(),v.end());
+    printf(" %-15s  %10.5f  %10.5f  %10.5f  %10.5f  %10.5f\n",setname[s].c_str(),std::sqrt(sse0[s]),
+	   v[ilo],v[ihi],npi[s] > 0 ? pisum[s] / npi[s] : 0.,pimax[s]);
   }
   printf("\n");
-#endif
+}
+
+// Select a subset of the properties in the fit with nearly the same
+// fit quality, by leverage or by D-optimal design on the weighted
+// term matrix, and write it as SUBSET blocks with MASK_ITEMS.
+void trainset::compress(std::ostream &os, const std::vector<double> &nselv,
+			const std::unordered_map<std::string,std::string> &kmap){
+  os << "* TRAINING: compressing the training set " << std::endl << std::endl;
+
+  bool dopt = (kmap.find("DOPT") != kmap.end());
+  if (dopt && kmap.find("LEVERAGE") != kmap.end())
+    throw std::runtime_error("LEVERAGE and DOPT cannot be used together in TRAINING COMPRESS");
+  if (nselv.size() != 1 || nselv[0] <= 0.)
+    throw std::runtime_error("TRAINING COMPRESS requires a positive number or fraction of properties");
+
+  // check the completeness of the training set
+  if (complete == c_unknown || complete_version != data_version())
+    describe(os,false,true,true);
+  if (complete == c_no)
+    throw std::runtime_error("The training set needs to be complete before using COMPRESS");
+
+  // the weighted problem and the property of each row
+  sparsemat xs;
+  std::vector<double> y, maxc;
+  unsigned long int nrows = fit_problem(nullptr,&xs,0.,y,maxc,false);
+  std::vector<int> rset, rprop;
+  std::vector<double> wrow;
+  fit_rows(rset,rprop,wrow);
+  if (rset.size() != nrows || nrows == 0)
+    throw std::runtime_error("Inconsistent number of rows in TRAINING COMPRESS");
+  int nprop = rprop.back() + 1;
+  unsigned long int nsel = (nselv[0] < 1.) ? (unsigned long int) std::ceil(nselv[0] * nprop) :
+    (unsigned long int) std::round(nselv[0]);
+  nsel = std::min(nsel,(unsigned long int) nprop);
+
+  // select the properties
+  int nth = fit_nthreads();
+  gramsys g;
+  gram_build(xs,y.data(),g,nth);
+  std::vector<int> sel;
+  if (dopt)
+    dopt_select(xs,rprop,nsel,sel);
+  else {
+    std::vector<double> h, hprop(nprop,0.);
+    row_leverage(xs,g,h);
+    for (unsigned long int i = 0; i < nrows; i++)
+      hprop[rprop[i]] += h[i];
+    std::vector<int> idx(nprop);
+    for (int k = 0; k < nprop; k++)
+      idx[k] = k;
+    std::stable_sort(idx.begin(),idx.end(),[&](int a, int b){ return hprop[a] > hprop[b]; });
+    sel.assign(idx.begin(),idx.begin()+nsel);
+    std::sort(sel.begin(),sel.end());
+  }
+
+  // least-squares fits with all and with the selected properties,
+  // both evaluated on the whole training set
+  std::vector<bool> rmask(nrows,false), pmask(nprop,false);
+  for (int k = 0; k < sel.size(); k++)
+    pmask[sel[k]] = true;
+  std::vector<double> ysel;
+  for (unsigned long int i = 0; i < nrows; i++){
+    rmask[i] = pmask[rprop[i]];
+    if (rmask[i]) ysel.push_back(y[i]);
+  }
+  sparsemat xsel;
+  xs.rowsubset(rmask,xsel);
+  gramsys gsel;
+  gram_build(xsel,ysel.data(),gsel,nth);
+  std::vector<double> ball, bsel, wdum;
+  ridge_gram_path(g,{0.},ball,wdum);
+  ridge_gram_path(gsel,{0.},bsel,wdum);
+  double wall = fit_wrms(xs,y.data(),ball.data());
+  double wsel = fit_wrms(xs,y.data(),bsel.data());
+
+  os << "# Selected " << sel.size() << " of " << nprop << " properties (" << ysel.size() << " of " << nrows
+     << " data points) by " << (dopt ? "D-optimal design" : "leverage") << std::endl;
+  std::streamsize prec = os.precision();
+  os << "# Least-squares wrms on the whole training set: " << std::fixed << std::setprecision(5)
+     << wall << " (all properties), " << wsel << " (selected properties)" << std::endl;
+  os << std::defaultfloat << std::setprecision(prec);
+  os << "# The MASK_ITEMS below replace the masks of the subsets in the fit; the" << std::endl
+     << "# other keywords (weights, NOFIT, etc.) must be copied from the original" << std::endl
+     << "# subsets. Items are numbered as in the database set." << std::endl;
+
+  // position of each property in its database set, as in MASK_ITEMS
+  statement st(db->ptr(),"SELECT id FROM Properties WHERE setid = ?1 AND property_type = ?2 ORDER BY orderid");
+  int n = 0;
+  for (int i = 0; i < setid.size(); i++){
+    if (!set_dofit[i]) continue;
+    std::unordered_map<int,int> item;
+    st.reset();
+    st.bind(1,setid[i]);
+    st.bind(2,setpptyid[i]);
+    int k = 0;
+    while (st.step() != SQLITE_DONE)
+      item[sqlite3_column_int(st.ptr(),0)] = ++k;
+
+    std::vector<int> items;
+    for (int j = set_initial_idx[i]; j < set_final_idx[i]; j++)
+      if (pmask[n++]) items.push_back(item[propid[j]]);
+    if (items.empty()){
+      os << "# SUBSET " << alias[i] << ": no properties selected" << std::endl;
+      continue;
+    }
+    os << "SUBSET " << alias[i] << std::endl
+       << " SET " << setname[i] << std::endl
+       << " PROPERTY_TYPE " << setpptyid[i] << std::endl
+       << " MASK_ITEMS";
+    for (int k = 0; k < items.size(); k++)
+      os << " " << items[k];
+    os << std::endl << "END" << std::endl;
+  }
+  os << std::endl;
 }
 
 // Write input files or structure files for the training set
@@ -1929,4 +3032,131 @@ void trainset::insert_subset_db(int sid){
   }
   db->commit_transaction();
   complete = c_unknown;
+  gram_version = -1;
+  create_vtab();
+}
+
+// Build the row layout of the training set columns. For each
+// property in the Training_set table, in order, store the offset of
+// its first item (a property may appear more than once). The number
+// of items is taken from the reference evaluations. If fitonly, use
+// only the properties in the fit. Returns the total number of items.
+unsigned long int trainset::column_layout(std::unordered_multimap<int,unsigned long int> &offset, bool fitonly,
+					  int idini/*=-1*/, int idfin/*=-1*/){
+  std::string str = R"SQL(
+SELECT Training_set.propid, length(Evaluations.value)
+FROM Training_set, Evaluations
+WHERE Evaluations.methodid = :METHOD AND Evaluations.propid = Training_set.propid
+)SQL";
+  if (fitonly)
+    str += "      AND Training_set.isfit IS NOT NULL\n";
+  if (idini >= 0)
+    str += "      AND Training_set.id BETWEEN :IDINI AND :IDFIN\n";
+  str += "ORDER BY Training_set.id;";
+
+  statement st(db->ptr(),str);
+  st.bind((char *) ":METHOD",refid);
+  if (idini >= 0){
+    st.bind((char *) ":IDINI",idini);
+    st.bind((char *) ":IDFIN",idfin);
+  }
+  offset.clear();
+  unsigned long int n = 0;
+  while (st.step() != SQLITE_DONE){
+    offset.emplace(sqlite3_column_int(st.ptr(),0),n);
+    n += sqlite3_column_int(st.ptr(),1) / sizeof(double);
+  }
+  return n;
+}
+
+// Add the contribution of ACP a to col in training set order, using
+// the layout from column_layout. The terms columns are multiplied
+// by the ACP coefficients and summed in the database, so only one
+// value per property is read. Returns the number of values read.
+unsigned long int trainset::add_acp_column(const acp &a, const std::unordered_multimap<int,unsigned long int> &offset,
+					   std::vector<double> &col){
+  // write the ACP terms to the temporary table
+  statement st(db->ptr(),R"SQL(
+CREATE TEMP TABLE IF NOT EXISTS Eval_acp (zatom INTEGER, symbol TEXT, l INTEGER, exponent REAL, exprn INTEGER, coef REAL);
+DELETE FROM temp.Eval_acp;
+)SQL");
+  st.execute();
+  st.recycle("INSERT INTO temp.Eval_acp (zatom,symbol,l,exponent,exprn,coef) VALUES(?1,?2,?3,?4,?5,?6);");
+  for (int i = 0; i < a.size(); i++){
+    acp::term t = a.get_term(i);
+    st.reset();
+    st.bind(1,(int) t.atom);
+    st.bind(2,std::string(t.sym));
+    st.bind(3,(int) t.l);
+    st.bind(4,t.exp);
+    st.bind(5,t.exprn);
+    st.bind(6,t.coef);
+    st.step();
+  }
+
+  // sum the terms and place them in the column
+  st.recycle(acp_column_sql);
+  st.bind((char *) ":METHOD",emptyid);
+  st.bind((char *) ":REFMETHOD",refid);
+  unsigned long int n = 0;
+  while (st.step() != SQLITE_DONE){
+    int pid = sqlite3_column_int(st.ptr(),0);
+    if (sqlite3_column_int(st.ptr(),1) != 0)
+      throw std::runtime_error("Missing ACP terms in the database for property with id " + std::to_string(pid));
+    double *value = (double *) sqlite3_column_blob(st.ptr(),2);
+    int len;
+    if (value)
+      len = sqlite3_column_bytes(st.ptr(),2) / sizeof(double);
+    else
+      len = sqlite3_column_int(st.ptr(),3) / sizeof(double);
+    auto range = offset.equal_range(pid);
+    for (auto it = range.first; it != range.second; it++){
+      if (it->second + len > col.size())
+	throw std::runtime_error("Inconsistent number of items in terms column");
+      for (int j = 0; value && j < len; j++)
+	col[it->second + j] += value[j];
+      n += len;
+    }
+  }
+  return n;
+}
+
+// Read the column of the Terms table for the empty method and the
+// given term, multiply by coef, and add it to col in training set
+// order. The rows are read in primary key order, which is also the
+// physical order of the table after REPACK, and placed at the
+// offsets from column_layout, so no sorting is needed. The
+// statement st must hold term_column_sql or
+// term_column_fit_sql. Returns the number of values read.
+unsigned long int trainset::add_term_column(statement &st, const std::unordered_multimap<int,unsigned long int> &offset,
+					    int zatom, const std::string &sym, int l, double ex, int exrn,
+					    double coef, std::vector<double> &col, int idini/*=-1*/, int idfin/*=-1*/){
+  st.reset();
+  st.bind((char *) ":METHOD",emptyid);
+  st.bind((char *) ":ZATOM",zatom);
+  st.bind((char *) ":SYMBOL",sym);
+  st.bind((char *) ":L",l);
+  st.bind((char *) ":EXP",ex);
+  st.bind((char *) ":EXPRN",exrn);
+  st.bind((char *) ":REFMETHOD",refid);
+  if (idini >= 0){
+    st.bind((char *) ":IDINI",idini);
+    st.bind((char *) ":IDFIN",idfin);
+  }
+
+  unsigned long int n = 0;
+  while (st.step() != SQLITE_DONE){
+    int pid = sqlite3_column_int(st.ptr(),0);
+    int len = sqlite3_column_int(st.ptr(),1) / sizeof(double);
+    double *value = (double *) sqlite3_column_blob(st.ptr(),2);
+    auto range = offset.equal_range(pid);
+    for (auto it = range.first; it != range.second; it++){
+      if (it->second + len > col.size())
+	throw std::runtime_error("Inconsistent number of items in terms column");
+      for (int j = 0; value && j < len; j++)
+	col[it->second + j] += coef * value[j];
+      n += len;
+    }
+  }
+  return n;
 }
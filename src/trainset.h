@@ -22,10 +22,13 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <string>
 #include <list>
 #include <vector>
+#include <unordered_map>
 #include <numeric>
 #include <algorithm>
 #include "acp.h"
 #include "sqldb.h"
+#include "sparsemat.h"
+#include "fit.h"
 #include "sqlite3.h"
 #include "config.h"
 #ifdef CEREAL_FOUND
@@ -84,6 +87,11 @@ class trainset {
   // Write training set data to data files in old-style format
   void write_olddat(std::ostream &os, const std::string &directory="./");
 
+  // Data version of the training set, from the versions of the
+  // methods, sets, and terms columns it uses. The completeness of the
+  // training set is checked again if the data version changes.
+  long int data_version();
+
   // Is the training set defined?
   inline bool isdefined() const{
     return (nat > 0) && !setid.empty() && !setpptyid.empty() &&
@@ -112,11 +120,51 @@ class trainset {
   // List training sets from the database
   void listdb(std::ostream &os) const;
 
-  // Write the octavedump.dat file
-  void dump(std::ostream &os, const std::string &keyw="");
-
-  // Generate an ACP
-  void generate(std::ostream &os, const bool maxcoef0, const std::vector<double> lambdav);
+  // Write the octavedump.dat file. Options in kmap: NOMAXCOEF (do
+  // not dump the maximum coefficients), SINGLE (write the term matrix
+  // in single precision, after the ACPDBF32 marker), SKETCH m (write
+  // a random projection of the weighted rows onto m rows), SEED s
+  // (seed for SKETCH).
+  void dump(std::ostream &os, const std::unordered_map<std::string,std::string> &kmap);
+
+  // Generate ACPs for the lambda values in lambdav (ini, end,
+  // step). Options in kmap: NOMAXCOEF (do not use the maximum
+  // coefficients), SPARSE [thr] (sparse term matrix and internal
+  // solver), SINGLE (sparse term matrix in single precision, with a
+  // double precision refit of the selected terms; ignored with
+  // STREAM, SKETCH, RIDGE, OMP and REFERENCE), GRAM (solve using
+  // the normal equations, cached while the training set and its data
+  // do not change), CV [k] (k-fold cross-validation, 5 folds by
+  // default), CVSET (leave-one-set-out cross-validation), SCREEN
+  // (screening of the zero coefficients, ignored with RIDGE and
+  // OMP), STREAM [mem] (normal equations from the term matrix read
+  // in blocks of at most mem MB, 1024 MB by default), SKETCH m
+  // (fit a random projection of the rows onto m rows; with CV, the
+  // rows of each fold are sketched separately),
+  // OMP (greedy forward selection; lambdav is the number of terms,
+  // fitted by least squares), RIDGE (ridge regression; lambdav is
+  // the ridge penalty; the maximum coefficients are not applied),
+  // ENET l2 (elastic net: the LASSO with an additional ridge
+  // penalty l2), BOOTSTRAP [n] (n bootstrap replicates of each
+  // ACP, 100 by default), BYROW (bootstrap resampling the data
+  // points instead of the properties), SEED s (seed for
+  // SKETCH and BOOTSTRAP), REFERENCE [m1 m2 ...] (fit each of the
+  // reference methods into lasso-<method>-<i>.acp, with the
+  // (reference, lambda) grid distributed over the threads).
+  void generate(std::ostream &os, const std::vector<double> &lambdav,
+		const std::unordered_map<std::string,std::string> &kmap);
+
+  // Select a subset of the properties in the fit that gives nearly
+  // the same fit as the whole training set, using the current term
+  // data. nselv contains the number of properties to keep (or the
+  // fraction, if smaller than one). Options in kmap: LEVERAGE
+  // (properties with the largest leverage, the default) or DOPT
+  // (greedy D-optimal design). Writes the least-squares wrms on the
+  // whole training set of the fits to all and to the selected
+  // properties, and the subset definitions with MASK_ITEMS for the
+  // selected properties.
+  void compress(std::ostream &os, const std::vector<double> &nselv,
+		const std::unordered_map<std::string,std::string> &kmap);
 
   // Write input files or structure files for the training set
   // structures. Pass the options other than TRAINING and the ACP to the
@@ -150,18 +198,164 @@ class trainset {
   const std::vector<int> &get_exprn() const { return exprn; };
   const std::vector<std::string> &get_symbol() const { return symbol; };
   const std::vector<std::string> &get_termstring() const { return termstring; };
+  const std::vector<double> &get_w() const { return w; };
+  const int &get_refid() const { return refid; };
+  const int &get_emptyid() const { return emptyid; };
 
  private:
 
   // Insert a subset into the Training_set table
   void insert_subset_db(int sid);
 
+  // Create the Training_matrix virtual table for the current training
+  // set, replacing the previous one (only drop it if the training set
+  // is not defined)
+  void create_vtab();
+
+  // Build the row layout of the training set columns: the offset of
+  // the first item of each property in the Training_set table. If
+  // fitonly, use only the properties in the fit. If idini >= 0, use
+  // only the entries with Training_set.id between idini and
+  // idfin. Returns the total number of items.
+  unsigned long int column_layout(std::unordered_multimap<int,unsigned long int> &offset, bool fitonly,
+				  int idini=-1, int idfin=-1);
+
+  // Add the contribution of an ACP to col in training set order,
+  // using the layout from column_layout. The terms are multiplied by
+  // the ACP coefficients and summed in the database. Returns the
+  // number of values read.
+  unsigned long int add_acp_column(const acp &a, const std::unordered_multimap<int,unsigned long int> &offset,
+				   std::vector<double> &col);
+
+  // Read the column of the Terms table for the empty method and the
+  // given term, multiply by coef, and add it to col in training set
+  // order, using the layout from column_layout. The statement st
+  // must hold the column query. If idini >= 0, bind the range of
+  // Training_set.id for the block query. Returns the number of values
+  // read.
+  unsigned long int add_term_column(statement &st, const std::unordered_multimap<int,unsigned long int> &offset,
+				    int zatom, const std::string &sym, int l, double ex, int exrn,
+				    double coef, std::vector<double> &col, int idini=-1, int idfin=-1);
+
+  // Build the weighted least-squares problem for the fit: the term
+  // matrix (sparse in xs if not null, otherwise dense in x), the
+  // target y, and the maximum coefficients (if maxcoef). Elements of
+  // the sparse matrix below thr are dropped. If colmask is not null,
+  // use only the columns with colmask true. Either x or xs must not
+  // be null. Returns the number of rows.
+  unsigned long int fit_problem(std::vector<double> *x, sparsemat *xs, double thr,
+				std::vector<double> &y, std::vector<double> &maxc, bool maxcoef,
+				const std::vector<bool> *colmask=nullptr);
+
+  // Calculate the target of the fit with method methodid as the
+  // reference (y = yref - yempty), multiplied by the square root of
+  // the weights in wsqrt.
+  void fit_target(int methodid, const std::vector<double> &wsqrt, std::vector<double> &y);
+
+  // For each row of the fit (in the order of fit_problem), the index
+  // of its set (rset), the index of its property among the
+  // properties in the fit (rprop), and its weight (wrow).
+  void fit_rows(std::vector<int> &rset, std::vector<int> &rprop, std::vector<double> &wrow);
+
+  // Assign each row of the fit to a cross-validation fold: nfold
+  // folds with the properties assigned in turn, or one fold per set
+  // if cvset. Returns the number of folds.
+  int cv_folds(int nfold, bool cvset, std::vector<int> &fold);
+
+  // Calculate the normal equations of the fit (gram) reading the
+  // term matrix from the database in blocks of rows of at most
+  // membudget bytes. y is the weighted target. If fold is not null,
+  // also calculate the normal equations for each of the nfold
+  // folds. Returns the number of blocks.
+  unsigned long int stream_gram(double membudget, const std::vector<double> &y,
+				const std::vector<int> *fold, int nfold, std::vector<gramsys> &gfold);
+
+  // Build the ACP from the fit coefficients in beta and write it to
+  // file name.acp, with nrows, wrms, maxcoef, and the reference
+  // method (if not empty) in the header.
+  acp write_fit_acp(const std::string &name, const double *beta, unsigned long int nrows, double wrms,
+		    bool maxcoef, const std::string &ref="") const;
+
+  // Options of TRAINING GENERATE (see generate), including the ones
+  // implied by other options.
+  struct genopts {
+    bool maxcoef, sparse, single, usegram, screen, cv, cvset, stream, sketch,
+      omp, ridge, enet, boot, byrow, multiref;
+    int nfold = 0; // number of CV folds
+    int nboot = 0; // number of bootstrap replicates
+    double thr = 0.; // SPARSE threshold
+    double membudget = 1024.; // STREAM memory budget (MB)
+    double l2 = 0.; // ENET ridge penalty
+    unsigned long int msketch = 0; // SKETCH rows
+    unsigned long int seed = 1; // SKETCH and BOOTSTRAP seed
+    std::list<std::string> refs; // REFERENCE methods
+
+    // Parse and check the options in kmap
+    genopts(const std::unordered_map<std::string,std::string> &kmap);
+  };
+
+  // Build the problem for GENERATE with options opt: the term matrix
+  // (x if dense, xs if sparse, or only its normal equations in gram),
+  // the target y, and the maximum coefficients maxc. With SKETCH, xs
+  // and y are sketched and xex and yex contain the exact problem.
+  // With CV, calculate the normal equations of the folds (gfold) and
+  // update the number of folds (nfold). Returns the number of rows.
+  unsigned long int generate_problem(std::ostream &os, const genopts &opt, std::vector<double> &x, sparsemat &xs,
+				     std::vector<double> &y, std::vector<double> &maxc, sparsemat &xex,
+				     std::vector<double> &yex, std::vector<gramsys> &gfold, int &nfold);
+
+  // Cross-validation of the lambda values in lam and report of the
+  // validation wrms, using gram and the nfold fold normal equations.
+  void generate_cv(std::ostream &os, const genopts &opt, const std::vector<double> &lam,
+		   const std::vector<double> &maxc, const std::vector<gramsys> &gfold, int nfold) const;
+
+  // OMP path with the numbers of terms in kv. Returns the coefficients
+  // (bpath) and wrms (wpath) of all the ACPs.
+  void generate_omp(std::ostream &os, const sparsemat &xs, const std::vector<double> &y,
+		    const std::vector<unsigned long int> &kv, const std::vector<double> &maxc,
+		    std::vector<double> &bpath, std::vector<double> &wpath) const;
+
+  // Ridge path from gram with the penalties in lam. Returns the
+  // coefficients (bpath) and wrms (wpath) of all the ACPs, and clears
+  // maxc.
+  void generate_ridge(std::ostream &os, const std::vector<double> &lam, std::vector<double> &maxc,
+		      std::vector<double> &bpath, std::vector<double> &wpath) const;
+
+  // Grid of LASSO fits for the reference methods in refids and the
+  // lambda values in lam. Returns the coefficients (bpath), wrms
+  // (wpath), and number of screened terms (nscr) of all the ACPs, by
+  // reference and then by lambda.
+  void generate_grid(std::ostream &os, const genopts &opt, const sparsemat &xs, const std::vector<double> &y,
+		     const std::vector<double> &lam, const std::vector<double> &maxc,
+		     const std::vector<int> &refids, std::vector<double> &bpath, std::vector<double> &wpath,
+		     std::vector<unsigned long int> &nscr);
+
+  // Bootstrap of the ACPs with coefficients ball and names names,
+  // fitted to xs and y with the lambda values in lam.
+  void generate_bootstrap(std::ostream &os, const genopts &opt, const sparsemat &xs, const std::vector<double> &y,
+			  const std::vector<double> &lam, const std::vector<double> &maxc,
+			  const std::vector<double> &ball, const std::vector<std::string> &names);
+
+  // Print the distributions of the coefficients and the prediction
+  // intervals for each set in the fit from the nboot bootstrap
+  // replicates (bboot) of the ACP with coefficients beta, fitted to
+  // x and y. rset and wrow are the set and weight of each row.
+  void bootstrap_report(std::ostream &os, const std::string &name, const sparsemat &x, const std::vector<double> &y,
+			const double *beta, const std::vector<double> &bboot, int nboot,
+			const std::vector<int> &rset, const std::vector<double> &wrow) const;
+
   //// Variables ////
 
   sqldb *db; // Database pointer
 
   enum completetype { c_unknown, c_no, c_yes };
   completetype complete = c_unknown; // whether the training set is complete
+  long int complete_version = -1; // data version when complete was calculated
+
+  gramsys gram; // normal equations of the fit, cached for GENERATE GRAM
+  long int gram_version = -1; // data version when gram was calculated
+  double gram_thr = 0.; // sparse threshold used to calculate gram
+  bool gram_single = false; // whether gram was calculated in single precision
 
   int ntot; // Total number of properties in the training set
 
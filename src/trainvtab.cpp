@@ -0,0 +1,359 @@
+/*
+Copyright (c) 2020 Alberto Otero de la Roza <aoterodelaroza@gmail.com>
+
+acpdb is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or (at
+your option) any later version.
+
+acpdb is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "trainvtab.h"
+#include "trainset.h"
+#include "globals.h"
+#include <map>
+#include <algorithm>
+#include <tuple>
+#include <vector>
+#include <string>
+
+// Fixed columns of the virtual table. The term columns come after.
+enum { col_tsid, col_item, col_propid, col_property, col_setid, col_property_type,
+       col_isfit, col_w, col_yref, col_yempty, col_nfixed };
+
+// Bits in idxNum: constraints on setid and property_type passed to
+// the query, and whether the term columns are used.
+enum { idx_setid = 1, idx_property_type = 2, idx_terms = 4 };
+
+// A term: atomic number, symbol, angular momentum, exponent, exprn
+typedef std::tuple<int,std::string,int,double,int> termkey;
+
+// The virtual table. The training set information is taken when the
+// table is created.
+struct tv_vtab {
+  sqlite3_vtab base;
+  sqlite3 *db;
+  int refid, emptyid;
+  std::vector<double> w;
+  std::map<termkey,int> termcol;
+  std::vector<int> termzat; // atomic number for each term column
+  int nterm;
+};
+
+// A cursor on the virtual table.
+struct tv_cursor {
+  sqlite3_vtab_cursor base;
+  sqlite3_stmt *st = nullptr; // properties in the training set
+  sqlite3_stmt *stterm = nullptr; // terms for one property
+  sqlite3_stmt *stzat = nullptr; // atoms in the structures of one property
+  bool eof = true;
+  bool doterms = false;
+  sqlite3_int64 rowid = 0;
+  int item = 0, nitem = 0, nref = 0, nempty = 0;
+  const double *yref = nullptr, *yempty = nullptr;
+  std::vector<std::vector<double> > termval;
+};
+
+// Create or connect to a virtual table
+static int tv_connect(sqlite3 *db, void *paux, int, const char *const *, sqlite3_vtab **ppvtab, char **pzerr){
+  trainset *ts = (trainset *) paux;
+  if (!ts->isdefined()){
+    *pzerr = sqlite3_mprintf("The training set needs to be defined before creating the virtual table");
+    return SQLITE_ERROR;
+  }
+
+  tv_vtab *vt = new tv_vtab();
+  vt->db = db;
+  vt->refid = ts->get_refid();
+  vt->emptyid = ts->get_emptyid();
+  vt->w = ts->get_w();
+
+  // build the schema and the term column map
+  std::string schema = R"SQL(CREATE TABLE x(tsid INTEGER, item INTEGER, propid INTEGER, property TEXT,
+setid INTEGER, property_type INTEGER, isfit INTEGER, w REAL, yref REAL, yempty REAL)SQL";
+  int n = col_nfixed;
+  for (int iz = 0; iz < ts->get_nat(); iz++){
+    std::string sym = ts->get_symbol()[iz];
+    std::string name = sym.substr(0,sym.find(ATSYMBOL_PAD));
+    for (int il = 0; il <= ts->get_lmax()[iz]; il++){
+      for (int ie = 0; ie < ts->get_exp().size(); ie++){
+	vt->termcol[termkey(ts->get_zat()[iz],sym,il,ts->get_exp()[ie],ts->get_exprn()[ie])] = n++;
+	vt->termzat.push_back(ts->get_zat()[iz]);
+	schema += ", \"term_" + name + "_" + globals::inttol[il] + "_" + std::to_string(ie+1) + "\" REAL";
+      }
+    }
+  }
+  schema += ");";
+  vt->nterm = n - col_nfixed;
+
+  int rc = sqlite3_declare_vtab(db,schema.c_str());
+  if (rc != SQLITE_OK){
+    delete vt;
+    return rc;
+  }
+  *ppvtab = &vt->base;
+  return SQLITE_OK;
+}
+
+// Disconnect from or destroy a virtual table
+static int tv_disconnect(sqlite3_vtab *pvtab){
+  delete (tv_vtab *) pvtab;
+  return SQLITE_OK;
+}
+
+// Choose the constraints passed to the query
+static int tv_bestindex(sqlite3_vtab *, sqlite3_index_info *info){
+  int idx = 0, narg = 0;
+  double cost = 1e6;
+  for (int i = 0; i < info->nConstraint; i++){
+    const auto &c = info->aConstraint[i];
+    if (!c.usable || c.op != SQLITE_INDEX_CONSTRAINT_EQ) continue;
+    if (c.iColumn == col_setid && !(idx & idx_setid)){
+      idx |= idx_setid;
+      cost /= 10;
+    } else if (c.iColumn == col_property_type && !(idx & idx_property_type)){
+      idx |= idx_property_type;
+      cost /= 2;
+    } else
+      continue;
+    info->aConstraintUsage[i].argvIndex = ++narg;
+    info->aConstraintUsage[i].omit = 1;
+  }
+
+  // the rows come in tsid order
+  if (info->nOrderBy == 1 && info->aOrderBy[0].iColumn == col_tsid && !info->aOrderBy[0].desc)
+    info->orderByConsumed = 1;
+
+  // whether the terms are needed
+  if (info->colUsed >> col_nfixed){
+    idx |= idx_terms;
+    cost *= 10;
+  }
+
+  info->idxNum = idx;
+  info->estimatedCost = cost;
+  return SQLITE_OK;
+}
+
+// Open a cursor
+static int tv_open(sqlite3_vtab *, sqlite3_vtab_cursor **ppcursor){
+  tv_cursor *cur = new tv_cursor();
+  *ppcursor = &cur->base;
+  return SQLITE_OK;
+}
+
+// Close a cursor
+static int tv_close(sqlite3_vtab_cursor *pcur){
+  tv_cursor *cur = (tv_cursor *) pcur;
+  sqlite3_finalize(cur->st);
+  sqlite3_finalize(cur->stterm);
+  sqlite3_finalize(cur->stzat);
+  delete cur;
+  return SQLITE_OK;
+}
+
+// Read the data for the current property in the cursor
+static int tv_loadprop(tv_cursor *cur){
+  tv_vtab *vt = (tv_vtab *) cur->base.pVtab;
+
+  cur->item = 0;
+  cur->nref = sqlite3_column_bytes(cur->st,6) / sizeof(double);
+  cur->yref = (const double *) sqlite3_column_blob(cur->st,6);
+  cur->nempty = sqlite3_column_bytes(cur->st,7) / sizeof(double);
+  cur->yempty = (const double *) sqlite3_column_blob(cur->st,7);
+  cur->nitem = std::max(1,cur->nref?cur->nref:cur->nempty);
+
+  if (cur->doterms){
+    for (int i = 0; i < vt->nterm; i++)
+      cur->termval[i].clear();
+    sqlite3_reset(cur->stterm);
+    sqlite3_bind_int(cur->stterm,2,sqlite3_column_int(cur->st,1));
+    int rc;
+    while ((rc = sqlite3_step(cur->stterm)) == SQLITE_ROW){
+      termkey key(sqlite3_column_int(cur->stterm,0),std::string((const char *) sqlite3_column_text(cur->stterm,1)),
+		  sqlite3_column_int(cur->stterm,2),sqlite3_column_double(cur->stterm,3),sqlite3_column_int(cur->stterm,4));
+      auto it = vt->termcol.find(key);
+      if (it == vt->termcol.end()) continue;
+      const double *val = (const double *) sqlite3_column_blob(cur->stterm,5);
+      int nval = sqlite3_column_bytes(cur->stterm,5) / sizeof(double);
+      cur->termval[it->second - col_nfixed].assign(val,val+nval);
+    }
+    if (rc != SQLITE_DONE)
+      return rc;
+
+    // the missing terms for atoms not in the structures are zero
+    std::vector<int> zs;
+    sqlite3_reset(cur->stzat);
+    sqlite3_bind_int(cur->stzat,1,sqlite3_column_int(cur->st,1));
+    while ((rc = sqlite3_step(cur->stzat)) == SQLITE_ROW)
+      zs.push_back(sqlite3_column_int(cur->stzat,0));
+    if (rc != SQLITE_DONE)
+      return rc;
+    for (int i = 0; i < vt->nterm; i++){
+      if (cur->termval[i].empty() && std::find(zs.begin(),zs.end(),vt->termzat[i]) == zs.end())
+	cur->termval[i].assign(cur->nitem,0.0);
+    }
+  }
+  return SQLITE_OK;
+}
+
+// Start a query on the virtual table
+static int tv_filter(sqlite3_vtab_cursor *pcur, int idxnum, const char *, int argc, sqlite3_value **argv){
+  tv_cursor *cur = (tv_cursor *) pcur;
+  tv_vtab *vt = (tv_vtab *) cur->base.pVtab;
+
+  // prepare the property query with the constraints
+  std::string sql = R"SQL(
+SELECT Training_set.id, Training_set.propid, Properties.key, Properties.setid, Properties.property_type, Training_set.isfit,
+       Eref.value, Eempty.value
+FROM Training_set
+INNER JOIN Properties ON Properties.id = Training_set.propid
+LEFT OUTER JOIN Evaluations AS Eref ON Eref.propid = Training_set.propid AND Eref.methodid = )SQL" + std::to_string(vt->refid) + R"SQL(
+LEFT OUTER JOIN Evaluations AS Eempty ON Eempty.propid = Training_set.propid AND Eempty.methodid = )SQL" + std::to_string(vt->emptyid) + R"SQL(
+WHERE 1)SQL";
+  int narg = 0;
+  if (idxnum & idx_setid)
+    sql += " AND Properties.setid = ?" + std::to_string(++narg);
+  if (idxnum & idx_property_type)
+    sql += " AND Properties.property_type = ?" + std::to_string(++narg);
+  sql += "\nORDER BY Training_set.id;";
+
+  sqlite3_finalize(cur->st);
+  cur->st = nullptr;
+  int rc = sqlite3_prepare_v2(vt->db,sql.c_str(),-1,&cur->st,nullptr);
+  if (rc != SQLITE_OK)
+    return rc;
+  for (int i = 0; i < argc; i++)
+    sqlite3_bind_value(cur->st,i+1,argv[i]);
+
+  // prepare the terms query
+  cur->doterms = (idxnum & idx_terms);
+  if (cur->doterms){
+    cur->termval.resize(vt->nterm);
+    if (!cur->stterm){
+      rc = sqlite3_prepare_v2(vt->db,"SELECT zatom, symbol, l, exponent, exprn, value FROM Terms WHERE methodid = ?1 AND propid = ?2;",
+			      -1,&cur->stterm,nullptr);
+      if (rc != SQLITE_OK)
+	return rc;
+      sqlite3_bind_int(cur->stterm,1,vt->emptyid);
+    }
+    if (!cur->stzat){
+      rc = sqlite3_prepare_v2(vt->db,R"SQL(
+SELECT DISTINCT Structure_atoms.zatom
+FROM Property_structures
+INNER JOIN Structure_atoms ON Structure_atoms.strid = Property_structures.strid
+WHERE Property_structures.propid = ?1;)SQL",-1,&cur->stzat,nullptr);
+      if (rc != SQLITE_OK)
+	return rc;
+    }
+  }
+
+  // first row
+  cur->rowid = 0;
+  rc = sqlite3_step(cur->st);
+  cur->eof = (rc != SQLITE_ROW);
+  if (rc == SQLITE_ROW)
+    return tv_loadprop(cur);
+  return (rc == SQLITE_DONE) ? SQLITE_OK : rc;
+}
+
+// Advance the cursor to the next item
+static int tv_next(sqlite3_vtab_cursor *pcur){
+  tv_cursor *cur = (tv_cursor *) pcur;
+  cur->rowid++;
+  if (++cur->item < cur->nitem)
+    return SQLITE_OK;
+
+  int rc = sqlite3_step(cur->st);
+  cur->eof = (rc != SQLITE_ROW);
+  if (rc == SQLITE_ROW)
+    return tv_loadprop(cur);
+  return (rc == SQLITE_DONE) ? SQLITE_OK : rc;
+}
+
+// Whether the cursor is past the last row
+static int tv_eof(sqlite3_vtab_cursor *pcur){
+  return ((tv_cursor *) pcur)->eof;
+}
+
+// Value of a column in the current row
+static int tv_column(sqlite3_vtab_cursor *pcur, sqlite3_context *ctx, int i){
+  tv_cursor *cur = (tv_cursor *) pcur;
+  tv_vtab *vt = (tv_vtab *) cur->base.pVtab;
+  int tsid = sqlite3_column_int(cur->st,0);
+
+  switch (i){
+  case col_tsid: sqlite3_result_int(ctx,tsid); break;
+  case col_item: sqlite3_result_int(ctx,cur->item); break;
+  case col_propid: sqlite3_result_value(ctx,sqlite3_column_value(cur->st,1)); break;
+  case col_property: sqlite3_result_value(ctx,sqlite3_column_value(cur->st,2)); break;
+  case col_setid: sqlite3_result_value(ctx,sqlite3_column_value(cur->st,3)); break;
+  case col_property_type: sqlite3_result_value(ctx,sqlite3_column_value(cur->st,4)); break;
+  case col_isfit: sqlite3_result_value(ctx,sqlite3_column_value(cur->st,5)); break;
+  case col_w:
+    if (tsid >= 0 && tsid < vt->w.size())
+      sqlite3_result_double(ctx,vt->w[tsid]);
+    break;
+  case col_yref:
+    if (cur->yref && cur->item < cur->nref)
+      sqlite3_result_double(ctx,cur->yref[cur->item]);
+    break;
+  case col_yempty:
+    if (cur->yempty && cur->item < cur->nempty)
+      sqlite3_result_double(ctx,cur->yempty[cur->item]);
+    break;
+  default:
+    if (cur->doterms && i - col_nfixed < cur->termval.size() && cur->item < cur->termval[i - col_nfixed].size())
+      sqlite3_result_double(ctx,cur->termval[i - col_nfixed][cur->item]);
+  }
+  return SQLITE_OK;
+}
+
+// Row id of the current row
+static int tv_rowid(sqlite3_vtab_cursor *pcur, sqlite3_int64 *prowid){
+  *prowid = ((tv_cursor *) pcur)->rowid;
+  return SQLITE_OK;
+}
+
+// The module
+static sqlite3_module tv_module = {
+  0,             // iVersion
+  tv_connect,    // xCreate
+  tv_connect,    // xConnect
+  tv_bestindex,  // xBestIndex
+  tv_disconnect, // xDisconnect
+  tv_disconnect, // xDestroy
+  tv_open,       // xOpen
+  tv_close,      // xClose
+  tv_filter,     // xFilter
+  tv_next,       // xNext
+  tv_eof,        // xEof
+  tv_column,     // xColumn
+  tv_rowid,      // xRowid
+  nullptr,       // xUpdate
+  nullptr,       // xBegin
+  nullptr,       // xSync
+  nullptr,       // xCommit
+  nullptr,       // xRollback
+  nullptr,       // xFindFunction
+  nullptr,       // xRename
+  nullptr,       // xSavepoint
+  nullptr,       // xRelease
+  nullptr,       // xRollbackTo
+  nullptr,       // xShadowName
+#if SQLITE_VERSION_NUMBER >= 3044000
+  nullptr,       // xIntegrity
+#endif
+};
+
+// Register the acpdb_training virtual table module
+int register_trainvtab(sqlite3 *db, trainset *ts){
+  return sqlite3_create_module_v2(db,"acpdb_training",&tv_module,(void *) ts,nullptr);
+}
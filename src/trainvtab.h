@@ -0,0 +1,51 @@
+/*
+Copyright (c) 2020 Alberto Otero de la Roza <aoterodelaroza@gmail.com>
+
+acpdb is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or (at
+your option) any later version.
+
+acpdb is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TRAINVTAB_H
+#define TRAINVTAB_H
+
+#include "sqlite3.h"
+
+class trainset;
+
+// Register the acpdb_training virtual table module in database
+// connection db. A virtual table created with this module
+// (CREATE VIRTUAL TABLE temp.Training_matrix USING acpdb_training)
+// has one row per item in training set ts and the columns:
+//
+//   tsid           id in the Training_set table
+//   item           item in the property (starting at zero)
+//   propid         property id
+//   property       property key
+//   setid          set id
+//   property_type  property type id
+//   isfit          whether the property is in the fit
+//   w              weight
+//   yref           reference method value
+//   yempty         empty method value
+//   term_<atom>_<l>_<iexp>  one column per term (empty method); zero
+//                  if the atom is not in the structures of the
+//                  property and the term is not in the database
+//
+// The rows are read from the database when the table is queried.
+// Equality constraints on setid and property_type are passed to
+// the underlying query, and the terms are read only if a term
+// column is used. The schema of the table is fixed when it is
+// created. Returns the SQLite error code.
+int register_trainvtab(sqlite3 *db, trainset *ts);
+
+#endif
@@ -0,0 +1,16 @@
+## Compare the least-squares wrms of the selected properties reported
+## by TRAINING COMPRESS (the first one in the first file) with the
+## wrms in the TRAINING EVAL output of the second file. Prints "same"
+## or both values.
+## Usage: awk -f compresscheck.awk compress.out eval.out
+FNR == 1 { nf++ }
+nf == 1 && /\(selected properties\)/ && rep == "" { rep = $(NF-2) }
+nf == 2 && /^# +wrms +=/ { ev = $4 }
+END {
+  if (rep == "" || ev == "")
+    print "unexpected input"
+  else if (rep - ev > 1e-4 || ev - rep > 1e-4)
+    print "different: " rep " " ev
+  else
+    print "same"
+}
@@ -0,0 +1,43 @@
+## Recalculate the CVSET table of TRAINING GENERATE from the ACPs
+## fitted with each set left out (NOFIT). The input is the output of
+## acpdb with the cross-validation table followed by the TRAINING
+## EVAL statistics of the ACPs, one set left out after the other and
+## in the order of the lambda in the table. The squared error of the
+## left-out set is wrmsall^2 - wrms^2. Prints, for each lambda and
+## for the best lambda, whether it agrees with the table.
+## Usage: awk -f cvcheck.awk output
+/cv-wrms +fold-min/ { intable = 1; next }
+intable && NF == 5 { nl++; lam[nl] = $2; cv[nl] = $3; fmin[nl] = $4; fmax[nl] = $5; next }
+intable && /Best lambda/ { intable = 0; best = $5; next }
+/^# +wrms +=/ { w = $4; next }
+/^# +wrmsall +=/ { sse[ne++] = $4 * $4 - w * w; next }
+function differ(a,b){
+  return (a - b > 1e-4 || b - a > 1e-4)
+}
+END {
+  if (nl == 0 || ne == 0 || ne % nl != 0){
+    print "unexpected input"
+    exit
+  }
+  nfold = ne / nl
+  ibest = 0
+  for (l = 1; l <= nl; l++){
+    s = 0
+    mn = -1
+    mx = 0
+    for (f = 0; f < nfold; f++){
+      e = sse[f*nl+l-1]
+      s += e
+      if (mn < 0 || sqrt(e) < mn) mn = sqrt(e)
+      if (sqrt(e) > mx) mx = sqrt(e)
+    }
+    s = sqrt(s)
+    if (ibest == 0 || s < sbest){
+      ibest = l
+      sbest = s
+    }
+    ok = !differ(s,cv[l]) && !differ(mn,fmin[l]) && !differ(mx,fmax[l])
+    printf "lambda = %s: %s\n", lam[l], (ok ? "same" : "different")
+  }
+  printf "best lambda = %s: %s\n", lam[ibest], (lam[ibest] == best ? "same" : "different")
+}
@@ -0,0 +1,32 @@
+## Compare two files field by field, skipping the lines that start
+## with ! (the comments in the ACP files). Numbers are equal if they
+## differ by at most tol; other fields must be identical. Prints
+## "same" or the number of the first line that is different.
+## Usage: awk -v tol=1e-8 -f numcmp.awk file1 file2
+function isnum(s){
+  return s ~ /^[-+]?([0-9]+\.?[0-9]*|\.[0-9]+)([eE][-+]?[0-9]+)?$/
+}
+function differ(a,b){
+  if (isnum(a) && isnum(b))
+    return (a - b > tol || b - a > tol)
+  return a != b
+}
+FNR == 1 { nf++ }
+/^!/ { next }
+nf == 1 { line[++n1] = $0; next }
+{
+  n2++
+  if (bad) next
+  if (n2 > n1) { bad = n2; next }
+  nw = split(line[n2],w)
+  if (nw != NF) { bad = n2; next }
+  for (i = 1; i <= NF; i++)
+    if (differ(w[i],$i)) { bad = n2; next }
+}
+END {
+  if (!bad && n1 != n2) bad = (n1 < n2 ? n1 : n2) + 1
+  if (bad)
+    print "different at line " bad
+  else
+    print "same"
+}